@@ -11,37 +11,502 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <vector>
+#include <array>
 #include <list>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
 #include <fstream>
 #include <sstream>
 #include <cmath>
 #include <iomanip>
 #include <sys/time.h>
+#include <immintrin.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <chrono>
+#include <future>
+#include <atomic>
+#include <functional>
+#include <random>
+#include <charconv>
+#include <cstddef>
+#include <cerrno>
+#include <climits>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <new>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
 
 /* Range Query Configuration */
 float leftBottomPoint[3];
 float rightAbovePoint[3];
 unsigned long numberOfReturnedTuples;
 unsigned long numberOfVisitedNodes;
+unsigned long numberOfBulkAcceptedSubtrees;
+unsigned long numberOfBulkAcceptedTuples;
+unsigned long numberOfRefinedTuples;
+
+/*
+ * The number of allocations that the program has made through operator new,
+ * which --check-allocations reads to verify that repeated searches allocate
+ * nothing.  Array and nothrow allocations are made through this operator too.
+ * The counting operator is compiled only with -DKD_CHECK_ALLOCATIONS, so that
+ * the allocations of other builds cost nothing extra.
+ */
+#ifdef KD_CHECK_ALLOCATIONS
+std::atomic<unsigned long> kdAllocations(0);
+
+void *operator new(size_t size)
+{
+    kdAllocations.fetch_add(1, std::memory_order_relaxed);
+    void *memory = malloc((size > 0) ? size : 1);
+    if (memory == NULL) {
+        throw std::bad_alloc();
+    }
+    return memory;
+}
+
+void operator delete(void *memory) noexcept
+{
+    free(memory);
+}
+
+void operator delete(void *memory, size_t) noexcept
+{
+    free(memory);
+}
+#endif
+
+/* The method that createKdTree uses to find the median tuple at each level of the tree. */
+enum KdBuilder
+{
+    BUILD_PRESORT,  // presort the references on every axis, then partition them at each level
+    BUILD_SELECT,   // select the median of a single reference array at each level
+    BUILD_SAMPLED   // as BUILD_SELECT, but narrow each selection about pivots drawn from a sample
+};
+
+/* The smallest range for which BUILD_SAMPLED draws a sample. */
+#define SAMPLED_SELECT_CUTOFF (4096)
+
+/*
+ * The work of one search of a k-d tree.  When the program is compiled with
+ * -DKD_TRACE, the searches count their work in kdQueryTrace, one per thread,
+ * through the KD_TRACE_* macros; otherwise the macros expand to nothing and
+ * the searches are compiled exactly as without them.
+ */
+struct KdQueryTrace
+{
+    unsigned long visitedNodes;    // nodes and leaf buckets that the search entered
+    unsigned long scannedLeaves;   // leaf buckets whose tuples were compared with the query
+    unsigned long testedTuples;    // tuples compared with the query, in nodes and in leaf buckets
+    unsigned long prunedSubtrees;  // subtrees skipped because they can hold no result
+    unsigned long maxDepth;        // the deepest level entered, with the root at 0
+    
+    KdQueryTrace() : visitedNodes(0), scannedLeaves(0), testedTuples(0), prunedSubtrees(0), maxDepth(0) {}
+    
+    void visit(const long depth)
+    {
+        this->visitedNodes += 1;
+        this->maxDepth = std::max(this->maxDepth, (unsigned long) depth);
+    }
+};
+
+#ifdef KD_TRACE
+thread_local KdQueryTrace kdQueryTrace;
+#define KD_TRACE_VISIT(depth) (kdQueryTrace.visit(depth))
+#define KD_TRACE_SCAN(tuples) (kdQueryTrace.scannedLeaves += 1, kdQueryTrace.testedTuples += (tuples))
+#define KD_TRACE_TEST(tuples) (kdQueryTrace.testedTuples += (tuples))
+#define KD_TRACE_PRUNE(subtrees) (kdQueryTrace.prunedSubtrees += (subtrees))
+#else
+#define KD_TRACE_VISIT(depth) ((void) 0)
+#define KD_TRACE_SCAN(tuples) ((void) 0)
+#define KD_TRACE_TEST(tuples) ((void) 0)
+#define KD_TRACE_PRUNE(subtrees) ((void) 0)
+#endif
+
+/*
+ * A histogram of unsigned values in power-of-two buckets: bucket 0 counts
+ * the zeros and bucket b the values in [2^(b-1), 2^b).  Histograms of
+ * several threads or runs are combined by merge.
+ */
+class KdHistogram
+{
+private:
+    unsigned long buckets[65];
+    unsigned long count, maximum;
+    double sum;
+
+public:
+    KdHistogram() : count(0), maximum(0), sum(0)
+    {
+        std::fill(this->buckets, this->buckets + 65, 0UL);
+    }
+    
+    void add(const unsigned long value)
+    {
+        this->buckets[(value == 0) ? 0 : 64 - __builtin_clzl(value)] += 1;
+        this->count += 1;
+        this->maximum = std::max(this->maximum, value);
+        this->sum += value;
+    }
+    
+    void merge(const KdHistogram& other)
+    {
+        for (long b = 0; b < 65; b++) {
+            this->buckets[b] += other.buckets[b];
+        }
+        this->count += other.count;
+        this->maximum = std::max(this->maximum, other.maximum);
+        this->sum += other.sum;
+    }
+    
+    unsigned long getCount() const
+    {
+        return this->count;
+    }
+    
+    double mean() const
+    {
+        return (this->count > 0) ? this->sum / this->count : 0;
+    }
+    
+    /*
+     * Return an upper bound of the value at a quantile: the largest value of
+     * the bucket that holds it, or the maximum if that is smaller.
+     *
+     * calling parameters:
+     *
+     * q - the quantile, from 0 to 1
+     */
+    unsigned long quantile(const double q) const
+    {
+        const unsigned long rank = (unsigned long) std::ceil(q * this->count);
+        unsigned long seen = 0;
+        for (long b = 0; b < 65; b++) {
+            seen += this->buckets[b];
+            if (seen >= std::max(rank, 1UL)) {
+                return std::min((b == 0) ? 0 : (b == 64) ? ULONG_MAX : (1UL << b) - 1, this->maximum);
+            }
+        }
+        return this->maximum;
+    }
+    
+    /*
+     * Print one tab-separated line: the name, the count, the mean, the bounds
+     * of the median and the 99th percentile, the maximum, then the count of
+     * each bucket that is not empty as lowest-highest:count.
+     */
+    void print(std::ostream& out, const char *name) const
+    {
+        out << name << "\t" << this->count << "\t" << mean() << "\t" << quantile(0.5) << "\t" << quantile(0.99)
+        << "\t" << this->maximum << "\t";
+        for (long b = 0; b < 65; b++) {
+            if (this->buckets[b] > 0) {
+                const unsigned long lowest = (b == 0) ? 0 : 1UL << (b - 1);
+                const unsigned long highest = (b == 0) ? 0 : (b == 64) ? ULONG_MAX : (1UL << b) - 1;
+                out << " " << lowest;
+                if (highest > lowest) {
+                    out << "-" << highest;
+                }
+                out << ":" << this->buckets[b];
+            }
+        }
+        out << "\n";
+    }
+};
+
+/* The histograms of the work and the wall-clock time of a set of searches. */
+struct KdTraceSummary
+{
+    KdHistogram visitedNodes, scannedLeaves, testedTuples, prunedSubtrees, maxDepth, nanoseconds;
+    
+    void add(const KdQueryTrace& trace, const unsigned long wallNanoseconds)
+    {
+        this->visitedNodes.add(trace.visitedNodes);
+        this->scannedLeaves.add(trace.scannedLeaves);
+        this->testedTuples.add(trace.testedTuples);
+        this->prunedSubtrees.add(trace.prunedSubtrees);
+        this->maxDepth.add(trace.maxDepth);
+        this->nanoseconds.add(wallNanoseconds);
+    }
+    
+    void merge(const KdTraceSummary& other)
+    {
+        this->visitedNodes.merge(other.visitedNodes);
+        this->scannedLeaves.merge(other.scannedLeaves);
+        this->testedTuples.merge(other.testedTuples);
+        this->prunedSubtrees.merge(other.prunedSubtrees);
+        this->maxDepth.merge(other.maxDepth);
+        this->nanoseconds.merge(other.nanoseconds);
+    }
+    
+    void print(std::ostream& out, const std::string& title) const
+    {
+        if (this->nanoseconds.getCount() == 0) {
+            return;
+        }
+        out << "\n" << title << "\n" << "per query\tqueries\tmean\tp50 <=\tp99 <=\tmax\thistogram\n";
+        this->visitedNodes.print(out, "visited nodes");
+        this->scannedLeaves.print(out, "scanned leaves");
+        this->testedTuples.print(out, "tested tuples");
+        this->prunedSubtrees.print(out, "pruned subtrees");
+        this->maxDepth.print(out, "max depth");
+        this->nanoseconds.print(out, "wall ns");
+    }
+};
+
+/*
+ * Traces the searches made during its lifetime, normally one query, and adds
+ * their work and wall-clock time to a summary when it is destroyed.  Without
+ * KD_TRACE it does nothing.
+ */
+class KdTraceScope
+{
+#ifdef KD_TRACE
+private:
+    KdTraceSummary& summary;
+    std::chrono::steady_clock::time_point begin;
+
+public:
+    KdTraceScope(KdTraceSummary& s) : summary(s)
+    {
+        kdQueryTrace = KdQueryTrace();
+        this->begin = std::chrono::steady_clock::now();
+    }
+    
+    ~KdTraceScope()
+    {
+        const std::chrono::steady_clock::duration wall = std::chrono::steady_clock::now() - this->begin;
+        this->summary.add(kdQueryTrace, (unsigned long) std::chrono::duration_cast<std::chrono::nanoseconds>(wall).count());
+    }
+#else
+public:
+    KdTraceScope(KdTraceSummary&) {}
+#endif
+};
+
+/*
+ * The time that the builds of k-d trees spent in each phase, in nanoseconds,
+ * which KdPhaseTimer accumulates when the program is compiled with
+ * -DKD_TRACE.  Phases that run concurrently on several threads are summed.
+ */
+struct KdBuildTrace
+{
+    std::atomic<long> presort;    // sorting the references
+    std::atomic<long> dedupe;     // removing the references to duplicate tuples
+    std::atomic<long> partition;  // finding the median of each subtree and linking the nodes
+    std::atomic<long> layout;     // copying the tuples into tree order and computing the subtree bounds
+    
+    KdBuildTrace() : presort(0), dedupe(0), partition(0), layout(0) {}
+    
+    void clear()
+    {
+        this->presort = this->dedupe = this->partition = this->layout = 0;
+    }
+    
+    void print(std::ostream& out) const
+    {
+        out << "Build phases in miliseconds: presort " << this->presort / 1e6 << ", dedupe " << this->dedupe / 1e6
+        << ", partition " << this->partition / 1e6 << ", layout " << this->layout / 1e6 << "\n";
+    }
+};
+KdBuildTrace kdBuildTrace;
+
+/* Adds the time from its construction to its destruction to a phase of kdBuildTrace, with KD_TRACE. */
+class KdPhaseTimer
+{
+#ifdef KD_TRACE
+private:
+    std::atomic<long>& phase;
+    std::chrono::steady_clock::time_point begin;
+
+public:
+    KdPhaseTimer(std::atomic<long>& p) : phase(p), begin(std::chrono::steady_clock::now()) {}
+    
+    ~KdPhaseTimer()
+    {
+        this->phase += (long) std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - this->begin).count();
+    }
+#else
+public:
+    KdPhaseTimer(std::atomic<long>&) {}
+#endif
+};
+
+/*
+ * The shape of a k-d tree: the number of nodes and of leaves at each depth.
+ * A leaf is a node without children or, in the flat tree, a leaf bucket.
+ */
+struct KdTreeShape
+{
+    std::vector<long> nodes;   // the nodes at each depth, leaves included
+    std::vector<long> leaves;  // the leaves at each depth
+    long tuples;               // the tuples in the tree
+    
+    KdTreeShape() : tuples(0) {}
+    
+    void add(const long depth, const bool leaf, const long numTuples)
+    {
+        if (depth >= (long) this->nodes.size()) {
+            this->nodes.resize(depth + 1, 0);
+            this->leaves.resize(depth + 1, 0);
+        }
+        this->nodes[depth] += 1;
+        this->leaves[depth] += leaf ? 1 : 0;
+        this->tuples += numTuples;
+    }
+    
+    /* The depth of the deepest leaf. */
+    long height() const
+    {
+        return (long) this->nodes.size() - 1;
+    }
+    
+    /* The depth of the shallowest leaf divided by that of the deepest, which is 1 for a perfectly balanced tree. */
+    double balance() const
+    {
+        for (long d = 0; d < this->leaves.size(); d++) {
+            if (this->leaves[d] > 0) {
+                return (height() > 0) ? (double) d / height() : 1;
+            }
+        }
+        return 1;
+    }
+    
+    void print(std::ostream& out, const std::string& title) const
+    {
+        long numNodes = 0, numLeaves = 0;
+        double leafDepths = 0;
+        for (long d = 0; d < this->nodes.size(); d++) {
+            numNodes += this->nodes[d];
+            numLeaves += this->leaves[d];
+            leafDepths += (double) d * this->leaves[d];
+        }
+        out << "\n" << title << ": " << this->tuples << " tuples in " << numNodes << " nodes, " << numLeaves
+        << " leaves, height " << height() << ", mean leaf depth " << ((numLeaves > 0) ? leafDepths / numLeaves : 0)
+        << ", balance " << balance() << "\n" << "depth\tnodes\tleaves\n";
+        for (long d = 0; d < this->nodes.size(); d++) {
+            out << d << "\t" << this->nodes[d] << "\t" << this->leaves[d] << "\n";
+        }
+    }
+};
+
+/* The most KdNodes in a tree, whose links are 32-bit offsets within its Arena. */
+#define KD_MAX_NODES (2147483647L)
+
+template <long Dim, typename T> class FixedKdTree;
+
 /* One node of a k-d tree */
 class KdNode
 {
+    friend class KdTree;
+    template <long Dim, typename T> friend class FixedKdTree;
+    
 private:
+    // The children are linked by their offsets within the Arena rather than
+    // by pointers, so that the size of the subtree fits in the 24 bytes of a
+    // node with pointers and no size.
     const float *tuple;
-    KdNode *ltChild,  *gtChild;
+    int32_t ltOffset, gtOffset;  // the offsets of the < and > children from this node, or 0; not modified after createKdTree
+    uint32_t subtreeSize;        // the number of KdNodes in the subtree whose root is this node
     
 public:
     KdNode(const float *t)
     {
         this->tuple = t;
-        this->ltChild = this->gtChild = NULL;
+        this->ltOffset = this->gtOffset = 0;
+        this->subtreeSize = 1;
+    }
+    
+    const KdNode *ltChild() const
+    {
+        return (this->ltOffset == 0) ? NULL : this + this->ltOffset;
+    }
+    
+    const KdNode *gtChild() const
+    {
+        return (this->gtOffset == 0) ? NULL : this + this->gtOffset;
+    }
+    
+private:
+    void setChildren(const KdNode *lt, const KdNode *gt)
+    {
+        this->ltOffset = (lt == NULL) ? 0 : (int32_t) (lt - this);
+        this->gtOffset = (gt == NULL) ? 0 : (int32_t) (gt - this);
     }
+    
 public:
     const float *getTuple() const
     {
         return this->tuple;
     }
     
+    /*
+     * Owns the KdNodes of one k-d tree in a single block, so that the tree is
+     * built without an allocation per node and is freed at once.  The node
+     * that holds the reference at position i of the tree-order reference array
+     * is stored at position i of the block, so the threads that build disjoint
+     * subtrees never contend for it and the block is in the in-order layout.
+     */
+public:
+    class Arena
+    {
+    private:
+        KdNode *nodes;
+        long capacity;
+        
+    public:
+        Arena() : nodes(NULL), capacity(0) {}
+        
+        ~Arena()
+        {
+            release();
+        }
+        
+        Arena(const Arena&) = delete;
+        Arena& operator=(const Arena&) = delete;
+        
+        /*
+         * Free the nodes of the tree, which must no longer be used, and make room
+         * for the nodes of a tree of up to count tuples.
+         */
+        void reserve(const long count)
+        {
+            release();
+            this->nodes = (KdNode *) ::operator new(count * sizeof(KdNode));
+            this->capacity = count;
+        }
+        
+        /* Free the nodes of the tree at once.  KdNode needs no destructor. */
+        void release()
+        {
+            ::operator delete(this->nodes);
+            this->nodes = NULL;
+            this->capacity = 0;
+        }
+        
+        KdNode *create(const long position, const float *tuple)
+        {
+            return new (&this->nodes[position]) KdNode(tuple);
+        }
+        
+        /* Return the bytes of the block. */
+        size_t memoryUsage() const
+        {
+            return this->capacity * sizeof(KdNode);
+        }
+    };
+    
     /*
      * Initialize a reference array by creating references into the coordinates array.
      *
@@ -98,11 +563,12 @@ private:
      * high - the high index of the region of the reference array to sort
      * p - the sorting partition (x, y, z, w...)
      * dim - the number of dimensions
+     * maximumSubmitDepth - the depth of subdivision above which the lower half is sorted by another thread
      * depth - the depth of subdivision
      */
 private:
     static void mergeSort(std::vector<float *> &reference, std::vector<float *>& temporary, const long low, const long high,
-                          const short p, const long dim)
+                          const short p, const long dim, const long maximumSubmitDepth = -1, const long depth = 0)
     {
         long i, j, k;
         
@@ -111,9 +577,18 @@ private:
             // Avoid overflow when calculating the median.
             const long mid = low + ( (high - low) >> 1 );
             
-            // Recursively subdivide the lower and upper halves of the array.
-            mergeSort(reference, temporary, low    , mid , p, dim);
-            mergeSort(reference, temporary, mid + 1, high, p, dim);
+            // Recursively subdivide the lower and upper halves of the array.  The halves
+            // occupy disjoint elements of both arrays, so they may be sorted concurrently.
+            if (depth < maximumSubmitDepth) {
+                std::future<void> lowerHalf = std::async(std::launch::async, [&] {
+                    mergeSort(reference, temporary, low, mid, p, dim, maximumSubmitDepth, depth + 1);
+                });
+                mergeSort(reference, temporary, mid + 1, high, p, dim, maximumSubmitDepth, depth + 1);
+                lowerHalf.get();
+            } else {
+                mergeSort(reference, temporary, low    , mid , p, dim, maximumSubmitDepth, depth + 1);
+                mergeSort(reference, temporary, mid + 1, high, p, dim, maximumSubmitDepth, depth + 1);
+            }
             
             
             // Merge the results for this level of subdivision.
@@ -158,6 +633,63 @@ private:
         return end;
     }
     
+    /*
+     * Partition the reference arrays about the median element of references[0]
+     * and permute them cyclically so that references[0] is sorted on the next
+     * axis for both branches of the tree.
+     *
+     * calling parameters:
+     *
+     * references - a vector< vector<float*> > of pointers to each of the (x, y, z, w...) tuples
+     * temporary - a vector<float*> that is used as a temporary array
+     * start - start element of the reference arrays
+     * end - end element of the reference arrays
+     * median - the element of references[0] about which to partition
+     * dim - the number of dimensions
+     * depth - the depth in the tree
+     * lower - returns the end element of the < branch
+     * upper - returns the end element of the > branch
+     */
+private:
+    static void partitionReferences(std::vector< std::vector<float *> >& references, std::vector<float *>& temporary,
+                                    const long start, const long end, const long median, const long dim, const long depth,
+                                    long& lower, long& upper)
+    {
+        // The axis permutes as x, y, z, w... and addresses the referenced data.
+        const long axis = depth % dim;
+        const float *tuple = references.at(0).at(median);
+        
+        // Copy references[0] to the temporary array before partitioning.
+        for (long i = start; i <= end; i++) {
+            temporary.at(i) = references.at(0).at(i);
+        }
+        
+        // Process each of the other reference arrays in a priori sorted order
+        // and partition it by comparing super keys.  Store the result from
+        // references[i] in references[i-1], thus permuting the reference
+        // arrays.  Skip the element of references[i] that that references
+        // a point that equals the point that is stored in the new k-d node.
+        for (long i = 1; i < dim; i++) {
+            
+            // Process one reference array.  Compare once only.
+            lower = start - 1;
+            upper = median;
+            for (long j = start; j <= end; j++) {
+                float compare = superKeyCompare(references.at(i).at(j), tuple, axis, dim);
+                if (compare < 0) {
+                    references.at(i-1).at(++lower) = references.at(i).at(j);
+                } else if (compare > 0) {
+                    references.at(i-1).at(++upper) = references.at(i).at(j);
+                }
+            }
+        }
+        
+        // Copy the temporary array to references[dim-1] to finish permutation.
+        for (long i = start; i <= end; i++) {
+            references.at(dim - 1).at(i) = temporary.at(i);
+        }
+    }
+    
     /*
      * This function builds a k-d tree by recursively partitioning the
      * reference arrays and adding kdNodes to the tree.  These arrays
@@ -168,42 +700,40 @@ private:
      *
      * references - a vector< vector<long*> > of pointers to each of the (x, y, z, w...) tuples
      * temporary - a vector<long*> that is used as a temporary array
+     * arena - holds the KdNodes, each at the position of its reference
      * start - start element of the reference arrays
      * end - end element of the reference arrays
      * dim - the number of dimensions
+     * maximumSubmitDepth - the depth in the tree above which the < branch is built by another thread
      * depth - the depth in the tree
      *
      * returns: a KdNode pointer to the root of the k-d tree
      */
 private:
-    static KdNode *buildKdTree(std::vector< std::vector<float *> >& references, std::vector<float *>& temporary, const float start,
-                               const float end, const long dim, const long depth)
+    static KdNode *buildKdTree(std::vector< std::vector<float *> >& references, std::vector<float *>& temporary, Arena& arena,
+                               const long start, const long end, const long dim, const long maximumSubmitDepth, const long depth)
     {
         KdNode *node = nullptr;
         
-        // The axis permutes as x, y, z, w... and addresses the referenced data.
-        long axis = depth % dim;
-        
         if (end == start) {
             
             // Only one reference was passed to this function, so add it to the tree.
-            node = new KdNode( references.at(0).at(end) );
+            node = arena.create(end, references.at(0).at(end));
             
         } else if (end == start + 1) {
             
             // Two references were passed to this function in sorted order, so store the start
             // element at this level of the tree and store the end element as the > child.
-            node = new KdNode( references.at(0).at(start) );
-            node->gtChild = new KdNode( references.at(0).at(end) );
+            node = arena.create(start, references.at(0).at(start));
+            node->setChildren(NULL, arena.create(end, references.at(0).at(end)));
             
         } else if (end == start + 2) {
             
             // Three references were passed to this function in sorted order, so
             // store the median element at this level of the tree, store the start
             // element as the < child and store the end element as the > child.
-            node = new KdNode( references.at(0).at(start + 1) );
-            node->ltChild = new KdNode( references.at(0).at(start) );
-            node->gtChild = new KdNode( references.at(0).at(end) );
+            node = arena.create(start + 1, references.at(0).at(start + 1));
+            node->setChildren(arena.create(start, references.at(0).at(start)), arena.create(end, references.at(0).at(end)));
             
         } else if (end > start + 2) {
             
@@ -214,48 +744,32 @@ private:
             const long median = start + ((end - start) / 2);
             
             // Store the median element of references[0] in a new kdNode.
-            node = new KdNode( references.at(0).at(median) );
-            
-            // Copy references[0] to the temporary array before partitioning.
-            for (long i = start; i <= end; i++) {
-                temporary.at(i) = references.at(0).at(i);
-            }
+            node = arena.create(median, references.at(0).at(median));
             
-            // Process each of the other reference arrays in a priori sorted order
-            // and partition it by comparing super keys.  Store the result from
-            // references[i] in references[i-1], thus permuting the reference
-            // arrays.  Skip the element of references[i] that that references
-            // a point that equals the point that is stored in the new k-d node.
-            long lower = 0, upper = 0, lowerSave = 0, upperSave = 0;
-            for (long i = 1; i < dim; i++) {
-                
-                // Process one reference array.  Compare once only.
-                lower = start - 1;
-                upper = median;
-                for (long j = start; j <= end; j++) {
-                    float compare = superKeyCompare(references.at(i).at(j), node->tuple, axis, dim);
-                    if (compare < 0) {
-                        references.at(i-1).at(++lower) = references.at(i).at(j);
-                    } else if (compare > 0) {
-                        references.at(i-1).at(++upper) = references.at(i).at(j);
-                    }
-                }
-                
-                lowerSave = lower;
-                upperSave = upper;
-            }
+            // Partition the other reference arrays about the median element.
+            long lower = 0, upper = 0;
+            partitionReferences(references, temporary, start, end, median, dim, depth, lower, upper);
             
-            // Copy the temporary array to references[dim-1] to finish permutation.
-            for (long i = start; i <= end; i++) {
-                references.at(dim - 1).at(i) = temporary.at(i);
+            // Recursively build the < and > branches of the tree.  The branches occupy
+            // disjoint elements of the reference arrays, so they may be built concurrently.
+            if (depth < maximumSubmitDepth) {
+                std::future<KdNode *> ltFuture = std::async(std::launch::async, [&] {
+                    return buildKdTree(references, temporary, arena, start, lower, dim, maximumSubmitDepth, depth+1);
+                });
+                KdNode *gtChild = buildKdTree(references, temporary, arena, median+1, upper, dim, maximumSubmitDepth, depth+1);
+                node->setChildren(ltFuture.get(), gtChild);
+            } else {
+                KdNode *ltChild = buildKdTree(references, temporary, arena, start, lower, dim, maximumSubmitDepth, depth+1);
+                KdNode *gtChild = buildKdTree(references, temporary, arena, median+1, upper, dim, maximumSubmitDepth, depth+1);
+                node->setChildren(ltChild, gtChild);
             }
             
-            // Recursively build the < branch of the tree.
-            node->ltChild = buildKdTree(references, temporary, start, lower, dim, depth+1);
-            
-            // Recursively build the > branch of the tree.
-            node->gtChild = buildKdTree(references, temporary, median+1, upper, dim, depth+1);
-            
+        }
+        
+        // Store the size of the subtree, which rangeCount adds up without visiting its nodes.
+        if (node != nullptr) {
+            node->subtreeSize = 1 + ((node->ltChild() != NULL) ? node->ltChild()->subtreeSize : 0)
+                                  + ((node->gtChild() != NULL) ? node->gtChild()->subtreeSize : 0);
         }
         
         // Return the pointer to the root of the k-d tree.
@@ -263,68 +777,422 @@ private:
     }
     
     /*
-     * The createKdTree function performs the necessary initialization then calls the buildKdTree function.
+     * Return the depth of subdivision above which work is handed to another
+     * thread so that all threads are kept busy.
      *
      * calling parameters:
      *
-     * coordinates - a vector<long*> of references to each of the (x, y, z, w...) tuples
-     * numDimensions - the number of dimensions
+     * numThreads - the number of threads
      *
-     * returns: a KdNode pointer to the root of the k-d tree
+     * returns: the smallest depth d such that 2^d >= numThreads
      */
-public:
-    static KdNode *createKdTree(std::vector<float *>& coordinates, const long numDimensions)
+private:
+    static long submitDepth(const long numThreads)
     {
-        // Initialize and sort the reference arrays.
-        std::vector< std::vector<float *> > references(numDimensions, std::vector<float *>( coordinates.size() ) );
-        std::vector<float *> temporary( coordinates.size() );;
-        for (long i = 0; i < references.size(); i++) {
-            initializeReference(coordinates, references.at(i));
-            mergeSort(references.at(i), temporary, 0, references.at(i).size()-1, i, numDimensions);
+        long depth = 0;
+        while ((1L << depth) < numThreads) {
+            depth++;
         }
-        
-        // Remove references to duplicate coordinates via one pass through each reference array.
+        return depth;
+    }
+    
+    /*
+     * Initialize and sort one reference array per dimension, then remove the
+     * references to duplicate coordinates from each of them.  When more than
+     * one thread is requested, the reference arrays are sorted concurrently,
+     * each with its own temporary array and its share of the threads.
+     *
+     * calling parameters:
+     *
+     * coordinates - a vector<float*> of references to each of the (x, y, z, w...) tuples
+     * references - a vector< vector<float*> > that receives the sorted reference arrays
+     * temporary - a vector<float*> that is used as a temporary array
+     * numDimensions - the number of dimensions
+     * numThreads - the number of threads
+     *
+     * returns: the end index of each reference array following removal of duplicate elements
+     */
+private:
+    static std::vector<long> presortReferences(std::vector<float *>& coordinates, std::vector< std::vector<float *> >& references,
+                                               std::vector<float *>& temporary, const long numDimensions, const long numThreads)
+    {
         std::vector<long> end( references.size() );
-        for (long i = 0; i < end.size(); i++) {
-            end.at(i) = removeDuplicates(references.at(i), i, numDimensions);
+        if (numThreads <= 1) {
+            for (long i = 0; i < references.size(); i++) {
+                KdPhaseTimer timer(kdBuildTrace.presort);
+                initializeReference(coordinates, references.at(i));
+                mergeSort(references.at(i), temporary, 0, references.at(i).size()-1, i, numDimensions);
+            }
+            
+            // Remove references to duplicate coordinates via one pass through each reference array.
+            for (long i = 0; i < end.size(); i++) {
+                KdPhaseTimer timer(kdBuildTrace.dedupe);
+                end.at(i) = removeDuplicates(references.at(i), i, numDimensions);
+            }
+            return end;
         }
         
-        // Build the k-d tree.
-        KdNode *root = buildKdTree(references, temporary, 0, end.at(0), numDimensions, 0);
-        
-        // Verify the k-d tree and report the number of KdNodes.
-        //long numberOfNodes = root->verifyKdTree(numDimensions, 0);
-        //std::cout << std::endl << "Number of nodes = " << numberOfNodes << std::endl;
-        
-        // Return the pointer to the root of the k-d tree.
-        return root;
+        const long maximumSubmitDepth = submitDepth((numThreads + numDimensions - 1) / numDimensions);
+        std::vector< std::vector<float *> > temporaries(references.size() - 1, std::vector<float *>( coordinates.size() ));
+        std::vector< std::future<void> > sorts;
+        for (long i = 0; i < references.size(); i++) {
+            sorts.push_back(std::async(std::launch::async, [&, i] {
+                std::vector<float *>& scratch = (i == 0) ? temporary : temporaries.at(i - 1);
+                {
+                    KdPhaseTimer timer(kdBuildTrace.presort);
+                    initializeReference(coordinates, references.at(i));
+                    mergeSort(references.at(i), scratch, 0, references.at(i).size()-1, i, numDimensions, maximumSubmitDepth, 0);
+                }
+                KdPhaseTimer timer(kdBuildTrace.dedupe);
+                end.at(i) = removeDuplicates(references.at(i), i, numDimensions);
+            }));
+        }
+        for (long i = 0; i < sorts.size(); i++) {
+            sorts.at(i).get();
+        }
+        return end;
     }
     
     /*
-     * Search the k-d tree and find the KdNodes that lie within a cutoff distance
-     * from a query node in all k dimensions.
+     * Sort a reference array on its super key for the x axis and remove the
+     * references to duplicate coordinates from it.
      *
      * calling parameters:
      *
-     * query - the query point
-     * cut - the cutoff distance
+     * reference - a vector<float*> that represents the reference array
      * dim - the number of dimensions
-     * depth - the depth in the k-d tree
      *
-     * returns: a list that contains the kdNodes that lie within the cutoff distance of the query node
+     * returns: the end index of the reference array following removal of duplicate elements
      */
-public:
-    std::list<KdNode> searchKdTree(const float * query, float cut, const long dim,
-                                   const long depth) /* const */ {
-        
-        // The partition cycles as x, y, z, w...
-        long axis = depth % dim;
-        
-        // If the distance from the query node to the k-d node is within the cutoff distance
-        // in all k dimensions, add the k-d node to a list.
-        std::list<KdNode> result;
-        bool inside = true;
-        float distance = (query[0] - this->tuple[0]) * (query[0] - this->tuple[0]) + (query[1] - this->tuple[1]) * (query[1] - this->tuple[1]) + (query[2] - this->tuple[2]) * (query[2] - this->tuple[2]);
+private:
+    static long sortAndRemoveDuplicates(std::vector<float *>& reference, const long dim)
+    {
+        {
+            KdPhaseTimer timer(kdBuildTrace.presort);
+            std::sort(reference.begin(), reference.end(), [dim](const float *a, const float *b) {
+                return superKeyCompare(a, b, 0, dim) < 0;
+            });
+        }
+        KdPhaseTimer timer(kdBuildTrace.dedupe);
+        std::vector<float *>::iterator last = std::unique(reference.begin(), reference.end(), [dim](const float *a, const float *b) {
+            return superKeyCompare(a, b, 0, dim) == 0;
+        });
+        return (long) (last - reference.begin()) - 1;
+    }
+    
+    /*
+     * Move the element of a reference array that ranks at the median position
+     * on the super key for an axis to that position, with the lesser elements
+     * before it and the greater elements after it.
+     *
+     * The sampled variant first selects two pivots from an evenly spaced sample
+     * that bracket the median with high probability (Floyd and Rivest), splits
+     * the references about both pivots, and selects the median only among the
+     * few references between them.  Either variant finds the exact median.
+     *
+     * calling parameters:
+     *
+     * reference - a vector<float*> that represents the reference array
+     * start - start element of the reference array
+     * end - end element of the reference array
+     * median - the element to select
+     * axis - the most significant dimension of the super key
+     * dim - the number of dimensions
+     * sampled - select pivots from a sample before selecting the median
+     */
+private:
+    static void selectMedian(std::vector<float *>& reference, const long start, const long end, const long median,
+                             const long axis, const long dim, const bool sampled)
+    {
+        auto less = [axis, dim](const float *a, const float *b) {
+            return superKeyCompare(a, b, axis, dim) < 0;
+        };
+        float **first = reference.data() + start;
+        float **last = reference.data() + end + 1;
+        float **nth = reference.data() + median;
+        
+        const long size = end - start + 1;
+        if (sampled && size >= SAMPLED_SELECT_CUTOFF) {
+            const long sampleSize = (long) sqrt((double) size);
+            const long stride = size / sampleSize;
+            std::vector<float *> sample(sampleSize);
+            for (long i = 0; i < sampleSize; i++) {
+                sample.at(i) = reference.at(start + i * stride);
+            }
+            std::sort(sample.begin(), sample.end(), less);
+            
+            const long rank = (median - start) * sampleSize / size;
+            const long gap = (long) sqrt((double) sampleSize);
+            const float *lowPivot = sample.at(std::max(rank - gap, 0L));
+            const float *highPivot = sample.at(std::min(rank + gap, sampleSize - 1));
+            
+            // Split the references into < lowPivot, [lowPivot, highPivot] and > highPivot.
+            float **middle = std::partition(first, last, [&](const float *a) { return less(a, lowPivot); });
+            float **upper = std::partition(middle, last, [&](const float *a) { return !less(highPivot, a); });
+            
+            if (nth < middle) {
+                std::nth_element(first, nth, middle, less);
+            } else if (nth < upper) {
+                std::nth_element(middle, nth, upper, less);
+            } else {
+                std::nth_element(upper, nth, last, less);
+            }
+        } else {
+            std::nth_element(first, nth, last, less);
+        }
+    }
+    
+    /*
+     * This function permutes a single reference array into the in-order layout
+     * of the k-d tree: the median on the super key for the axis of each level is
+     * selected to the middle of its range, and the ranges on either side become
+     * the < and > branches.  This is the same tree that buildKdTree builds from
+     * the presorted reference arrays, without sorting on every axis.
+     *
+     * calling parameters:
+     *
+     * reference - a vector<float*> of pointers to each of the (x, y, z, w...) tuples
+     * start - start element of the reference array
+     * end - end element of the reference array
+     * dim - the number of dimensions
+     * sampled - select pivots from a sample before selecting each median
+     * maximumSubmitDepth - the depth in the tree above which the < branch is built by another thread
+     * depth - the depth in the tree
+     */
+private:
+    static void selectKdTree(std::vector<float *>& reference, const long start, const long end, const long dim,
+                             const bool sampled, const long maximumSubmitDepth, const long depth)
+    {
+        if (end <= start) {
+            return;
+        }
+        
+        const long median = start + ((end - start) / 2);
+        selectMedian(reference, start, end, median, depth % dim, dim, sampled);
+        
+        if (depth < maximumSubmitDepth) {
+            std::future<void> ltFuture = std::async(std::launch::async, [&] {
+                selectKdTree(reference, start, median - 1, dim, sampled, maximumSubmitDepth, depth+1);
+            });
+            selectKdTree(reference, median + 1, end, dim, sampled, maximumSubmitDepth, depth+1);
+            ltFuture.get();
+        } else {
+            selectKdTree(reference, start, median - 1, dim, sampled, maximumSubmitDepth, depth+1);
+            selectKdTree(reference, median + 1, end, dim, sampled, maximumSubmitDepth, depth+1);
+        }
+    }
+    
+    /*
+     * Create a KdNode for each reference of an array in the in-order layout of
+     * the k-d tree and link them into a tree.
+     *
+     * calling parameters:
+     *
+     * tree - a vector<float*> of references in the in-order layout of the tree
+     * arena - holds the KdNodes
+     * start - start element of the array
+     * end - end element of the array
+     *
+     * returns: a KdNode pointer to the root of the k-d tree
+     */
+private:
+    static KdNode *linkKdTree(const std::vector<float *>& tree, Arena& arena, const long start, const long end)
+    {
+        if (end < start) {
+            return nullptr;
+        }
+        const long median = start + ((end - start) / 2);
+        KdNode *node = arena.create(median, tree.at(median));
+        node->setChildren(linkKdTree(tree, arena, start, median - 1), linkKdTree(tree, arena, median + 1, end));
+        node->subtreeSize = (uint32_t) (end - start + 1);
+        return node;
+    }
+    
+    /*
+     * Return the bytes of the reference arrays that createKdTree allocates
+     * while it builds a tree, which are released before it returns.  The
+     * presort builder sorts a reference array per axis with a temporary array,
+     * and one more temporary per extra axis when the axes are sorted
+     * concurrently; the selection builders permute a single copy.
+     *
+     * calling parameters:
+     *
+     * numTuples - the number of tuples
+     * numDimensions - the number of dimensions
+     * numThreads - the number of threads that sort and build
+     * builder - the method of finding the median at each level
+     *
+     * returns: the number of bytes
+     */
+public:
+    static size_t referenceMemory(const long numTuples, const long numDimensions, const long numThreads,
+                                  const KdBuilder builder)
+    {
+        if (builder != BUILD_PRESORT) {
+            return numTuples * sizeof(float *);
+        }
+        const long numTemporaries = (numThreads <= 1) ? 1 : numDimensions;
+        return (numDimensions + numTemporaries) * numTuples * sizeof(float *);
+    }
+    
+    /*
+     * Count the KdNodes of a k-d tree, from the size of the subtree stored by the build.
+     *
+     * returns: the number of nodes in the subtree whose root is this node
+     */
+public:
+    long countNodes() const
+    {
+        return this->subtreeSize;
+    }
+    
+    /*
+     * Find the bounding box of the tuples of the subtree whose root is this node,
+     * which is the cell of the root for rangeCount.
+     *
+     * calling parameters:
+     *
+     * dim - the number of dimensions
+     * lower - receives the lower corner of the bounding box
+     * upper - receives the upper corner of the bounding box
+     */
+public:
+    void getBounds(const long dim, float *lower, float *upper) const
+    {
+        std::copy(this->tuple, this->tuple + dim, lower);
+        std::copy(this->tuple, this->tuple + dim, upper);
+        std::vector<const KdNode *> stack(1, this);
+        while (!stack.empty()) {
+            const KdNode *node = stack.back();
+            stack.pop_back();
+            for (long i = 0; i < dim; i++) {
+                lower[i] = std::min(lower[i], node->tuple[i]);
+                upper[i] = std::max(upper[i], node->tuple[i]);
+            }
+            if (node->ltChild() != NULL) {
+                stack.push_back(node->ltChild());
+            }
+            if (node->gtChild() != NULL) {
+                stack.push_back(node->gtChild());
+            }
+        }
+    }
+    
+    /*
+     * Add the nodes of the subtree whose root is this node to the shape of a tree.
+     *
+     * calling parameters:
+     *
+     * shape - receives the nodes and the leaves at each depth
+     * depth - the depth of this node
+     */
+public:
+    void getShape(KdTreeShape& shape, const long depth = 0) const
+    {
+        shape.add(depth, this->ltChild() == NULL && this->gtChild() == NULL, 1);
+        if (this->ltChild() != NULL) {
+            this->ltChild()->getShape(shape, depth + 1);
+        }
+        if (this->gtChild() != NULL) {
+            this->gtChild()->getShape(shape, depth + 1);
+        }
+    }
+    
+    /*
+     * Return the bytes of the KdNodes of a k-d tree.  The tuples are not
+     * included because the nodes refer to the coordinates that they were
+     * built from rather than copying them.
+     */
+public:
+    size_t memoryUsage() const
+    {
+        return countNodes() * sizeof(KdNode);
+    }
+    
+    /*
+     * The createKdTree function performs the necessary initialization then calls the buildKdTree function.
+     * The KdNodes are created in an arena, which frees them when it is destroyed or reused.
+     *
+     * calling parameters:
+     *
+     * arena - receives the KdNodes, replacing those of any tree that it held
+     * coordinates - a vector<long*> of references to each of the (x, y, z, w...) tuples
+     * numDimensions - the number of dimensions
+     * numThreads - the number of threads that sort and build; the tree is the same for any number
+     * builder - the method of finding the median at each level; the tree is the same for any method
+     * referenceBytes - if not NULL, receives the bytes of the reference arrays allocated during the build
+     *
+     * returns: a const KdNode pointer to the root of the k-d tree, which is immutable,
+     *          so that any number of threads may search it at once, or NULL if
+     *          there are more than KD_MAX_NODES tuples
+     */
+public:
+    static const KdNode *createKdTree(Arena& arena, std::vector<float *>& coordinates, const long numDimensions,
+                                      const long numThreads = 1, const KdBuilder builder = BUILD_PRESORT,
+                                      size_t *referenceBytes = NULL)
+    {
+        if (coordinates.size() > KD_MAX_NODES) {
+            return NULL;
+        }
+        if (referenceBytes != NULL) {
+            *referenceBytes = referenceMemory(coordinates.size(), numDimensions, numThreads, builder);
+        }
+        if (builder != BUILD_PRESORT) {
+            
+            // Permute a copy of the coordinate references into tree order, then link the nodes.
+            std::vector<float *> tree(coordinates);
+            const long end = sortAndRemoveDuplicates(tree, numDimensions);
+            KdPhaseTimer timer(kdBuildTrace.partition);
+            selectKdTree(tree, 0, end, numDimensions, builder == BUILD_SAMPLED, submitDepth(numThreads), 0);
+            arena.reserve(end + 1);
+            return linkKdTree(tree, arena, 0, end);
+        }
+        
+        // Initialize, sort and remove duplicates from the reference arrays.
+        std::vector< std::vector<float *> > references(numDimensions, std::vector<float *>( coordinates.size() ) );
+        std::vector<float *> temporary( coordinates.size() );
+        std::vector<long> end = presortReferences(coordinates, references, temporary, numDimensions, numThreads);
+        
+        // Build the k-d tree.
+        KdPhaseTimer timer(kdBuildTrace.partition);
+        arena.reserve(end.at(0) + 1);
+        KdNode *root = buildKdTree(references, temporary, arena, 0, end.at(0), numDimensions, submitDepth(numThreads), 0);
+        
+        // Verify the k-d tree and report the number of KdNodes.
+        //long numberOfNodes = root->verifyKdTree(numDimensions, 0);
+        //std::cout << std::endl << "Number of nodes = " << numberOfNodes << std::endl;
+        
+        // Return the pointer to the root of the k-d tree.
+        return root;
+    }
+    
+    /*
+     * Search the k-d tree and find the KdNodes that lie within a cutoff distance
+     * from a query node in all k dimensions.  Each node is passed to a function
+     * as it is found, so nothing is copied or accumulated.
+     *
+     * calling parameters:
+     *
+     * query - the query point
+     * cut - the cutoff distance
+     * dim - the number of dimensions
+     * depth - the depth in the k-d tree
+     * found - called with each KdNode that lies within the cutoff distance of the query node
+     */
+public:
+    template <typename Function>
+    void searchKdTree(const float * query, float cut, const long dim,
+                      const long depth, Function& found) const {
+        
+        // The partition cycles as x, y, z, w...
+        long axis = depth % dim;
+        KD_TRACE_VISIT(depth);
+        KD_TRACE_TEST(1);
+        
+        // If the distance from the query node to the k-d node is within the cutoff distance
+        // in all k dimensions, pass the k-d node to the function.
+        bool inside = true;
+        float distance = (query[0] - this->tuple[0]) * (query[0] - this->tuple[0]) + (query[1] - this->tuple[1]) * (query[1] - this->tuple[1]) + (query[2] - this->tuple[2]) * (query[2] - this->tuple[2]);
         if (distance > cut) {
             inside = false;
         }
@@ -335,26 +1203,28 @@ public:
         if (inside) {
             cut = 0;
             cut = distance;
-            result.push_back(*this); // The push_back function expects a KdNode for a call by reference.
+            found(*this);
         }
         
         if (depth == 0) {
-            std::list<KdNode> ltResult = this->ltChild->searchKdTree(query, cut, dim, depth + 1);
-            result.splice(result.end(), ltResult); // Can't substitute searchKdTree(...) for ltResult.
+            if (this->ltChild() != NULL) {
+                this->ltChild()->searchKdTree(query, cut, dim, depth + 1, found);
+            }
             
-            if ( this->gtChild != NULL && /*(query[axis]) >= this->tuple[axis]*/ (abs(query[axis] - this->tuple[axis]) <= abs(this->tuple[axis] - this->gtChild->tuple[axis]))) {
-                std::list<KdNode> gtResult = this->gtChild->searchKdTree(query, cut, dim, depth + 1);
-                result.splice(result.end(), gtResult); // Can't substitute searchKdTree(...) for gtResult.
+            if ( this->gtChild() != NULL && /*(query[axis]) >= this->tuple[axis]*/ (abs(query[axis] - this->tuple[axis]) <= abs(this->tuple[axis] - this->gtChild()->tuple[axis]))) {
+                this->gtChild()->searchKdTree(query, cut, dim, depth + 1, found);
             }
         }
         
-        if ( this->ltChild != NULL && (query[axis]) <= this->tuple[axis]) {
-            std::list<KdNode> ltResult = this->ltChild->searchKdTree(query, cut, dim, depth + 1);
-            result.splice(result.end(), ltResult); // Can't substitute searchKdTree(...) for ltResult.
+        if ( this->ltChild() != NULL && (query[axis]) <= this->tuple[axis]) {
+            this->ltChild()->searchKdTree(query, cut, dim, depth + 1, found);
+        } else if (this->ltChild() != NULL) {
+            KD_TRACE_PRUNE(1);
         }
-        if ( this->gtChild != NULL && (query[axis]) >= this->tuple[axis]) {
-            std::list<KdNode> gtResult = this->gtChild->searchKdTree(query, cut, dim, depth + 1);
-            result.splice(result.end(), gtResult); // Can't substitute searchKdTree(...) for gtResult.
+        if ( this->gtChild() != NULL && (query[axis]) >= this->tuple[axis]) {
+            this->gtChild()->searchKdTree(query, cut, dim, depth + 1, found);
+        } else if (this->gtChild() != NULL) {
+            KD_TRACE_PRUNE(1);
         }
         /*
          // Search the < branch of the k-d tree if the partition coordinate of the query point minus
@@ -362,9 +1232,8 @@ public:
          // searched when the cutoff distance equals the partition coordinate because the super key
          // may assign a point to either branch of the tree if the sorting or partition coordinate,
          // which forms the most significant portion of the super key, shows equality.
-         if ( this->ltChild != NULL && (query[axis] - cut) <= this->tuple[axis] ) {
-         std::list<KdNode> ltResult = this->ltChild->searchKdTree(query, cut, dim, depth + 1);
-         result.splice(result.end(), ltResult); // Can't substitute searchKdTree(...) for ltResult.
+         if ( this->ltChild() != NULL && (query[axis] - cut) <= this->tuple[axis] ) {
+         this->ltChild()->searchKdTree(query, cut, dim, depth + 1, found);
          }
          
          // Search the > branch of the k-d tree if the partition coordinate of the query point plus
@@ -372,12 +1241,25 @@ public:
          // searched when the cutoff distance equals the partition coordinate because the super key
          // may assign a point to either branch of the tree if the sorting or partition coordinate,
          // which forms the most significant portion of the super key, shows equality.
-         if ( this->gtChild != NULL && (query[axis] + cut) >= this->tuple[axis] ) {
-         std::list<KdNode> gtResult = this->gtChild->searchKdTree(query, cut, dim, depth + 1);
-         result.splice(result.end(), gtResult); // Can't substitute searchKdTree(...) for gtResult.
+         if ( this->gtChild() != NULL && (query[axis] + cut) >= this->tuple[axis] ) {
+         this->gtChild()->searchKdTree(query, cut, dim, depth + 1, found);
          }
          */
-        return result;
+    }
+    
+    /*
+     * As above, but store the tuples of the KdNodes in a vector, in the order in
+     * which they are found.  The capacity of the vector is reused from one call
+     * to the next, so a search allocates only when it finds more tuples than any before.
+     */
+public:
+    void searchKdTree(const float * query, float cut, const long dim,
+                      const long depth, std::vector<const float *>& result) const {
+        result.clear();
+        auto found = [&result](const KdNode& node) {
+            result.push_back(node.getTuple());
+        };
+        searchKdTree(query, cut, dim, depth, found);
     }
     
     /*
@@ -395,153 +1277,6613 @@ public:
         for (long i=1; i<dim-1; i++) std::cout << tuple[i] << ",";
         std::cout << tuple[dim-1] << ")";
     }
+
+    /*
+     * Search the k-d tree for the tuples within a query box in one pass, counting
+     * the visited nodes, and pass each returned tuple to a function as it is
+     * found.  The search reads only its arguments and the tree, which is not
+     * modified after createKdTree, so any number of threads may search one tree
+     * at once.
+     *
+     * calling parameters:
+     *
+     * lower - the lower corner of the query box
+     * upper - the upper corner of the query box
+     * dim - the number of dimensions
+     * depth - the depth in the k-d tree
+     * found - called with each tuple within the query box
+     * visitedNodes - incremented for each visited node
+     */
 public:
-    void rangeSearch(const long dim, const long depth) const
+    template <typename Function>
+    void rangeSearch(const float *lower, const float *upper, const long dim, const long depth, Function& found,
+                     unsigned long& visitedNodes) const
     {
         // Check if the current node is in the query square or not
-        if(this->tuple[0] >= leftBottomPoint[0] & this->tuple[0] <= rightAbovePoint[0]){
-            if(this->tuple[1] >= leftBottomPoint[1] & this->tuple[1] <= rightAbovePoint[1]){
-                if(this->tuple[2] >= leftBottomPoint[2] & this->tuple[2] <= rightAbovePoint[2]){
-                    std::cout << this->tuple[0] << ", " << this->tuple[1] << ", "<< this->tuple[2] << "\n";
-                    numberOfReturnedTuples += 1;
+        if(this->tuple[0] >= lower[0] & this->tuple[0] <= upper[0]){
+            if(this->tuple[1] >= lower[1] & this->tuple[1] <= upper[1]){
+                if(this->tuple[2] >= lower[2] & this->tuple[2] <= upper[2]){
+                    found(this->tuple);
                 }
             }
         }
         
-        numberOfVisitedNodes += 1;
+        visitedNodes += 1;
+        KD_TRACE_VISIT(depth);
+        KD_TRACE_TEST(1);
         
         long axis = depth % dim;
         
-        if(this->tuple[axis] >= leftBottomPoint[axis] & this->tuple[axis] <= rightAbovePoint[axis])
+        if(this->tuple[axis] >= lower[axis] & this->tuple[axis] <= upper[axis])
         {
-            if (this->ltChild != NULL)
-                this->ltChild->rangeSearch(dim, depth+1);
+            if (this->ltChild() != NULL)
+                this->ltChild()->rangeSearch(lower, upper, dim, depth+1, found, visitedNodes);
             
-            if (this->gtChild != NULL)
-                this->gtChild->rangeSearch(dim, depth+1);
+            if (this->gtChild() != NULL)
+                this->gtChild()->rangeSearch(lower, upper, dim, depth+1, found, visitedNodes);
         }
-        else if(this->tuple[axis] < leftBottomPoint[axis] & this->tuple[axis] < rightAbovePoint[axis]){
-            if (this->gtChild != NULL)
-                this->gtChild->rangeSearch(dim, depth+1);
+        else if(this->tuple[axis] < lower[axis] & this->tuple[axis] < upper[axis]){
+            KD_TRACE_PRUNE(this->ltChild() != NULL);
+            if (this->gtChild() != NULL)
+                this->gtChild()->rangeSearch(lower, upper, dim, depth+1, found, visitedNodes);
         }
-        else if(this->tuple[axis] > leftBottomPoint[axis] & this->tuple[axis] > rightAbovePoint[axis]){
-            if (this->ltChild != NULL)
-                this->ltChild->rangeSearch(dim, depth+1);
+        else if(this->tuple[axis] > lower[axis] & this->tuple[axis] > upper[axis]){
+            KD_TRACE_PRUNE(this->gtChild() != NULL);
+            if (this->ltChild() != NULL)
+                this->ltChild()->rangeSearch(lower, upper, dim, depth+1, found, visitedNodes);
         }
     }
+    
+    /*
+     * As above, for the query box of leftBottomPoint and rightAbovePoint,
+     * counting the returned tuples in numberOfReturnedTuples and the visited
+     * nodes in numberOfVisitedNodes.  Because it shares these globals, only one
+     * thread at a time may call it.
+     *
+     * calling parameters:
+     *
+     * dim - the number of dimensions
+     * depth - the depth in the k-d tree
+     * found - called with each tuple within the query box
+     */
 public:
-    void rangeSearchNOSHOW(const long dim, const long depth) const
+    template <typename Function>
+    void rangeSearch(const long dim, const long depth, Function& found) const
     {
-        // Check if the current node is in the query square or not
-        if(this->tuple[0] >= leftBottomPoint[0] & this->tuple[0] <= rightAbovePoint[0]){
-            if(this->tuple[1] >= leftBottomPoint[1] & this->tuple[1] <= rightAbovePoint[1]){
-                if(this->tuple[2] >= leftBottomPoint[2] & this->tuple[2] <= rightAbovePoint[2]){
-                    /*std::cout << this->tuple[0] << ", " << this->tuple[1] << ", "<< this->tuple[2] << "\n";*/
-                    numberOfReturnedTuples += 1;
-                }
-            }
+        auto counted = [&found](const float *tuple) {
+            found(tuple);
+            numberOfReturnedTuples += 1;
+        };
+        rangeSearch(leftBottomPoint, rightAbovePoint, dim, depth, counted, numberOfVisitedNodes);
+    }
+    
+    /*
+     * Count the tuples within a query box.  The cell of a subtree is the box that
+     * the partitions of its ancestors leave to it, and the size of a subtree
+     * whose cell lies within the query box is added without visiting its nodes,
+     * so that the cost grows with the nodes near the faces of the box rather
+     * than with the tuples within it.
+     *
+     * calling parameters:
+     *
+     * lower - the lower corner of the query box
+     * upper - the upper corner of the query box
+     * cellLower - the lower corner of the cell of this subtree, which is
+     *             modified during the search and restored
+     * cellUpper - the upper corner of the cell, likewise
+     * dim - the number of dimensions
+     * depth - the depth in the k-d tree
+     * visitedNodes - incremented for each visited node
+     *
+     * returns: the number of tuples within the query box
+     */
+public:
+    long rangeCount(const float *lower, const float *upper, float *cellLower, float *cellUpper, const long dim,
+                    const long depth, unsigned long& visitedNodes) const
+    {
+        bool contained = true, inside = true;
+        for (long i = 0; i < dim; i++) {
+            contained &= (cellLower[i] >= lower[i]) & (cellUpper[i] <= upper[i]);
+            inside &= (this->tuple[i] >= lower[i]) & (this->tuple[i] <= upper[i]);
+        }
+        if (contained) {
+            return this->subtreeSize;
         }
         
-        numberOfVisitedNodes += 1;
-        
-        long axis = depth % dim;
+        visitedNodes += 1;
+        KD_TRACE_VISIT(depth);
+        KD_TRACE_TEST(1);
         
-        if(this->tuple[axis] >= leftBottomPoint[axis] & this->tuple[axis] <= rightAbovePoint[axis])
-        {
-            if (this->ltChild != NULL)
-                this->ltChild->rangeSearchNOSHOW(dim, depth+1);
-            
-            if (this->gtChild != NULL)
-                this->gtChild->rangeSearchNOSHOW(dim, depth+1);
+        // The < branch holds tuples whose partition coordinate is <= that of
+        // the node, and the > branch holds tuples whose coordinate is >= it.
+        long count = inside ? 1 : 0;
+        const long axis = depth % dim;
+        const float split = this->tuple[axis];
+        if (this->ltChild() != NULL && lower[axis] <= split) {
+            const float saved = cellUpper[axis];
+            cellUpper[axis] = split;
+            count += this->ltChild()->rangeCount(lower, upper, cellLower, cellUpper, dim, depth + 1, visitedNodes);
+            cellUpper[axis] = saved;
         }
-        else if(this->tuple[axis] < leftBottomPoint[axis] & this->tuple[axis] < rightAbovePoint[axis]){
-            if (this->gtChild != NULL)
-                this->gtChild->rangeSearchNOSHOW(dim, depth+1);
-        }
-        else if(this->tuple[axis] > leftBottomPoint[axis] & this->tuple[axis] > rightAbovePoint[axis]){
-            if (this->ltChild != NULL)
-                this->ltChild->rangeSearchNOSHOW(dim, depth+1);
+        if (this->gtChild() != NULL && upper[axis] >= split) {
+            const float saved = cellLower[axis];
+            cellLower[axis] = split;
+            count += this->gtChild()->rangeCount(lower, upper, cellLower, cellUpper, dim, depth + 1, visitedNodes);
+            cellLower[axis] = saved;
         }
+        KD_TRACE_PRUNE((this->ltChild() != NULL && lower[axis] > split) + (this->gtChild() != NULL && upper[axis] < split));
+        return count;
+    }
+public:
+    void rangeSearch(const long dim, const long depth) const
+    {
+        auto print = [](const float *tuple) {
+            std::cout << tuple[0] << ", " << tuple[1] << ", "<< tuple[2] << "\n";
+        };
+        rangeSearch(dim, depth, print);
+    }
+public:
+    void rangeSearchNOSHOW(const long dim, const long depth) const
+    {
+        auto ignore = [](const float *) {};
+        rangeSearch(dim, depth, ignore);
     }
 };
 
+/* The most tuples that a KdTree holds, which stores the index of each tuple in its input as a uint32_t. */
+#define KD_MAX_TUPLES (4294967295L)
 
-/* Declare the two-dimensional coordinates array that contains (x,y,z) coordinates. */
-float coordinates[10000000][3];
-#define NUM_TUPLES (10000000)
-#define SEARCH_DISTANCE (+INFINITY)
-/* Create a simple k-d tree and print its topology for inspection. */
-int main(int argc, const char * argv[]) {
-    std::cout << std::setprecision(7);
-    std::string inputFile = argv[1];
-    const clock_t BEGINNING_OF_INPUT_PROCEDURE= clock();
-    std::ifstream input_data;
-    input_data.open(inputFile.c_str());
-    char garbageChar;
-    int i = 0;
-    std::string line;
-    while (std::getline(input_data, line))
-    {
-        std::istringstream iss(line);
-        iss >> garbageChar >> coordinates[i][0] >> garbageChar >> coordinates[i][1] >> garbageChar >> coordinates[i][2] >> garbageChar;
-        i++;
-    }
-    const double EXECUTION_OF_INPUT_PROCEDURE = (double)(clock() - BEGINNING_OF_INPUT_PROCEDURE) / CLOCKS_PER_SEC * 1000; // Report the execution time (in seconds).
-    std::cout << "\n" << "Execution time of input procedure in miliseconds:\t" << EXECUTION_OF_INPUT_PROCEDURE << "\n"; // Print out the time elapsed inputting the data.
-    
-    // Create the k-d tree.  The two-dimensional array is indexed by
-    // a vector<long*> in order to pass it as a function argument.
-    // The array is not copied to a vector< vector<long> > because,
-    // for efficiency, assignments in the initializeReference,
-    // mergeSort and buildKdTree functions copy only the long*
-    // pointer instead of all elements of a vector<long>.
-    std::vector<float *> coordinateVector(NUM_TUPLES);
-    for (long i = 0; i < coordinateVector.size(); ++i) {
-        coordinateVector.at(i) = &(coordinates[i][0]);
-    }
-    const clock_t BEGINNING_OF_BUILD_PROCEDURE = clock(); // Mark the beginning of the building procedure.
-    KdNode *root = KdNode::createKdTree(coordinateVector, 3);
-    const double EXECUTION_TIME_OF_BUILD_PROCEDURE = (double)(clock() - BEGINNING_OF_BUILD_PROCEDURE) / CLOCKS_PER_SEC * 1000; // Report the execution time (in seconds).
-    std::cout << "\n" << "Execution time of build procedure in miliseconds:\t" << EXECUTION_TIME_OF_BUILD_PROCEDURE << "\n"; // Print out the time elapsed building.
-    std::cout << "Index size: " << sizeof(KdNode) * NUM_TUPLES / (1024. * 1024.) << "MB\n";
-    bool more = true;
-    while(more)
+/* The most dimensions of a KdTree, which sizes the fixed arrays of its boxes and searches. */
+#define KD_MAX_DIMENSIONS (8)
+
+/* An axis-aligned query box, with the lower and upper corners inclusive. */
+struct KdBox
+{
+    float lower[KD_MAX_DIMENSIONS];
+    float upper[KD_MAX_DIMENSIONS];
+};
+
+/* Counters for one range or nearest-neighbour search of a KdTree. */
+struct KdRangeStats
+{
+    unsigned long visitedNodes;          // nodes whose tuple was compared with the query box or point
+    unsigned long bulkAcceptedSubtrees;  // subtrees whose bounding box lies within the query box
+    unsigned long bulkAcceptedTuples;    // tuples within those subtrees
+    unsigned long scannedBuckets;        // leaf buckets whose tuples were compared with the query box or point
+    unsigned long scannedTuples;         // tuples within those buckets
+    unsigned long refinedTuples;         // tuples of a QuantizedKdTree whose original coordinates were read
+    
+    KdRangeStats() : visitedNodes(0), bulkAcceptedSubtrees(0), bulkAcceptedTuples(0), scannedBuckets(0), scannedTuples(0),
+    refinedTuples(0) {}
+};
+
+/*
+ * How far KdTree::knnApproximate may stop short of the exact nearest tuples:
+ * each tuple found lies within 1 + epsilon times the distance of the true
+ * neighbour of its rank, and the search ends after the budget of leaf
+ * buckets or nodes, whichever is spent first.  Zero is no limit.
+ */
+struct KdApproximation
+{
+    float epsilon;   // the relative distance tolerance, 0 for exact distances
+    long maxLeaves;  // the largest number of leaf buckets to scan, or 0
+    long maxNodes;   // the largest number of nodes to visit, or 0
+    
+    KdApproximation() : epsilon(0), maxLeaves(0), maxNodes(0) {}
+};
+
+/* The largest number of consecutive tuples that descend the other tree together in KdTree::joinWithin. */
+#define KD_JOIN_GROUP_SIZE (64)
+
+/* The largest number of tuples that KdTree::rangeStream passes at a time. */
+#define KD_RANGE_CHUNK_SIZE (1024)
+
+/*
+ * The number of queries that each thread of KdTree::knnBatch keeps in flight
+ * and claims at once, and the depth above which the nodes are assumed to stay
+ * in cache, so that a query descends through them without yielding.
+ */
+#define KD_BATCH_LANES (8)
+#define KD_BATCH_BLOCK_SIZE (256)
+#define KD_BATCH_HOT_DEPTH (12)
+
+/* Subtrees with more tuples than this store their bounding box. */
+#define KD_BOUNDED_SUBTREE_SIZE (8)
+
+/* The default and the largest number of tuples in a leaf bucket of a KdTree. */
+#define KD_DEFAULT_BUCKET_SIZE (16)
+#define KD_MAX_BUCKET_SIZE (256)
+
+/*
+ * The order in which a KdTree stores the nodes above its leaf buckets.  The
+ * tuples stay in the in-order layout either way, so positions, spans and leaf
+ * buckets are unchanged; the other layouts add a copy of each node's bounding
+ * box and tuple in an order that keeps small subtrees together in memory.
+ */
+enum KdLayout
+{
+    LAYOUT_INORDER,  // read the nodes in place and their bounding boxes in breadth-first order
+    LAYOUT_VEB,      // van Emde Boas order: split the levels in half recursively
+    LAYOUT_BLOCKED   // subtrees of as many levels as fit a page, each block in van Emde Boas order
+};
+
+static const char *KD_LAYOUT_NAMES[] = {"inorder", "veb", "blocked"};
+
+/* The page that a block of LAYOUT_BLOCKED fits. */
+#define KD_LAYOUT_PAGE_SIZE (4096)
+
+/* A range-search sink that only counts the tuples. */
+struct KdCountSink
+{
+    unsigned long count;
+    
+    KdCountSink() : count(0) {}
+    
+    void add(const long)
     {
-        std::string input;
-        std::cout << "Do please indicate your query type, i.e., Q1 and its related parameters (i.e., x1, x2, y1, y2, z1, and z2) for range search, or Q2 and its related parameters (i.e., x1, y1, and z1) for nearest neighbour(s) search... You can also type QUIT to terminate this program...: " << std::endl;
-        std::cin >> input;
-        
-        if (input == "QUIT") {more = false;}
-        else if (input == "Q2")
-        {
-            float x1;
-            float y1;
-            float z1;
-            std::cout << "Do please enter a coordinate in the format [x1 y1 z1] in order for its nearest neighbours to be found!..." << std::endl;
-            std::cin >> x1 >> y1 >> z1;
-            /* Search the k-d tree for the k-d nodes that lie within the cutoff distance. */
-            float query[3];
-            query[0] = x1;
-            query[1] = y1;
-            query[2] = z1;
-            const clock_t BEGINNING_OF_SEARCH_PROCEDURE = clock(); // Mark the beginning of the execution of the searching procedure.
-            std::list<KdNode> kdList = root->searchKdTree(query, SEARCH_DISTANCE, 3, 0);
-            const double EXECUTION_TIME_OF_SEARCH_PROCEDURE = (double)(clock() - BEGINNING_OF_SEARCH_PROCEDURE) / CLOCKS_PER_SEC * 1000; // Report the execution time (in seconds).
-            std::cout << "\n" << "Execution time of search procedure in miliseconds:\t" << EXECUTION_TIME_OF_SEARCH_PROCEDURE << "\n"; // Print out the time elapsed sorting.
-            std::cout << std::endl << kdList.size() << " nodes within " << SEARCH_DISTANCE << " units of ";
-            KdNode::printTuple(query, 3);
-            std::cout << " in all dimensions." << std::endl << std::endl;
-            if (kdList.size() != 0) {
-                std::cout << "List of k-d nodes within " << SEARCH_DISTANCE << "-unit search distance follows:" << std::endl << std::endl;
-                std::list<KdNode>::iterator it;
-                for (it = kdList.begin(); it != kdList.end(); it++) {
-                    KdNode::printTuple(it->getTuple(), 3);
-                    std::cout << " ";
-                }
-                std::cout << std::endl << std::endl;
-            }
-            continue;
-        }
+        count += 1;
+    }
+    
+    void addSpan(const long start, const long end)
+    {
+        count += end - start + 1;
+    }
+};
+
+/* A range-search sink that passes the position of each tuple to a function. */
+template <typename Function>
+struct KdCallbackSink
+{
+    Function function;
+    
+    KdCallbackSink(Function f) : function(f) {}
+    
+    void add(const long position)
+    {
+        function(position);
+    }
+    
+    void addSpan(const long start, const long end)
+    {
+        for (long position = start; position <= end; position++) {
+            function(position);
+        }
+    }
+};
+
+/* A range-search sink that collects the indices into the input coordinates of the tuples. */
+class KdTree;
+struct KdIndexSink
+{
+    const KdTree& tree;
+    std::vector<uint32_t>& indices;
+    
+    KdIndexSink(const KdTree& t, std::vector<uint32_t>& i) : tree(t), indices(i) {}
+    
+    void add(const long position);
+    void addSpan(const long start, const long end);
+};
+
+/* The number of tuples within a query box and the sums of their coordinates, from KdTree::rangeAggregate. */
+struct KdAggregate
+{
+    unsigned long count;
+    double sum[KD_MAX_DIMENSIONS];
+    
+    KdAggregate() : count(0)
+    {
+        std::fill(sum, sum + KD_MAX_DIMENSIONS, 0.0);
+    }
+    
+    /* Return the mean of one coordinate of the tuples, or NAN if there are none. */
+    double centroid(const long axis) const
+    {
+        return (count > 0) ? sum[axis] / count : NAN;
+    }
+};
+
+/* A range-search sink that counts the tuples and sums their coordinates. */
+struct KdAggregateSink
+{
+    const KdTree& tree;
+    KdAggregate& aggregate;
+    
+    KdAggregateSink(const KdTree& t, KdAggregate& a) : tree(t), aggregate(a) {}
+    
+    void add(const long position);
+    void addSpan(const long start, const long end);
+};
+
+template <typename Function>
+KdCallbackSink<Function> makeCallbackSink(Function function)
+{
+    return KdCallbackSink<Function>(function);
+}
+
+/*
+ * Call body(thread, i) for each i in [0, count) on numThreads threads, each of
+ * which claims chunks of consecutive i in turn.
+ */
+template <typename Body>
+void parallelFor(const long count, const long numThreads, Body body)
+{
+    const long chunk = 64;
+    std::atomic<long> next(0);
+    auto work = [&](const long thread) {
+        for (long first = next.fetch_add(chunk); first < count; first = next.fetch_add(chunk)) {
+            const long last = std::min(first + chunk, count);
+            for (long i = first; i < last; i++) {
+                body(thread, i);
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (long thread = 1; thread < std::min(numThreads, (count + chunk - 1) / chunk); thread++) {
+        threads.push_back(std::thread(work, thread));
+    }
+    work(0);
+    for (long i = 0; i < threads.size(); i++) {
+        threads.at(i).join();
+    }
+}
+
+/*
+ * Kernels that compare the tuples of a leaf bucket with a query box or measure
+ * their squared distances from a query point.  A KdTree stores its coordinates
+ * one axis after another, so that coordinate a of the tuple at position p is
+ * points[a * stride + p], and each kernel compares one axis of 8 or 16 tuples
+ * at once.  selectKdKernels picks the widest instructions that the CPU
+ * supports, and the scalar kernels are the portable fallback.
+ *
+ * calling parameters:
+ *
+ * points - the coordinates of the tree, one axis after another
+ * stride - the number of coordinates of each axis
+ * dim - the number of dimensions
+ * start - the position of the first tuple of the bucket
+ * count - the number of tuples in the bucket
+ */
+struct KdKernels
+{
+    const char *name;
+    
+    // Return the number of tuples within the box [lower, upper].
+    long (*countInBox)(const float *points, long stride, long dim, long start, long count,
+                       const float *lower, const float *upper);
+    
+    // Write the positions of the tuples within the box to selected and return their number.
+    long (*selectInBox)(const float *points, long stride, long dim, long start, long count,
+                        const float *lower, const float *upper, uint32_t *selected);
+    
+    // Write the squared distance of each tuple from the query point to distances.
+    void (*squaredDistances)(const float *points, long stride, long dim, long start, long count,
+                             const float *query, float *distances);
+};
+
+// GCC would fuse the multiplies and adds of the squared distances where FMA is
+// available, which rounds differently from one function to another.  The
+// distance kernels and the joins, with their bounds on the distances, are
+// compiled without it, so that a bound is never rounded below a distance that
+// it bounds.
+#if defined(__GNUC__) && !defined(__clang__)
+#define KD_NO_FP_CONTRACT __attribute__((optimize("fp-contract=off")))
+#else
+#define KD_NO_FP_CONTRACT
+#endif
+
+static long scalarCountInBox(const float *points, const long stride, const long dim, const long start, const long count,
+                             const float *lower, const float *upper)
+{
+    long n = 0;
+    for (long i = start; i < start + count; i++) {
+        bool inside = true;
+        for (long a = 0; a < dim; a++) {
+            const float c = points[a * stride + i];
+            inside &= (c >= lower[a]) & (c <= upper[a]);
+        }
+        n += inside;
+    }
+    return n;
+}
+
+static long scalarSelectInBox(const float *points, const long stride, const long dim, const long start, const long count,
+                              const float *lower, const float *upper, uint32_t *selected)
+{
+    long n = 0;
+    for (long i = start; i < start + count; i++) {
+        bool inside = true;
+        for (long a = 0; a < dim; a++) {
+            const float c = points[a * stride + i];
+            inside &= (c >= lower[a]) & (c <= upper[a]);
+        }
+        selected[n] = (uint32_t) i;
+        n += inside;
+    }
+    return n;
+}
+
+KD_NO_FP_CONTRACT
+static void scalarSquaredDistances(const float *points, const long stride, const long dim, const long start, const long count,
+                                   const float *query, float *distances)
+{
+    for (long i = 0; i < count; i++) {
+        float distance = 0;
+        for (long a = 0; a < dim; a++) {
+            const float d = points[a * stride + start + i] - query[a];
+            distance += d * d;
+        }
+        distances[i] = distance;
+    }
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define KD_X86_KERNELS
+
+/* The in-box mask of the 8 tuples at position i. */
+__attribute__((target("avx2")))
+static inline int avx2InBoxMask(const float *points, const long stride, const long dim, const long i,
+                                const float *lower, const float *upper)
+{
+    __m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+    for (long a = 0; a < dim; a++) {
+        const __m256 c = _mm256_loadu_ps(points + a * stride + i);
+        inside = _mm256_and_ps(inside, _mm256_and_ps(_mm256_cmp_ps(c, _mm256_set1_ps(lower[a]), _CMP_GE_OQ),
+                                                     _mm256_cmp_ps(c, _mm256_set1_ps(upper[a]), _CMP_LE_OQ)));
+    }
+    return _mm256_movemask_ps(inside);
+}
+
+__attribute__((target("avx2,popcnt")))
+static long avx2CountInBox(const float *points, const long stride, const long dim, const long start, const long count,
+                           const float *lower, const float *upper)
+{
+    long n = 0, i = start;
+    for (; i + 8 <= start + count; i += 8) {
+        n += __builtin_popcount(avx2InBoxMask(points, stride, dim, i, lower, upper));
+    }
+    return n + scalarCountInBox(points, stride, dim, i, start + count - i, lower, upper);
+}
+
+__attribute__((target("avx2")))
+static long avx2SelectInBox(const float *points, const long stride, const long dim, const long start, const long count,
+                            const float *lower, const float *upper, uint32_t *selected)
+{
+    long n = 0, i = start;
+    for (; i + 8 <= start + count; i += 8) {
+        for (int mask = avx2InBoxMask(points, stride, dim, i, lower, upper); mask != 0; mask &= mask - 1) {
+            selected[n++] = (uint32_t) (i + __builtin_ctz(mask));
+        }
+    }
+    return n + scalarSelectInBox(points, stride, dim, i, start + count - i, lower, upper, selected + n);
+}
+
+__attribute__((target("avx2"))) KD_NO_FP_CONTRACT
+static void avx2SquaredDistances(const float *points, const long stride, const long dim, const long start, const long count,
+                                 const float *query, float *distances)
+{
+    long i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256 distance = _mm256_setzero_ps();
+        for (long a = 0; a < dim; a++) {
+            const __m256 d = _mm256_sub_ps(_mm256_loadu_ps(points + a * stride + start + i), _mm256_set1_ps(query[a]));
+            distance = _mm256_add_ps(distance, _mm256_mul_ps(d, d));
+        }
+        _mm256_storeu_ps(distances + i, distance);
+    }
+    scalarSquaredDistances(points, stride, dim, start + i, count - i, query, distances + i);
+}
+
+/* The in-box mask of the tuples at positions [i, i + 16) that are selected by valid. */
+__attribute__((target("avx512f")))
+static inline __mmask16 avx512InBoxMask(const float *points, const long stride, const long dim, const long i,
+                                        const __mmask16 valid, const float *lower, const float *upper)
+{
+    __mmask16 inside = valid;
+    for (long a = 0; a < dim; a++) {
+        const __m512 c = _mm512_maskz_loadu_ps(valid, points + a * stride + i);
+        inside = _mm512_mask_cmp_ps_mask(inside, c, _mm512_set1_ps(lower[a]), _CMP_GE_OQ);
+        inside = _mm512_mask_cmp_ps_mask(inside, c, _mm512_set1_ps(upper[a]), _CMP_LE_OQ);
+    }
+    return inside;
+}
+
+__attribute__((target("avx512f,popcnt")))
+static long avx512CountInBox(const float *points, const long stride, const long dim, const long start, const long count,
+                             const float *lower, const float *upper)
+{
+    long n = 0;
+    for (long i = start; i < start + count; i += 16) {
+        const __mmask16 valid = (start + count - i >= 16) ? 0xFFFF : (__mmask16) ((1u << (start + count - i)) - 1);
+        n += __builtin_popcount(avx512InBoxMask(points, stride, dim, i, valid, lower, upper));
+    }
+    return n;
+}
+
+__attribute__((target("avx512f,popcnt")))
+static long avx512SelectInBox(const float *points, const long stride, const long dim, const long start, const long count,
+                              const float *lower, const float *upper, uint32_t *selected)
+{
+    const __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    long n = 0;
+    for (long i = start; i < start + count; i += 16) {
+        const __mmask16 valid = (start + count - i >= 16) ? 0xFFFF : (__mmask16) ((1u << (start + count - i)) - 1);
+        const __mmask16 inside = avx512InBoxMask(points, stride, dim, i, valid, lower, upper);
+        _mm512_mask_compressstoreu_epi32(selected + n, inside, _mm512_add_epi32(_mm512_set1_epi32((int) i), lanes));
+        n += __builtin_popcount(inside);
+    }
+    return n;
+}
+
+__attribute__((target("avx512f"))) KD_NO_FP_CONTRACT
+static void avx512SquaredDistances(const float *points, const long stride, const long dim, const long start, const long count,
+                                   const float *query, float *distances)
+{
+    for (long i = 0; i < count; i += 16) {
+        const __mmask16 valid = (count - i >= 16) ? 0xFFFF : (__mmask16) ((1u << (count - i)) - 1);
+        __m512 distance = _mm512_setzero_ps();
+        for (long a = 0; a < dim; a++) {
+            const __m512 d = _mm512_sub_ps(_mm512_maskz_loadu_ps(valid, points + a * stride + start + i), _mm512_set1_ps(query[a]));
+            distance = _mm512_add_ps(distance, _mm512_mul_ps(d, d));
+        }
+        _mm512_mask_storeu_ps(distances + i, valid, distance);
+    }
+}
+#endif
+
+static const KdKernels SCALAR_KERNELS = {"scalar", scalarCountInBox, scalarSelectInBox, scalarSquaredDistances};
+#ifdef KD_X86_KERNELS
+static const KdKernels AVX2_KERNELS = {"avx2", avx2CountInBox, avx2SelectInBox, avx2SquaredDistances};
+static const KdKernels AVX512_KERNELS = {"avx512", avx512CountInBox, avx512SelectInBox, avx512SquaredDistances};
+#endif
+
+/*
+ * Return the kernels with the given name if the CPU supports them, or else the
+ * widest kernels that it supports.
+ *
+ * calling parameters:
+ *
+ * name - "scalar", "avx2", "avx512", or an empty string for the widest kernels
+ */
+static const KdKernels *selectKdKernels(const std::string& name = "")
+{
+#ifdef KD_X86_KERNELS
+    __builtin_cpu_init();
+    const bool avx512 = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("popcnt");
+    const bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+    if (name == "scalar") return &SCALAR_KERNELS;
+    if (name == "avx2" && avx2) return &AVX2_KERNELS;
+    if ((name == "avx512" || name.empty()) && avx512) return &AVX512_KERNELS;
+    if (avx2) return &AVX2_KERNELS;
+#endif
+    return &SCALAR_KERNELS;
+}
+
+/* The kernels that every KdTree uses; main may replace them before any query runs. */
+static const KdKernels *kdKernels = selectKdKernels();
+
+/* A private mapping of a whole file, which is unmapped when it is destroyed. */
+class MappedFile
+{
+private:
+    void *address;
+    size_t length;
+    
+public:
+    MappedFile() : address(nullptr), length(0) {}
+    
+    MappedFile(MappedFile&& other) : address(nullptr), length(0)
+    {
+        *this = std::move(other);
+    }
+    
+    MappedFile& operator=(MappedFile&& other)
+    {
+        std::swap(this->address, other.address);
+        std::swap(this->length, other.length);
+        return *this;
+    }
+    
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    
+    ~MappedFile()
+    {
+        if (this->address != nullptr) {
+            munmap(this->address, this->length);
+        }
+    }
+    
+    char *data() const
+    {
+        return (char *) this->address;
+    }
+    
+    size_t size() const
+    {
+        return this->length;
+    }
+    
+    /*
+     * Map a whole file into memory.
+     *
+     * calling parameters:
+     *
+     * path - the file
+     * writable - allow writes to the mapping, which are not written back to the file
+     *
+     * returns: true if the file was mapped
+     */
+    bool map(const std::string& path, const bool writable)
+    {
+        *this = MappedFile();
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat status;
+        if (fstat(fd, &status) == 0 && status.st_size > 0) {
+            void *mapping = mmap(nullptr, (size_t) status.st_size, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                                 MAP_PRIVATE, fd, 0);
+            if (mapping != MAP_FAILED) {
+                this->address = mapping;
+                this->length = (size_t) status.st_size;
+            }
+        }
+        close(fd);
+        return this->address != nullptr;
+    }
+};
+
+/*
+ * Return a 64-bit checksum of a buffer, which mixes one 64-bit word at a time
+ * into an FNV-1a style hash and then the remaining bytes.
+ */
+static uint64_t kdChecksum(const char *data, const size_t size)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * 1099511628211ULL;
+        hash ^= hash >> 29;
+    }
+    for (; i < size; i++) {
+        hash = (hash ^ (unsigned char) data[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/*
+ * The header of a KdTree index file.  It is followed by the sections that
+ * hold the coordinates, the indices and the subtree bounds, each aligned to
+ * 64 bytes so that the mapped tree reads them in place.
+ */
+struct KdIndexFileHeader
+{
+    char magic[8];            // "KDINDEX1"
+    uint32_t version;         // KD_INDEX_FILE_VERSION
+    uint32_t byteOrder;       // 0x01020304 as written by the machine that saved the tree
+    uint32_t dim;             // the number of dimensions
+    uint32_t bucketSize;      // the largest number of tuples in a leaf bucket
+    uint64_t count;           // the number of tuples
+    uint64_t boundsDepth;     // the depth above which subtrees store their bounding box
+    uint64_t pointsOffset;    // count * dim floats, one axis after another
+    uint64_t indicesOffset;   // count uint32_t indices into the input coordinates
+    uint64_t boundsOffset;    // (2^boundsDepth - 1) * 2 * dim floats, then the node tuples of another layout
+    uint64_t fileSize;        // the size of the whole file
+    uint64_t checksum;        // kdChecksum of everything after the header
+    uint64_t layout;          // the KdLayout of the bounds section; zero in files that predate it
+    uint64_t reserved[5];     // zero; pads the header to 128 bytes
+};
+
+#define KD_INDEX_FILE_MAGIC "KDINDEX1"
+#define KD_INDEX_FILE_VERSION (2)
+#define KD_INDEX_FILE_BYTE_ORDER (0x01020304)
+
+static_assert(sizeof(KdIndexFileHeader) == 128, "the index file header must keep its sections 64-byte aligned");
+
+/* A tuple found by a nearest-neighbour search of a KdTree. */
+struct KdNeighbour
+{
+    float distance;  // the squared distance from the query point
+    long position;   // the position of the tuple in the tree
+    
+    KdNeighbour(const float d, const long p) : distance(d), position(p) {}
+    
+    bool operator<(const KdNeighbour& other) const
+    {
+        return this->distance < other.distance;
+    }
+};
+
+/* A join sink that counts the pairs of tuples within the join distance. */
+struct KdPairCountSink
+{
+    unsigned long count;
+    
+    KdPairCountSink() : count(0) {}
+    
+    void add(const long, const long)
+    {
+        count += 1;
+    }
+    
+    void addBlock(const long aStart, const long aEnd, const long bStart, const long bEnd)
+    {
+        count += (unsigned long) (aEnd - aStart + 1) * (bEnd - bStart + 1);
+    }
+};
+
+/* A join sink that collects the positions of the pairs of tuples in their trees. */
+struct KdPairSink
+{
+    std::vector< std::pair<long, long> > pairs;
+    
+    void add(const long a, const long b)
+    {
+        pairs.push_back(std::make_pair(a, b));
+    }
+    
+    void addBlock(const long aStart, const long aEnd, const long bStart, const long bEnd)
+    {
+        for (long a = aStart; a <= aEnd; a++) {
+            for (long b = bStart; b <= bEnd; b++) {
+                pairs.push_back(std::make_pair(a, b));
+            }
+        }
+    }
+};
+
+/*
+ * A k-d tree that is stored as one flat array of tuples instead of one KdNode
+ * per tuple.  The tuples are copied into the in-order layout of the tree that
+ * buildKdTree produces: the subtree that covers the elements [start, end] of
+ * the array stores its root at the median element start + (end - start) / 2,
+ * its < branch at [start, median - 1] and its > branch at [median + 1, end].
+ * The children are therefore implicit and no pointers need to be stored.
+ *
+ * The coordinates are stored one axis after another rather than one tuple
+ * after another.  A subtree of at most bucketSize tuples is a leaf bucket
+ * whose tuples are compared with a query all at once by the kdKernels.
+ *
+ * The bounding boxes are stored in breadth-first order.  In LAYOUT_INORDER
+ * the searches read each node's tuple from the coordinates; the other
+ * layouts store a copy of the tuple of each node above the leaf buckets,
+ * ordered so that the nodes of small subtrees share cache lines and pages.
+ *
+ * The arrays are either owned by the tree or read in place from a mapped
+ * index file, so a tree can be moved but not copied.
+ */
+class KdTree
+{
+private:
+    long dim;
+    long count;
+    long bucketSize;
+    long boundsDepth;
+    long layout;               // the KdLayout of bounds
+    long nodeDepth;            // the number of levels above the leaf buckets
+    const float *points;       // the coordinates of each axis in turn, in tree order
+    const uint32_t *indices;   // the index of each node's tuple in the input coordinates
+    const float *bounds;       // lower and upper corners of the subtrees above boundsDepth, in breadth-first order
+    const float *nodes;        // the tuple of each node above the leaf buckets in the order of the layout, after the bounds
+    std::vector<float> ownedPoints;
+    std::vector<uint32_t> ownedIndices;
+    std::vector<float> ownedBounds;
+    std::vector<double> prefixSums;  // the sums of the coordinates before each position, axis by axis, from createSums
+    std::vector<long> levelRoot;     // the depth of the root of the top tree that each level hangs below
+    std::vector<long> levelTop;      // the number of nodes of that top tree
+    std::vector<long> levelBottom;   // the number of nodes of each bottom tree that begins at the level
+    MappedFile mapping;
+
+public:
+    KdTree() : dim(0), count(0), bucketSize(1), boundsDepth(0), layout(LAYOUT_INORDER), nodeDepth(0), points(nullptr),
+    indices(nullptr), bounds(nullptr), nodes(nullptr) {}
+    
+    KdTree(KdTree&&) = default;
+    KdTree& operator=(KdTree&&) = default;
+    KdTree(const KdTree&) = delete;
+    KdTree& operator=(const KdTree&) = delete;
+    
+    long size() const
+    {
+        return this->count;
+    }
+    
+    /*
+     * Return true if the arrays of the tree are read from a mapped index file.
+     */
+    bool isMapped() const
+    {
+        return this->mapping.data() != nullptr;
+    }
+    
+    long dimensions() const
+    {
+        return this->dim;
+    }
+    
+    long getBucketSize() const
+    {
+        return this->bucketSize;
+    }
+    
+    KdLayout getLayout() const
+    {
+        return (KdLayout) this->layout;
+    }
+    
+    /*
+     * Return one coordinate of the tuple that is stored at a position of the tree.
+     */
+    float coordinate(const long position, const long axis) const
+    {
+        return this->points[axis * size() + position];
+    }
+    
+    /*
+     * Copy the tuple that is stored at a position of the tree.
+     */
+    void getTuple(const long position, float *tuple) const
+    {
+        for (long i = 0; i < this->dim; i++) {
+            tuple[i] = coordinate(position, i);
+        }
+    }
+    
+    /*
+     * Return the index into the input coordinates of the tuple that is stored
+     * at a position of the tree.
+     */
+    long getIndex(const long position) const
+    {
+        return this->indices[position];
+    }
+    
+    /*
+     * Precompute the sums of the coordinates of the tuples before each position,
+     * so that the coordinates of a subtree, which occupies consecutive
+     * positions, are summed in O(1).  The sums take dim * (size() + 1) doubles
+     * and must be created before the tree is searched by other threads.
+     * A subtree's sum is the difference of two of them, so its rounding error
+     * is relative to the running sum at its end rather than to its own sum.
+     */
+    void createSums()
+    {
+        const long n = size();
+        this->prefixSums.assign((n + 1) * this->dim, 0);
+        for (long i = 0; i < this->dim; i++) {
+            double *sums = &this->prefixSums[i * (n + 1)];
+            for (long position = 0; position < n; position++) {
+                sums[position + 1] = sums[position] + coordinate(position, i);
+            }
+        }
+    }
+    
+    /* Return true if createSums has precomputed the sums of the coordinates. */
+    bool hasSums() const
+    {
+        return !this->prefixSums.empty();
+    }
+    
+    /*
+     * Add the sums of the coordinates of the tuples at the positions [start, end]
+     * to sum, in O(1) if createSums has precomputed them.
+     */
+    void addSums(const long start, const long end, double *sum) const
+    {
+        if (this->prefixSums.empty()) {
+            for (long position = start; position <= end; position++) {
+                for (long i = 0; i < this->dim; i++) {
+                    sum[i] += coordinate(position, i);
+                }
+            }
+            return;
+        }
+        const long n = size();
+        for (long i = 0; i < this->dim; i++) {
+            sum[i] += this->prefixSums[i * (n + 1) + end + 1] - this->prefixSums[i * (n + 1) + start];
+        }
+    }
+    
+    /*
+     * Return the number of bytes that are held by the tree.
+     */
+    size_t memoryUsage() const
+    {
+        return sizeof(*this) + ownedPoints.capacity() * sizeof(float) + ownedIndices.capacity() * sizeof(uint32_t)
+        + ownedBounds.capacity() * sizeof(float) + prefixSums.capacity() * sizeof(double) + mapping.size();
+    }
+    
+    /*
+     * Return the shape of the tree, in which each leaf bucket is a leaf.
+     */
+    KdTreeShape getShape() const
+    {
+        KdTreeShape shape;
+        if (size() > 0) {
+            getShape(shape, 0, size() - 1, 0);
+        }
+        return shape;
+    }
+
+private:
+    void getShape(KdTreeShape& shape, const long start, const long end, const long depth) const
+    {
+        if (end - start < this->bucketSize) {
+            shape.add(depth, true, end - start + 1);
+            return;
+        }
+        const long median = start + ((end - start) / 2);
+        shape.add(depth, false, 1);
+        if (start < median) {
+            getShape(shape, start, median - 1, depth + 1);
+        }
+        if (median < end) {
+            getShape(shape, median + 1, end, depth + 1);
+        }
+    }
+
+    /*
+     * Return the number of floats of the bounds section: the bounding boxes of
+     * the subtrees above boundsDepth and, in a layout other than LAYOUT_INORDER,
+     * the tuples of the nodes above the leaf buckets.
+     */
+private:
+    long boxFloats() const
+    {
+        return (this->boundsDepth == 0) ? 0 : ((1L << this->boundsDepth) - 1) * 2 * this->dim;
+    }
+    
+    long boundsFloats() const
+    {
+        if (this->layout != LAYOUT_INORDER && this->nodeDepth > 0) {
+            return boxFloats() + ((1L << this->nodeDepth) - 1) * this->dim;
+        }
+        return boxFloats();
+    }
+    
+    /*
+     * Fill the level tables of a layout for the subtree of height levels whose
+     * root is at rootDepth.  The subtree is split into a top tree and the bottom
+     * trees below it, which are stored one after another, and each of these is
+     * laid out in turn.  LAYOUT_VEB splits the levels in half; LAYOUT_BLOCKED
+     * cuts blocks of blockHeight levels from the top and splits each in half.
+     *
+     * calling parameters:
+     *
+     * rootDepth - the depth of the root of the subtree
+     * height - the number of levels of the subtree
+     * blockHeight - the number of levels of a block of LAYOUT_BLOCKED
+     */
+private:
+    void layoutLevels(const long rootDepth, const long height, const long blockHeight)
+    {
+        if (height <= 1) {
+            return;
+        }
+        const long topHeight = (this->layout == LAYOUT_BLOCKED && height > blockHeight) ? blockHeight : height / 2;
+        const long depth = rootDepth + topHeight;
+        this->levelRoot.at(depth) = rootDepth;
+        this->levelTop.at(depth) = (1L << topHeight) - 1;
+        this->levelBottom.at(depth) = (1L << (height - topHeight)) - 1;
+        layoutLevels(rootDepth, topHeight, blockHeight);
+        layoutLevels(depth, height - topHeight, blockHeight);
+    }
+    
+    /*
+     * Count the levels above the leaf buckets and fill the level tables of the
+     * layout, which depend only on the size, the bucket size and the layout.
+     */
+private:
+    void createLevels()
+    {
+        this->nodeDepth = 0;
+        for (long largest = size(); largest > this->bucketSize; largest /= 2) {
+            this->nodeDepth++;
+        }
+        long blockHeight = 1;
+        while (((2L << blockHeight) - 1) * this->dim * (long) sizeof(float) <= KD_LAYOUT_PAGE_SIZE) {
+            blockHeight++;
+        }
+        this->levelRoot.assign(this->nodeDepth, 0);
+        this->levelTop.assign(this->nodeDepth, 0);
+        this->levelBottom.assign(this->nodeDepth, 0);
+        if (this->layout != LAYOUT_INORDER) {
+            layoutLevels(0, this->nodeDepth, blockHeight);
+        }
+    }
+    
+    /*
+     * Return the slot of a node's tuple in a layout other than LAYOUT_INORDER.
+     * The node at depth d whose heap number is h is in the ((h + 1) & levelTop[d])-th
+     * bottom tree below the top tree whose root is at depth levelRoot[d], so its
+     * slot follows from the slot of that root (Brodal, Fagerberg and Jacob).
+     *
+     * calling parameters:
+     *
+     * slots - the slots of the ancestors of the node, indexed by depth
+     * heap - the heap number of the node
+     * depth - the depth of the node
+     */
+private:
+    long nodeSlot(const long *slots, const long heap, const long depth) const
+    {
+        if (depth == 0) {
+            return 0;
+        }
+        return slots[this->levelRoot[depth]] + this->levelTop[depth] + ((heap + 1) & this->levelTop[depth]) * this->levelBottom[depth];
+    }
+    
+    /*
+     * Copy the tuple of each node of the subtree [start, end] above the leaf
+     * buckets into its slot of the layout.  The bounding boxes stay in
+     * breadth-first order, so that a node below boundsDepth takes no room
+     * for one.
+     *
+     * calling parameters:
+     *
+     * tuples - receives the tuples, dim floats per slot
+     * slots - the slots of the ancestors of the subtree, indexed by depth
+     * start - start element of the subtree
+     * end - end element of the subtree
+     * heap - the heap number of the subtree
+     * depth - the depth in the tree
+     */
+private:
+    void layoutNodes(float *tuples, long *slots, const long start, const long end, const long heap, const long depth) const
+    {
+        if (end - start < this->bucketSize) {
+            return;
+        }
+        const long median = start + ((end - start) / 2);
+        slots[depth] = nodeSlot(slots, heap, depth);
+        getTuple(median, &tuples[slots[depth] * this->dim]);
+        if (start < median) {
+            layoutNodes(tuples, slots, start, median - 1, 2 * heap + 1, depth + 1);
+        }
+        if (median < end) {
+            layoutNodes(tuples, slots, median + 1, end, 2 * heap + 2, depth + 1);
+        }
+    }
+    
+    /*
+     * This function builds the tree by recursively partitioning the reference
+     * arrays exactly as KdNode::buildKdTree does, but instead of allocating a
+     * KdNode it records the median reference at its position in the tree.
+     *
+     * calling parameters:
+     *
+     * references - a vector< vector<float*> > of pointers to each of the (x, y, z, w...) tuples
+     * temporary - a vector<float*> that is used as a temporary array
+     * tree - a vector<float*> that receives the references in tree order
+     * start - start element of the reference arrays
+     * end - end element of the reference arrays
+     * dim - the number of dimensions
+     * maximumSubmitDepth - the depth in the tree above which the < branch is built by another thread
+     * depth - the depth in the tree
+     */
+private:
+    static void buildKdTree(std::vector< std::vector<float *> >& references, std::vector<float *>& temporary,
+                            std::vector<float *>& tree, const long start, const long end, const long dim,
+                            const long maximumSubmitDepth, const long depth)
+    {
+        if (end <= start + 2) {
+            
+            // At most three references were passed to this function in sorted
+            // order, which is already the in-order layout of their subtree.
+            for (long i = start; i <= end; i++) {
+                tree.at(i) = references.at(0).at(i);
+            }
+            
+        } else {
+            
+            // Store the median element of references[0] at its position in the
+            // tree and partition the other reference arrays about it.
+            const long median = start + ((end - start) / 2);
+            tree.at(median) = references.at(0).at(median);
+            
+            long lower = 0, upper = 0;
+            KdNode::partitionReferences(references, temporary, start, end, median, dim, depth, lower, upper);
+            
+            // Recursively build the < and > branches of the tree, concurrently near the root.
+            if (depth < maximumSubmitDepth) {
+                std::future<void> ltFuture = std::async(std::launch::async, [&] {
+                    buildKdTree(references, temporary, tree, start, lower, dim, maximumSubmitDepth, depth+1);
+                });
+                buildKdTree(references, temporary, tree, median+1, upper, dim, maximumSubmitDepth, depth+1);
+                ltFuture.get();
+            } else {
+                buildKdTree(references, temporary, tree, start, lower, dim, maximumSubmitDepth, depth+1);
+                buildKdTree(references, temporary, tree, median+1, upper, dim, maximumSubmitDepth, depth+1);
+            }
+        }
+    }
+    
+    /*
+     * Compute the bounding box of every subtree at depth < boundsDepth.  The
+     * subtrees are numbered as in a binary heap: the root is 0 and the
+     * children of subtree h are 2h + 1 and 2h + 2.  Subtrees at the same depth
+     * differ in size by at most one, so every slot above boundsDepth is used.
+     *
+     * calling parameters:
+     *
+     * start - start element of the subtree
+     * end - end element of the subtree
+     * heap - the heap number of the subtree
+     * maximumSubmitDepth - the depth in the tree above which the < branch is computed by another thread
+     * depth - the depth in the tree
+     * box - receives the bounding box of the subtree
+     */
+private:
+    void computeBounds(const long start, const long end, const long heap, const long maximumSubmitDepth,
+                       const long depth, float *box)
+    {
+        float *lower = box, *upper = box + this->dim;
+        if (depth >= this->boundsDepth) {
+            
+            // Scan the subtree, which is too small to store its own box.
+            getTuple(start, lower);
+            getTuple(start, upper);
+            for (long i = start + 1; i <= end; i++) {
+                for (long j = 0; j < this->dim; j++) {
+                    lower[j] = std::min(lower[j], coordinate(i, j));
+                    upper[j] = std::max(upper[j], coordinate(i, j));
+                }
+            }
+            return;
+        }
+        
+        // Merge the tuple of the node with the boxes of both branches, which
+        // are not empty because the subtree is larger than KD_BOUNDED_SUBTREE_SIZE.
+        // The boxes of branches below boundsDepth are only needed here.
+        const long median = start + ((end - start) / 2);
+        float ltScan[2 * KD_MAX_DIMENSIONS], gtScan[2 * KD_MAX_DIMENSIONS];
+        const bool stored = depth + 1 < this->boundsDepth;
+        float *ltBox = stored ? &this->ownedBounds[(2 * heap + 1) * 2 * this->dim] : ltScan;
+        float *gtBox = stored ? &this->ownedBounds[(2 * heap + 2) * 2 * this->dim] : gtScan;
+        if (depth < maximumSubmitDepth) {
+            std::future<void> ltFuture = std::async(std::launch::async, [&] {
+                computeBounds(start, median - 1, 2 * heap + 1, maximumSubmitDepth, depth + 1, ltBox);
+            });
+            computeBounds(median + 1, end, 2 * heap + 2, maximumSubmitDepth, depth + 1, gtBox);
+            ltFuture.get();
+        } else {
+            computeBounds(start, median - 1, 2 * heap + 1, maximumSubmitDepth, depth + 1, ltBox);
+            computeBounds(median + 1, end, 2 * heap + 2, maximumSubmitDepth, depth + 1, gtBox);
+        }
+        for (long j = 0; j < this->dim; j++) {
+            lower[j] = std::min(std::min(ltBox[j], gtBox[j]), coordinate(median, j));
+            upper[j] = std::max(std::max(ltBox[this->dim + j], gtBox[this->dim + j]), coordinate(median, j));
+        }
+    }
+    
+    /*
+     * Store the bounding boxes of the subtrees that hold more than
+     * KD_BOUNDED_SUBTREE_SIZE tuples and are not leaf buckets.  In a layout
+     * other than LAYOUT_INORDER, the tuples of the nodes are then copied
+     * after them in the order of the layout.
+     *
+     * calling parameters:
+     *
+     * numThreads - the number of threads
+     */
+private:
+    void createBounds(const long numThreads)
+    {
+        // Find the depth at which the smallest subtree no longer exceeds the cutoff.
+        this->boundsDepth = 0;
+        const long cutoff = std::max((long) KD_BOUNDED_SUBTREE_SIZE, this->bucketSize);
+        for (long smallest = size(); smallest > cutoff; smallest = (smallest - 1) / 2) {
+            this->boundsDepth++;
+        }
+        createLevels();
+        this->ownedBounds.assign(boundsFloats(), 0);
+        if (this->boundsDepth > 0) {
+            computeBounds(0, size() - 1, 0, KdNode::submitDepth(numThreads), 0, &this->ownedBounds[0]);
+        }
+        if (this->layout != LAYOUT_INORDER && size() > 0) {
+            long slots[64];
+            layoutNodes(&this->ownedBounds[boxFloats()], slots, 0, size() - 1, 0, 0);
+        }
+        this->bounds = this->ownedBounds.data();
+        this->nodes = this->bounds + boxFloats();
+    }
+    
+    /*
+     * Check that createKdTree can build a tree of a number of tuples and
+     * dimensions, which size the fixed arrays of the searches.
+     *
+     * calling parameters:
+     *
+     * numTuples - the number of tuples
+     * numDimensions - the number of dimensions
+     *
+     * returns: an empty string if it can, or else the reason it cannot
+     */
+public:
+    static std::string checkInput(const long numTuples, const long numDimensions)
+    {
+        if (numDimensions <= 0 || numDimensions > KD_MAX_DIMENSIONS) {
+            return std::to_string(numDimensions) + " dimensions are not between 1 and "
+            + std::to_string(KD_MAX_DIMENSIONS);
+        }
+        if (numTuples > KD_MAX_TUPLES) {
+            return std::to_string(numTuples) + " tuples exceed the " + std::to_string(KD_MAX_TUPLES)
+            + " that the 32-bit indices of a flat tree can hold";
+        }
+        return "";
+    }
+    
+    /*
+     * The createKdTree function sorts the reference arrays, builds the tree
+     * and copies the tuples into tree order.
+     *
+     * calling parameters:
+     *
+     * coordinates - the (x, y, z, w...) tuples stored contiguously
+     * numTuples - the number of tuples
+     * numDimensions - the number of dimensions
+     * numThreads - the number of threads that sort and build; the tree is the same for any number
+     * builder - the method of finding the median at each level; the tree is the same for any method
+     * bucketSize - the largest number of tuples in a leaf bucket
+     * layout - the order in which the nodes above the leaf buckets are stored
+     * referenceBytes - if not NULL, receives the bytes of the reference arrays allocated during the build
+     *
+     * returns: the k-d tree, which owns a copy of the tuples so that the coordinates may be freed,
+     *          or an empty tree if checkInput rejects the input
+     */
+public:
+    static KdTree createKdTree(float *coordinates, const long numTuples, const long numDimensions, const long numThreads = 1,
+                               const KdBuilder builder = BUILD_PRESORT, const long bucketSize = KD_DEFAULT_BUCKET_SIZE,
+                               const KdLayout layout = LAYOUT_INORDER, size_t *referenceBytes = NULL)
+    {
+        if (referenceBytes != NULL) {
+            
+            // The selection builders permute the coordinate references in place; presort
+            // also allocates them and then the references in tree order.
+            *referenceBytes = KdNode::referenceMemory(numTuples, numDimensions, numThreads, builder)
+            + ((builder == BUILD_PRESORT) ? 2 * numTuples * sizeof(float *) : 0);
+        }
+        KdTree kdTree;
+        if (!checkInput(numTuples, numDimensions).empty()) {
+            return kdTree;
+        }
+        kdTree.dim = numDimensions;
+        kdTree.bucketSize = std::min(std::max(bucketSize, 1L), (long) KD_MAX_BUCKET_SIZE);
+        kdTree.layout = layout;
+        if (numTuples <= 0) {
+            return kdTree;
+        }
+        
+        std::vector<float *> coordinateVector(numTuples);
+        for (long i = 0; i < numTuples; i++) {
+            coordinateVector.at(i) = coordinates + i * numDimensions;
+        }
+        
+        std::vector<float *> tree;
+        if (builder == BUILD_PRESORT) {
+            
+            // Initialize, sort and remove duplicates from the reference arrays.
+            std::vector< std::vector<float *> > references(numDimensions, std::vector<float *>(numTuples));
+            std::vector<float *> temporary(numTuples);
+            std::vector<long> end = KdNode::presortReferences(coordinateVector, references, temporary, numDimensions, numThreads);
+            
+            // Build the tree into an array of references in tree order.
+            KdPhaseTimer timer(kdBuildTrace.partition);
+            tree.resize(end.at(0) + 1);
+            buildKdTree(references, temporary, tree, 0, end.at(0), numDimensions, KdNode::submitDepth(numThreads), 0);
+        } else {
+            
+            // Permute the coordinate references themselves into tree order.
+            const long end = KdNode::sortAndRemoveDuplicates(coordinateVector, numDimensions);
+            KdPhaseTimer timer(kdBuildTrace.partition);
+            KdNode::selectKdTree(coordinateVector, 0, end, numDimensions, builder == BUILD_SAMPLED, KdNode::submitDepth(numThreads), 0);
+            coordinateVector.resize(end + 1);
+            tree.swap(coordinateVector);
+        }
+        
+        // Copy the tuples into tree order, one axis after another.
+        KdPhaseTimer timer(kdBuildTrace.layout);
+        kdTree.count = (long) tree.size();
+        kdTree.ownedPoints.resize(tree.size() * numDimensions);
+        kdTree.ownedIndices.resize(tree.size());
+        for (long i = 0; i < tree.size(); i++) {
+            for (long j = 0; j < numDimensions; j++) {
+                kdTree.ownedPoints[j * tree.size() + i] = tree.at(i)[j];
+            }
+            kdTree.ownedIndices[i] = (uint32_t) ((tree.at(i) - coordinates) / numDimensions);
+        }
+        kdTree.points = kdTree.ownedPoints.data();
+        kdTree.indices = kdTree.ownedIndices.data();
+        kdTree.createBounds(numThreads);
+        return kdTree;
+    }
+    
+    /*
+     * Save the tree to an index file that load maps back into memory.
+     *
+     * calling parameters:
+     *
+     * path - the index file
+     *
+     * returns: true if the file was written
+     */
+public:
+    bool save(const std::string& path) const
+    {
+        KdIndexFileHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, KD_INDEX_FILE_MAGIC, sizeof(header.magic));
+        header.version = KD_INDEX_FILE_VERSION;
+        header.byteOrder = KD_INDEX_FILE_BYTE_ORDER;
+        header.dim = (uint32_t) this->dim;
+        header.bucketSize = (uint32_t) this->bucketSize;
+        header.count = (uint64_t) size();
+        header.boundsDepth = (uint64_t) this->boundsDepth;
+        header.layout = (uint64_t) this->layout;
+        
+        // Lay out the sections at 64-byte boundaries after the header.
+        const size_t pointsSize = size() * this->dim * sizeof(float);
+        const size_t indicesSize = size() * sizeof(uint32_t);
+        const size_t boundsSize = boundsFloats() * sizeof(float);
+        header.pointsOffset = sizeof(header);
+        header.indicesOffset = (header.pointsOffset + pointsSize + 63) & ~63ULL;
+        header.boundsOffset = (header.indicesOffset + indicesSize + 63) & ~63ULL;
+        header.fileSize = header.boundsOffset + boundsSize;
+        
+        std::vector<char> payload(header.fileSize - sizeof(header), 0);
+        memcpy(&payload[header.pointsOffset - sizeof(header)], this->points, pointsSize);
+        memcpy(&payload[header.indicesOffset - sizeof(header)], this->indices, indicesSize);
+        memcpy(&payload[header.boundsOffset - sizeof(header)], this->bounds, boundsSize);
+        header.checksum = kdChecksum(payload.data(), payload.size());
+        
+        std::ofstream file(path.c_str(), std::ios::binary | std::ios::trunc);
+        file.write((const char *) &header, sizeof(header));
+        file.write(payload.data(), payload.size());
+        return (bool) file;
+    }
+    
+    /*
+     * Return true if a file begins with the magic number of an index file.
+     */
+public:
+    static bool isIndexFile(const std::string& path)
+    {
+        char magic[8] = {0};
+        std::ifstream file(path.c_str(), std::ios::binary);
+        file.read(magic, sizeof(magic));
+        return file && memcmp(magic, KD_INDEX_FILE_MAGIC, sizeof(magic)) == 0;
+    }
+    
+    /*
+     * Map an index file that save wrote.  The tree reads its coordinates,
+     * indices and bounds directly from the mapping, so nothing is allocated
+     * per node and the pages are read only as the queries touch them.
+     *
+     * calling parameters:
+     *
+     * path - the index file
+     * kdTree - receives the tree
+     * verify - compare the checksum of the file, which reads the whole file
+     *
+     * returns: an empty string if the tree was loaded, or else the reason it was not
+     */
+public:
+    static std::string load(const std::string& path, KdTree& kdTree, const bool verify = true)
+    {
+        MappedFile file;
+        if (!file.map(path, false)) {
+            return "cannot map " + path;
+        }
+        
+        // Check the header before trusting any offset in it.
+        KdIndexFileHeader header;
+        if (file.size() < sizeof(header)) {
+            return "truncated header";
+        }
+        memcpy(&header, file.data(), sizeof(header));
+        if (memcmp(header.magic, KD_INDEX_FILE_MAGIC, sizeof(header.magic)) != 0) {
+            return "not an index file";
+        }
+        // Version 1 stored the box of every node in a record with its tuple; its inorder files are unchanged.
+        if (header.version != KD_INDEX_FILE_VERSION && !(header.version == 1 && header.layout == LAYOUT_INORDER)) {
+            return "unsupported index file version";
+        }
+        if (header.byteOrder != KD_INDEX_FILE_BYTE_ORDER) {
+            return "index file has the wrong byte order";
+        }
+        if (header.dim == 0 || header.dim > KD_MAX_DIMENSIONS || header.bucketSize == 0
+            || header.bucketSize > KD_MAX_BUCKET_SIZE || header.boundsDepth >= 63 || header.count > KD_MAX_TUPLES
+            || header.layout > LAYOUT_BLOCKED) {
+            return "invalid index file header";
+        }
+        
+        // Check the sections by division, so that no product of a crafted count can wrap.
+        if (header.fileSize != file.size()
+            || header.pointsOffset < sizeof(header) || header.pointsOffset % 64 != 0
+            || header.indicesOffset % 64 != 0 || header.boundsOffset % 64 != 0
+            || header.pointsOffset > header.indicesOffset || header.indicesOffset > header.boundsOffset
+            || header.boundsOffset > header.fileSize
+            || header.count > (header.indicesOffset - header.pointsOffset) / (header.dim * sizeof(float))
+            || header.count > (header.boundsOffset - header.indicesOffset) / sizeof(uint32_t)) {
+            return "index file sections do not match its size";
+        }
+        
+        // The size of the bounds section follows from the layout, the size and the bucket size.
+        KdTree loaded;
+        loaded.dim = header.dim;
+        loaded.count = (long) header.count;
+        loaded.bucketSize = header.bucketSize;
+        loaded.boundsDepth = (long) header.boundsDepth;
+        loaded.layout = (long) header.layout;
+        loaded.createLevels();
+        if (loaded.boundsDepth > loaded.nodeDepth) {
+            return "invalid index file header";
+        }
+        if ((uint64_t) loaded.boundsFloats() > (header.fileSize - header.boundsOffset) / sizeof(float)) {
+            return "index file sections do not match its size";
+        }
+        if (verify && kdChecksum(file.data() + sizeof(header), file.size() - sizeof(header)) != header.checksum) {
+            return "index file checksum mismatch";
+        }
+        
+        loaded.points = (const float *) (file.data() + header.pointsOffset);
+        loaded.indices = (const uint32_t *) (file.data() + header.indicesOffset);
+        loaded.bounds = (const float *) (file.data() + header.boundsOffset);
+        loaded.nodes = loaded.bounds + loaded.boxFloats();
+        loaded.mapping = std::move(file);
+        kdTree = std::move(loaded);
+        return "";
+    }
+    
+    /*
+     * Change the largest number of tuples in a leaf bucket.  The tree itself
+     * does not change, only where the searches stop descending.
+     */
+public:
+    void setBucketSize(const long size)
+    {
+        this->bucketSize = std::min(std::max(size, 1L), (long) KD_MAX_BUCKET_SIZE);
+        createBounds(1);
+    }
+    
+    /*
+     * Change the order in which the nodes above the leaf buckets are stored.
+     * The tree itself does not change, only where its nodes are read from.
+     */
+public:
+    void setLayout(const KdLayout layout)
+    {
+        this->layout = layout;
+        createBounds(1);
+    }
+    
+    /*
+     * Find the tuples that lie within a query box and pass the position of
+     * each of them to a sink.  The search reads only the tree and its
+     * arguments, so any number of searches may run concurrently.
+     *
+     * calling parameters:
+     *
+     * box - the query box
+     * sink - receives add(position) for each tuple in the query box, or
+     *        addSpan(start, end) for a subtree that lies within it
+     * stats - receives the number of nodes that are visited and of subtrees
+     *         and tuples that are accepted whole
+     */
+public:
+    template <typename Sink>
+    void rangeSearch(const KdBox& box, Sink& sink, KdRangeStats& stats) const
+    {
+        if (size() > 0) {
+            long slots[64];
+            if (this->layout == LAYOUT_INORDER) {
+                rangeSearch<false>(box, sink, stats, slots, 0, size() - 1, 0, 0);
+            } else {
+                rangeSearch<true>(box, sink, stats, slots, 0, size() - 1, 0, 0);
+            }
+        }
+    }
+    
+    template <typename Sink>
+    void rangeSearch(const KdBox& box, Sink& sink) const
+    {
+        KdRangeStats stats;
+        rangeSearch(box, sink, stats);
+    }
+    
+    /*
+     * Count the tuples within a query box and sum their coordinates, from
+     * which their centroid follows.  A subtree that lies within the box adds
+     * its count and, once createSums has precomputed them, its sums in O(1),
+     * so that the cost grows with the nodes near the faces of the box rather
+     * than with the tuples within it.
+     *
+     * calling parameters:
+     *
+     * box - the query box
+     * aggregate - receives the count and the sums
+     * stats - as for rangeSearch
+     */
+public:
+    void rangeAggregate(const KdBox& box, KdAggregate& aggregate, KdRangeStats& stats) const
+    {
+        aggregate = KdAggregate();
+        KdAggregateSink sink(*this, aggregate);
+        rangeSearch(box, sink, stats);
+    }
+    
+    void rangeAggregate(const KdBox& box, KdAggregate& aggregate) const
+    {
+        KdRangeStats stats;
+        rangeAggregate(box, aggregate, stats);
+    }
+    
+private:
+    template <bool Reordered, typename Sink>
+    void rangeSearch(const KdBox& box, Sink& sink, KdRangeStats& stats, long *slots,
+                     const long start, const long end, const long heap, const long depth) const
+    {
+        // Compare all tuples of a leaf bucket with the query box at once.  A
+        // subtree that stores its bounding box is never a leaf bucket.
+        KD_TRACE_VISIT(depth);
+        if (end - start < this->bucketSize) {
+            scanBucket(box, sink, start, end);
+            stats.scannedBuckets += 1;
+            stats.scannedTuples += end - start + 1;
+            KD_TRACE_SCAN(end - start + 1);
+            return;
+        }
+        
+        // A reordered node's tuple is read from its slot of the layout.
+        const long median = start + ((end - start) / 2);
+        const float *tuple = nullptr;
+        if (Reordered) {
+            slots[depth] = nodeSlot(slots, heap, depth);
+            tuple = &this->nodes[slots[depth] * this->dim];
+        }
+        
+        // Compare the bounding box of the subtree, where one is stored, with the
+        // query box.  A disjoint subtree is skipped and a contained one is passed
+        // to the sink as a whole.
+        if (depth < this->boundsDepth) {
+            const float *lower = &this->bounds[heap * 2 * this->dim];
+            const float *upper = lower + this->dim;
+            bool disjoint = false, contained = true;
+            for (long i = 0; i < this->dim; i++) {
+                disjoint |= (upper[i] < box.lower[i]) | (lower[i] > box.upper[i]);
+                contained &= (lower[i] >= box.lower[i]) & (upper[i] <= box.upper[i]);
+            }
+            if (disjoint) {
+                KD_TRACE_PRUNE(1);
+                return;
+            }
+            if (contained) {
+                sink.addSpan(start, end);
+                stats.bulkAcceptedSubtrees += 1;
+                stats.bulkAcceptedTuples += end - start + 1;
+                return;
+            }
+        }
+        
+        // Check if the current node is in the query box or not.
+        bool inside = true;
+        for (long i = 0; i < this->dim; i++) {
+            const float c = Reordered ? tuple[i] : coordinate(median, i);
+            inside &= (c >= box.lower[i]) & (c <= box.upper[i]);
+        }
+        if (inside) {
+            sink.add(median);
+        }
+        
+        stats.visitedNodes += 1;
+        KD_TRACE_TEST(1);
+        
+        // The < branch holds tuples whose partition coordinate is <= that of
+        // the node, and the > branch holds tuples whose coordinate is >= it.
+        const long axis = depth % this->dim;
+        const float split = Reordered ? tuple[axis] : coordinate(median, axis);
+        if (start < median && box.lower[axis] <= split) {
+            rangeSearch<Reordered>(box, sink, stats, slots, start, median - 1, 2 * heap + 1, depth + 1);
+        }
+        if (median < end && box.upper[axis] >= split) {
+            rangeSearch<Reordered>(box, sink, stats, slots, median + 1, end, 2 * heap + 2, depth + 1);
+        }
+        KD_TRACE_PRUNE((start < median && box.lower[axis] > split) + (median < end && box.upper[axis] < split));
+    }
+    
+    /*
+     * Pass the tuples of the leaf bucket [start, end] that lie within the query
+     * box to a sink.  A count needs no positions, so KdCountSink has its own overload.
+     */
+private:
+    template <typename Sink>
+    void scanBucket(const KdBox& box, Sink& sink, const long start, const long end) const
+    {
+        uint32_t selected[KD_MAX_BUCKET_SIZE];
+        const long n = kdKernels->selectInBox(this->points, size(), this->dim, start, end - start + 1,
+                                              box.lower, box.upper, selected);
+        for (long i = 0; i < n; i++) {
+            sink.add(selected[i]);
+        }
+    }
+    
+    void scanBucket(const KdBox& box, KdCountSink& sink, const long start, const long end) const
+    {
+        sink.count += kdKernels->countInBox(this->points, size(), this->dim, start, end - start + 1,
+                                            box.lower, box.upper);
+    }
+    
+    /*
+     * Count the tuples within each of a batch of query boxes.  The boxes are
+     * shared among threads that each claim chunks of consecutive boxes, and
+     * each count is written only by the thread that searched its box.
+     *
+     * calling parameters:
+     *
+     * boxes - the query boxes
+     * numThreads - the number of threads
+     *
+     * returns: the number of tuples within each box
+     */
+public:
+    std::vector<unsigned long> rangeCount(const std::vector<KdBox>& boxes, const long numThreads) const
+    {
+        std::vector<unsigned long> counts(boxes.size());
+        parallelFor((long) boxes.size(), numThreads, [&](const long, const long i) {
+            KdCountSink sink;
+            rangeSearch(boxes[i], sink);
+            counts[i] = sink.count;
+        });
+        return counts;
+    }
+    
+    /*
+     * Find the indices of the tuples within each of a batch of query boxes.
+     *
+     * calling parameters:
+     *
+     * boxes - the query boxes
+     * numThreads - the number of threads
+     *
+     * returns: the indices into the input coordinates of the tuples within each box
+     */
+public:
+    std::vector< std::vector<uint32_t> > rangeIndices(const std::vector<KdBox>& boxes, const long numThreads) const
+    {
+        std::vector< std::vector<uint32_t> > indices(boxes.size());
+        parallelFor((long) boxes.size(), numThreads, [&](const long, const long i) {
+            KdIndexSink sink(*this, indices[i]);
+            rangeSearch(boxes[i], sink);
+        });
+        return indices;
+    }
+    
+    /*
+     * Iterates over the tuples within a query box in the order of rangeSearch,
+     * searching the tree only as far as the tuples are taken.  The cursor
+     * keeps a stack of the subtrees that it has yet to search, the tuples of
+     * the current leaf bucket and the current subtree that lies within the box,
+     * so its memory is bounded by the height of the tree whatever the number
+     * of tuples within the box.  The tree must outlive the cursor.
+     */
+public:
+    class RangeCursor
+    {
+    private:
+        struct Entry
+        {
+            long start, end, heap, depth;
+        };
+        
+        const KdTree *tree;
+        KdBox box;
+        Entry stack[128];
+        long top;
+        long slots[64];
+        uint32_t pending[KD_MAX_BUCKET_SIZE];
+        long pendingNext, pendingCount;
+        long spanNext, spanEnd;
+        KdRangeStats stats;
+        
+    public:
+        RangeCursor(const KdTree& t, const KdBox& b) : tree(&t), box(b), top(0), pendingNext(0), pendingCount(0),
+        spanNext(0), spanEnd(-1)
+        {
+            if (t.size() > 0) {
+                this->stack[this->top++] = {0, t.size() - 1, 0, 0};
+            }
+        }
+        
+        /*
+         * Take the next tuples within the box.
+         *
+         * calling parameters:
+         *
+         * positions - receives the positions of the tuples in the tree
+         * capacity - the largest number of tuples to take
+         *
+         * returns: the number of tuples taken, which is less than capacity
+         *          only once every tuple has been taken
+         */
+        long next(long *positions, const long capacity)
+        {
+            return (this->tree->layout == LAYOUT_INORDER) ? advance<false>(positions, capacity) : advance<true>(positions, capacity);
+        }
+        
+        /*
+         * Pass over the next tuples within the box.  The tuples of a subtree
+         * that lies within the box are passed over without being read.
+         *
+         * returns: the number of tuples passed over, which is less than count
+         *          only once every tuple has been taken
+         */
+        long skip(const long count)
+        {
+            return (this->tree->layout == LAYOUT_INORDER) ? advance<false>(NULL, count) : advance<true>(NULL, count);
+        }
+        
+        /* The nodes visited and the subtrees and buckets accepted or scanned so far. */
+        const KdRangeStats& getStats() const
+        {
+            return this->stats;
+        }
+        
+    private:
+        template <bool Reordered>
+        long advance(long *positions, const long capacity)
+        {
+            const KdTree& t = *this->tree;
+            long n = 0;
+            while (n < capacity) {
+                if (this->pendingNext < this->pendingCount) {
+                    const long taken = std::min(capacity - n, this->pendingCount - this->pendingNext);
+                    for (long i = 0; positions != NULL && i < taken; i++) {
+                        positions[n + i] = this->pending[this->pendingNext + i];
+                    }
+                    this->pendingNext += taken;
+                    n += taken;
+                    continue;
+                }
+                if (this->spanNext <= this->spanEnd) {
+                    const long taken = std::min(capacity - n, this->spanEnd - this->spanNext + 1);
+                    for (long i = 0; positions != NULL && i < taken; i++) {
+                        positions[n + i] = this->spanNext + i;
+                    }
+                    this->spanNext += taken;
+                    n += taken;
+                    continue;
+                }
+                if (this->top == 0) {
+                    break;
+                }
+                
+                // Search the next subtree as rangeSearch does, but stack its
+                // children and keep its tuples within the box for the next calls.
+                const Entry entry = this->stack[--this->top];
+                KD_TRACE_VISIT(entry.depth);
+                if (entry.end - entry.start < t.bucketSize) {
+                    this->pendingCount = kdKernels->selectInBox(t.points, t.size(), t.dim, entry.start, entry.end - entry.start + 1,
+                                                                this->box.lower, this->box.upper, this->pending);
+                    this->pendingNext = 0;
+                    this->stats.scannedBuckets += 1;
+                    this->stats.scannedTuples += entry.end - entry.start + 1;
+                    KD_TRACE_SCAN(entry.end - entry.start + 1);
+                    continue;
+                }
+                const long median = entry.start + ((entry.end - entry.start) / 2);
+                const float *tuple = nullptr;
+                if (Reordered) {
+                    this->slots[entry.depth] = t.nodeSlot(this->slots, entry.heap, entry.depth);
+                    tuple = &t.nodes[this->slots[entry.depth] * t.dim];
+                }
+                if (entry.depth < t.boundsDepth) {
+                    const float *lower = &t.bounds[entry.heap * 2 * t.dim];
+                    const float *upper = lower + t.dim;
+                    bool disjoint = false, contained = true;
+                    for (long i = 0; i < t.dim; i++) {
+                        disjoint |= (upper[i] < this->box.lower[i]) | (lower[i] > this->box.upper[i]);
+                        contained &= (lower[i] >= this->box.lower[i]) & (upper[i] <= this->box.upper[i]);
+                    }
+                    if (disjoint) {
+                        KD_TRACE_PRUNE(1);
+                        continue;
+                    }
+                    if (contained) {
+                        this->spanNext = entry.start;
+                        this->spanEnd = entry.end;
+                        this->stats.bulkAcceptedSubtrees += 1;
+                        this->stats.bulkAcceptedTuples += entry.end - entry.start + 1;
+                        continue;
+                    }
+                }
+                bool inside = true;
+                for (long i = 0; i < t.dim; i++) {
+                    const float c = Reordered ? tuple[i] : t.coordinate(median, i);
+                    inside &= (c >= this->box.lower[i]) & (c <= this->box.upper[i]);
+                }
+                if (inside) {
+                    this->pending[0] = (uint32_t) median;
+                    this->pendingCount = 1;
+                    this->pendingNext = 0;
+                }
+                this->stats.visitedNodes += 1;
+                KD_TRACE_TEST(1);
+                
+                // Stack the > branch first so that the < branch is searched first.
+                const long axis = entry.depth % t.dim;
+                const float split = Reordered ? tuple[axis] : t.coordinate(median, axis);
+                if (median < entry.end && this->box.upper[axis] >= split) {
+                    this->stack[this->top++] = {median + 1, entry.end, 2 * entry.heap + 2, entry.depth + 1};
+                }
+                if (entry.start < median && this->box.lower[axis] <= split) {
+                    this->stack[this->top++] = {entry.start, median - 1, 2 * entry.heap + 1, entry.depth + 1};
+                }
+                KD_TRACE_PRUNE((entry.start < median && this->box.lower[axis] > split)
+                               + (median < entry.end && this->box.upper[axis] < split));
+            }
+            return n;
+        }
+    };
+    
+    /*
+     * Pass the tuples within a query box to a function in chunks as they are
+     * found, skipping the first offset of them and stopping the search after
+     * limit of them, so that a box of millions of tuples is searched once and
+     * its results are never held at once.
+     *
+     * calling parameters:
+     *
+     * box - the query box
+     * offset - the number of tuples to skip
+     * limit - the largest number of tuples to pass
+     * chunk - called as chunk(positions, count) with up to KD_RANGE_CHUNK_SIZE
+     *         positions of tuples in the tree at a time
+     *
+     * returns: the number of tuples passed to the function
+     */
+public:
+    template <typename Function>
+    long rangeStream(const KdBox& box, const long offset, const long limit, Function chunk) const
+    {
+        RangeCursor cursor(*this, box);
+        cursor.skip(offset);
+        long positions[KD_RANGE_CHUNK_SIZE];
+        long passed = 0;
+        while (passed < limit) {
+            const long n = cursor.next(positions, std::min(limit - passed, (long) KD_RANGE_CHUNK_SIZE));
+            if (n == 0) {
+                break;
+            }
+            chunk((const long *) positions, n);
+            passed += n;
+        }
+        return passed;
+    }
+    
+    /*
+     * Find the k tuples that lie nearest to a query point.
+     *
+     * calling parameters:
+     *
+     * query - the query point
+     * k - the number of tuples to find
+     * result - receives the nearest tuples in order of increasing distance;
+     *          its capacity is reused from one call to the next
+     * stats - receives the number of nodes that are visited and of buckets
+     *         and tuples that are scanned
+     */
+public:
+    void knn(const float *query, const long k, std::vector<KdNeighbour>& result, KdRangeStats& stats) const
+    {
+        result.clear();
+        if (size() > 0 && k > 0) {
+            KnnCollector collector(result, k);
+            nearestSearch(query, collector, stats);
+            std::sort_heap(result.begin(), result.end());
+        }
+    }
+    
+    void knn(const float *query, const long k, std::vector<KdNeighbour>& result) const
+    {
+        KdRangeStats stats;
+        knn(query, k, result, stats);
+    }
+    
+    std::vector<KdNeighbour> knn(const float *query, const long k) const
+    {
+        std::vector<KdNeighbour> result;
+        result.reserve(std::max(std::min(k, size()), 0L));
+        knn(query, k, result);
+        return result;
+    }
+    
+    /*
+     * Find k tuples near a query point by a best-bin-first search, which
+     * searches the subtrees in order of their distance from the query and
+     * stops early where an approximation allows.  A subtree is skipped if its
+     * distance times 1 + epsilon exceeds that of the k-th nearest tuple found
+     * so far, so that each tuple found lies within 1 + epsilon times the
+     * distance of the true neighbour of its rank.  The search also stops once
+     * it has scanned maxLeaves leaf buckets or visited maxNodes nodes, and
+     * then returns the nearest tuples found so far.
+     *
+     * calling parameters:
+     *
+     * query - the query point
+     * k - the number of tuples to find
+     * approximation - the distance tolerance and the budget of the search
+     * result - receives the tuples in order of increasing distance
+     * stats - receives the number of nodes that are visited and of buckets
+     *         and tuples that are scanned
+     *
+     * returns: true if no subtree that was left unsearched could hold a
+     *          nearer tuple, so that the result is that of knn
+     */
+public:
+    bool knnApproximate(const float *query, const long k, const KdApproximation& approximation,
+                        std::vector<KdNeighbour>& result, KdRangeStats& stats) const
+    {
+        result.clear();
+        if (size() == 0 || k <= 0) {
+            return true;
+        }
+        KnnCollector collector(result, k);
+        const bool exact = (this->layout == LAYOUT_INORDER) ? priorityKnn<false>(query, collector, approximation, stats)
+                                                            : priorityKnn<true>(query, collector, approximation, stats);
+        std::sort_heap(result.begin(), result.end());
+        return exact;
+    }
+    
+    bool knnApproximate(const float *query, const long k, const KdApproximation& approximation,
+                        std::vector<KdNeighbour>& result) const
+    {
+        KdRangeStats stats;
+        return knnApproximate(query, k, approximation, result, stats);
+    }
+    
+    /*
+     * Find the tuples that lie within a fixed distance of a query point.
+     *
+     * calling parameters:
+     *
+     * query - the query point
+     * radius - the search distance
+     * result - receives the tuples in order of increasing distance
+     */
+public:
+    void radiusSearch(const float *query, const float radius, std::vector<KdNeighbour>& result) const
+    {
+        result.clear();
+        if (size() > 0 && radius >= 0) {
+            RadiusCollector collector(result, radius * radius);
+            KdRangeStats stats;
+            nearestSearch(query, collector, stats);
+            std::sort(result.begin(), result.end());
+        }
+    }
+    
+    std::vector<KdNeighbour> radiusSearch(const float *query, const float radius) const
+    {
+        std::vector<KdNeighbour> result;
+        radiusSearch(query, radius, result);
+        return result;
+    }
+    
+    /*
+     * Find the k nearest tuples to each of a batch of query points.  The
+     * queries are sorted along a Morton curve so that consecutive queries
+     * visit mostly the same nodes, and the sorted queries are shared among
+     * threads in blocks.  Each thread keeps KD_BATCH_LANES queries in flight
+     * and advances them in turn by one node each, prefetching the node that
+     * a query visits next, so that one query's memory accesses overlap with
+     * the others' work.  Each query finds the same tuples as knn.  The
+     * queries are not traced with KD_TRACE, whose counters are per thread
+     * and so cannot tell the interleaved queries apart.
+     *
+     * calling parameters:
+     *
+     * queries - the query points, dim floats each
+     * numQueries - the number of query points
+     * k - the number of tuples to find for each query
+     * numThreads - the number of threads
+     *
+     * returns: min(k, size()) neighbours of each query in the original order
+     *          of the queries, each query's in order of increasing distance
+     */
+public:
+    std::vector<KdNeighbour> knnBatch(const float *queries, const long numQueries, const long k, const long numThreads) const
+    {
+        const long found = std::max(std::min(k, size()), 0L);
+        std::vector<KdNeighbour> result(numQueries * found, KdNeighbour(0, 0));
+        if (found == 0 || numQueries <= 0) {
+            return result;
+        }
+        const std::vector<long> order = mortonOrder(queries, numQueries, this->dim);
+        const long numBlocks = (numQueries + KD_BATCH_BLOCK_SIZE - 1) / KD_BATCH_BLOCK_SIZE;
+        std::vector< std::vector<BatchLane> > lanes(std::max(numThreads, 1L), std::vector<BatchLane>(KD_BATCH_LANES));
+        parallelFor(numBlocks, numThreads, [&](const long thread, const long block) {
+            const long first = block * KD_BATCH_BLOCK_SIZE;
+            const long last = std::min(first + KD_BATCH_BLOCK_SIZE, numQueries);
+            if (this->layout == LAYOUT_INORDER) {
+                knnPipeline<false>(queries, &order[first], last - first, found, lanes[thread], result.data());
+            } else {
+                knnPipeline<true>(queries, &order[first], last - first, found, lanes[thread], result.data());
+            }
+        });
+        return result;
+    }
+    
+    /*
+     * Find the pairs of a tuple of this tree and a tuple of another tree that
+     * lie within a distance of each other, by a dual-tree traversal.  This
+     * tree is cut into groups of up to KD_JOIN_GROUP_SIZE consecutive tuples,
+     * each a subtree or the median of a larger one, and each group descends
+     * the other tree together: a subtree of the other tree is skipped where
+     * its bounding box lies farther than the distance from that of the group,
+     * and passed to the sink whole with the group where it lies within the
+     * distance.  The groups are shared among threads.
+     *
+     * calling parameters:
+     *
+     * other - the other tree, of the same number of dimensions
+     * radius - the join distance
+     * sinks - one sink per thread, each of which receives add(a, b) for a pair
+     *         of positions in this tree and in the other tree, or
+     *         addBlock(aStart, aEnd, bStart, bEnd) for all pairs of two spans
+     * numThreads - the number of threads
+     * traces - one summary per thread, which receives the work of each group
+     *          when compiled with KD_TRACE, or null
+     */
+public:
+    template <typename Sink>
+    void joinWithin(const KdTree& other, const float radius, std::vector<Sink>& sinks, const long numThreads,
+                    KdTraceSummary *traces = nullptr) const
+    {
+        if (size() == 0 || other.size() == 0 || radius < 0 || other.dim != this->dim) {
+            return;
+        }
+        std::vector< std::pair<long, long> > groups;
+        joinGroups(groups, 0, size() - 1);
+        parallelFor((long) groups.size(), numThreads, [&](const long thread, const long g) {
+            static thread_local KdTraceSummary untraced;
+            KdTraceScope trace((traces != nullptr) ? traces[thread] : untraced);
+            JoinGroup group;
+            loadJoinGroup(groups[g].first, groups[g].second, group);
+            float lower[KD_MAX_DIMENSIONS], upper[KD_MAX_DIMENSIONS];
+            std::fill(lower, lower + this->dim, -INFINITY);
+            std::fill(upper, upper + this->dim, INFINITY);
+            uint8_t active[KD_JOIN_GROUP_SIZE];
+            for (long i = 0; i < group.count; i++) {
+                active[i] = (uint8_t) i;
+            }
+            long slots[64];
+            if (other.layout == LAYOUT_INORDER) {
+                other.joinSearch<false>(group, radius * radius, sinks[thread], slots, active, group.count, lower, upper,
+                                        0, other.size() - 1, 0, 0);
+            } else {
+                other.joinSearch<true>(group, radius * radius, sinks[thread], slots, active, group.count, lower, upper,
+                                       0, other.size() - 1, 0, 0);
+            }
+        });
+    }
+    
+    /*
+     * Find the nearest tuple of another tree to each tuple of this tree, within
+     * a distance, by the dual-tree traversal of joinWithin.  A tuple of a
+     * group stops descending where the cell lies farther from it than the
+     * nearest tuple found so far for it.
+     *
+     * calling parameters:
+     *
+     * other - the other tree, of the same number of dimensions
+     * radius - the largest distance, or INFINITY
+     * numThreads - the number of threads
+     * traces - one summary per thread, which receives the work of each group
+     *          when compiled with KD_TRACE, or null
+     *
+     * returns: for each position in this tree, the squared distance and the
+     *          position in the other tree of its nearest tuple, or position -1
+     *          if none lies within the distance
+     */
+public:
+    std::vector<KdNeighbour> nearestWithin(const KdTree& other, const float radius, const long numThreads,
+                                           KdTraceSummary *traces = nullptr) const
+    {
+        std::vector<KdNeighbour> result(size(), KdNeighbour(INFINITY, -1));
+        if (size() == 0 || other.size() == 0 || radius < 0 || other.dim != this->dim) {
+            return result;
+        }
+        std::vector< std::pair<long, long> > groups;
+        joinGroups(groups, 0, size() - 1);
+        parallelFor((long) groups.size(), numThreads, [&](const long thread, const long g) {
+            static thread_local KdTraceSummary untraced;
+            KdTraceScope trace((traces != nullptr) ? traces[thread] : untraced);
+            JoinGroup group;
+            loadJoinGroup(groups[g].first, groups[g].second, group);
+            std::fill(group.best, group.best + group.count, radius * radius);
+            std::fill(group.nearest, group.nearest + group.count, -1L);
+            float lower[KD_MAX_DIMENSIONS], upper[KD_MAX_DIMENSIONS];
+            std::fill(lower, lower + this->dim, -INFINITY);
+            std::fill(upper, upper + this->dim, INFINITY);
+            uint8_t active[KD_JOIN_GROUP_SIZE];
+            for (long i = 0; i < group.count; i++) {
+                active[i] = (uint8_t) i;
+            }
+            long slots[64];
+            if (other.layout == LAYOUT_INORDER) {
+                other.nearestGroupSearch<false>(group, slots, active, group.count, lower, upper, 0, other.size() - 1, 0, 0);
+            } else {
+                other.nearestGroupSearch<true>(group, slots, active, group.count, lower, upper, 0, other.size() - 1, 0, 0);
+            }
+            for (long i = 0; i < group.count; i++) {
+                if (group.nearest[i] >= 0) {
+                    result[group.start + i] = KdNeighbour(group.best[i], group.nearest[i]);
+                }
+            }
+        });
+        return result;
+    }
+    
+    /*
+     * A group of consecutive tuples of one tree that descends another tree
+     * together: their coordinates, one tuple after another, their bounding
+     * box and, for nearestWithin, the nearest tuple found so far for each.
+     */
+private:
+    struct JoinGroup
+    {
+        long start, count;
+        float tuples[KD_JOIN_GROUP_SIZE * KD_MAX_DIMENSIONS];
+        float lower[KD_MAX_DIMENSIONS], upper[KD_MAX_DIMENSIONS];
+        float best[KD_JOIN_GROUP_SIZE];
+        long nearest[KD_JOIN_GROUP_SIZE];
+    };
+    
+    /*
+     * Cut the subtree [start, end] into the groups of joinWithin: subtrees of
+     * up to KD_JOIN_GROUP_SIZE tuples, and the medians of larger subtrees.
+     */
+private:
+    void joinGroups(std::vector< std::pair<long, long> >& groups, const long start, const long end) const
+    {
+        if (end - start < KD_JOIN_GROUP_SIZE) {
+            groups.push_back(std::make_pair(start, end));
+            return;
+        }
+        const long median = start + ((end - start) / 2);
+        groups.push_back(std::make_pair(median, median));
+        joinGroups(groups, start, median - 1);
+        joinGroups(groups, median + 1, end);
+    }
+    
+    void loadJoinGroup(const long start, const long end, JoinGroup& group) const
+    {
+        group.start = start;
+        group.count = end - start + 1;
+        for (long a = 0; a < this->dim; a++) {
+            group.lower[a] = INFINITY;
+            group.upper[a] = -INFINITY;
+            for (long i = 0; i < group.count; i++) {
+                const float c = coordinate(start + i, a);
+                group.tuples[i * this->dim + a] = c;
+                group.lower[a] = std::min(group.lower[a], c);
+                group.upper[a] = std::max(group.upper[a], c);
+            }
+        }
+    }
+    
+    /*
+     * Return the smallest or the largest squared distance between two boxes,
+     * summed axis by axis in the precision of the distance kernels, so that the
+     * largest is never below the distance that a kernel finds for a pair.
+     */
+private:
+    KD_NO_FP_CONTRACT
+    static float boxDistance(const float *aLower, const float *aUpper, const float *bLower, const float *bUpper,
+                             const long dim, const bool farthest)
+    {
+        float distance = 0;
+        for (long a = 0; a < dim; a++) {
+            const float d = farthest ? std::max(aUpper[a] - bLower[a], bUpper[a] - aLower[a])
+                                     : std::max(std::max(bLower[a] - aUpper[a], aLower[a] - bUpper[a]), 0.f);
+            distance += d * d;
+        }
+        return distance;
+    }
+    
+    /*
+     * Return the smallest or the largest squared distance between a point and
+     * a box, in the precision of the distance kernels as boxDistance is.
+     */
+private:
+    KD_NO_FP_CONTRACT
+    static float pointDistance(const float *point, const float *lower, const float *upper, const long dim,
+                               const bool farthest)
+    {
+        float distance = 0;
+        for (long a = 0; a < dim; a++) {
+            const float d = farthest ? std::max(point[a] - lower[a], upper[a] - point[a])
+                                     : std::max(std::max(lower[a] - point[a], point[a] - upper[a]), 0.f);
+            distance += d * d;
+        }
+        return distance;
+    }
+    
+    /*
+     * Pass the pairs of a group and the tuples of the subtree [start, end]
+     * that lie within the join distance to a sink.  The cell bounds the
+     * subtree by the partitions of its ancestors, and a stored bounding box
+     * replaces it where there is one.  Only the active tuples of the group,
+     * those within the distance of the parent's cell, are compared with the
+     * subtree, and only those within the distance of its cell descend further.
+     */
+private:
+    template <bool Reordered, typename Sink>
+    KD_NO_FP_CONTRACT
+    void joinSearch(const JoinGroup& group, const float r2, Sink& sink, long *slots, const uint8_t *active,
+                    const long numActive, const float *cellLower, const float *cellUpper,
+                    const long start, const long end, const long heap, const long depth) const
+    {
+        KD_TRACE_VISIT(depth);
+        if (end - start < this->bucketSize) {
+            KD_TRACE_SCAN(numActive * (end - start + 1));
+            float distances[KD_MAX_BUCKET_SIZE];
+            for (long k = 0; k < numActive; k++) {
+                const long i = active[k];
+                kdKernels->squaredDistances(this->points, size(), this->dim, start, end - start + 1,
+                                            &group.tuples[i * this->dim], distances);
+                for (long j = 0; j <= end - start; j++) {
+                    if (distances[j] <= r2) {
+                        sink.add(group.start + i, start + j);
+                    }
+                }
+            }
+            return;
+        }
+        
+        const long median = start + ((end - start) / 2);
+        const float *nodeTuple = nullptr;
+        if (Reordered) {
+            slots[depth] = nodeSlot(slots, heap, depth);
+            nodeTuple = &this->nodes[slots[depth] * this->dim];
+        }
+        const float *lower = cellLower, *upper = cellUpper;
+        if (depth < this->boundsDepth) {
+            lower = &this->bounds[heap * 2 * this->dim];
+            upper = lower + this->dim;
+        }
+        
+        // A whole group within the distance of the whole subtree is passed as a block.
+        if (numActive == group.count && boxDistance(group.lower, group.upper, lower, upper, this->dim, true) <= r2) {
+            sink.addBlock(group.start, group.start + group.count - 1, start, end);
+            return;
+        }
+        uint8_t next[KD_JOIN_GROUP_SIZE];
+        long numNext = 0;
+        for (long k = 0; k < numActive; k++) {
+            const float *point = &group.tuples[active[k] * this->dim];
+            if (pointDistance(point, lower, upper, this->dim, false) <= r2) {
+                if (pointDistance(point, lower, upper, this->dim, true) <= r2) {
+                    sink.addBlock(group.start + active[k], group.start + active[k], start, end);
+                } else {
+                    next[numNext++] = active[k];
+                }
+            }
+        }
+        if (numNext == 0) {
+            KD_TRACE_PRUNE(1);
+            return;
+        }
+        KD_TRACE_TEST(numNext);
+        
+        float tuple[KD_MAX_DIMENSIONS];
+        for (long a = 0; a < this->dim; a++) {
+            tuple[a] = Reordered ? nodeTuple[a] : coordinate(median, a);
+        }
+        for (long k = 0; k < numNext; k++) {
+            float distance = 0;
+            for (long a = 0; a < this->dim; a++) {
+                const float d = group.tuples[next[k] * this->dim + a] - tuple[a];
+                distance += d * d;
+            }
+            if (distance <= r2) {
+                sink.add(group.start + next[k], median);
+            }
+        }
+        
+        // The < branch lies at or below the partition and the > branch at or above it.
+        const long axis = depth % this->dim;
+        float childLower[KD_MAX_DIMENSIONS], childUpper[KD_MAX_DIMENSIONS];
+        std::copy(lower, lower + this->dim, childLower);
+        std::copy(upper, upper + this->dim, childUpper);
+        if (start < median) {
+            childUpper[axis] = std::min(upper[axis], tuple[axis]);
+            joinSearch<Reordered>(group, r2, sink, slots, next, numNext, childLower, childUpper,
+                                  start, median - 1, 2 * heap + 1, depth + 1);
+            childUpper[axis] = upper[axis];
+        }
+        if (median < end) {
+            childLower[axis] = std::max(lower[axis], tuple[axis]);
+            joinSearch<Reordered>(group, r2, sink, slots, next, numNext, childLower, childUpper,
+                                  median + 1, end, 2 * heap + 2, depth + 1);
+        }
+    }
+    
+    /*
+     * Update the nearest tuples of a group with the tuples of the subtree
+     * [start, end], as joinSearch does, where each active tuple of the group
+     * descends only while the cell lies within the distance of the nearest
+     * tuple found so far for it.  The branch whose cell lies nearer to the
+     * group is searched first.  A tuple at exactly the largest distance is
+     * accepted.
+     */
+private:
+    template <bool Reordered>
+    void nearestGroupSearch(JoinGroup& group, long *slots, const uint8_t *active, const long numActive,
+                            const float *cellLower, const float *cellUpper,
+                            const long start, const long end, const long heap, const long depth) const
+    {
+        auto update = [&group](const long i, const float distance, const long position) {
+            if (distance < group.best[i] || (distance == group.best[i] && group.nearest[i] < 0)) {
+                group.best[i] = distance;
+                group.nearest[i] = position;
+            }
+        };
+        KD_TRACE_VISIT(depth);
+        if (end - start < this->bucketSize) {
+            KD_TRACE_SCAN(numActive * (end - start + 1));
+            float distances[KD_MAX_BUCKET_SIZE];
+            for (long k = 0; k < numActive; k++) {
+                kdKernels->squaredDistances(this->points, size(), this->dim, start, end - start + 1,
+                                            &group.tuples[active[k] * this->dim], distances);
+                for (long j = 0; j <= end - start; j++) {
+                    update(active[k], distances[j], start + j);
+                }
+            }
+            return;
+        }
+        
+        const long median = start + ((end - start) / 2);
+        const float *nodeTuple = nullptr;
+        if (Reordered) {
+            slots[depth] = nodeSlot(slots, heap, depth);
+            nodeTuple = &this->nodes[slots[depth] * this->dim];
+        }
+        const float *lower = cellLower, *upper = cellUpper;
+        if (depth < this->boundsDepth) {
+            lower = &this->bounds[heap * 2 * this->dim];
+            upper = lower + this->dim;
+        }
+        uint8_t next[KD_JOIN_GROUP_SIZE];
+        long numNext = 0;
+        for (long k = 0; k < numActive; k++) {
+            if (pointDistance(&group.tuples[active[k] * this->dim], lower, upper, this->dim, false) <= group.best[active[k]]) {
+                next[numNext++] = active[k];
+            }
+        }
+        if (numNext == 0) {
+            KD_TRACE_PRUNE(1);
+            return;
+        }
+        KD_TRACE_TEST(numNext);
+        
+        float tuple[KD_MAX_DIMENSIONS];
+        for (long a = 0; a < this->dim; a++) {
+            tuple[a] = Reordered ? nodeTuple[a] : coordinate(median, a);
+        }
+        for (long k = 0; k < numNext; k++) {
+            float distance = 0;
+            for (long a = 0; a < this->dim; a++) {
+                const float d = group.tuples[next[k] * this->dim + a] - tuple[a];
+                distance += d * d;
+            }
+            update(next[k], distance, median);
+        }
+        
+        const long axis = depth % this->dim;
+        float ltUpper[KD_MAX_DIMENSIONS], gtLower[KD_MAX_DIMENSIONS];
+        std::copy(upper, upper + this->dim, ltUpper);
+        std::copy(lower, lower + this->dim, gtLower);
+        ltUpper[axis] = std::min(upper[axis], tuple[axis]);
+        gtLower[axis] = std::max(lower[axis], tuple[axis]);
+        const bool ltFirst = group.lower[axis] + group.upper[axis] <= 2 * tuple[axis];
+        for (long pass = 0; pass < 2; pass++) {
+            if ((pass == 0) == ltFirst) {
+                if (start < median) {
+                    nearestGroupSearch<Reordered>(group, slots, next, numNext, lower, ltUpper, start, median - 1, 2 * heap + 1, depth + 1);
+                }
+            } else if (median < end) {
+                nearestGroupSearch<Reordered>(group, slots, next, numNext, gtLower, upper, median + 1, end, 2 * heap + 2, depth + 1);
+            }
+        }
+    }
+    
+    /*
+     * Keeps the k nearest tuples found so far in a max-heap on their distance,
+     * so the k-th best distance bounds the search.
+     */
+private:
+    class KnnCollector
+    {
+    private:
+        std::vector<KdNeighbour>& heap;
+        const size_t k;
+        
+    public:
+        KnnCollector(std::vector<KdNeighbour>& h, const long n) : heap(h), k((size_t) n) {}
+        
+        float bound() const
+        {
+            return (heap.size() < k) ? INFINITY : heap.front().distance;
+        }
+        
+        void add(const float distance, const long position)
+        {
+            if (heap.size() < k) {
+                heap.push_back(KdNeighbour(distance, position));
+                std::push_heap(heap.begin(), heap.end());
+            } else if (distance < heap.front().distance) {
+                std::pop_heap(heap.begin(), heap.end());
+                heap.back() = KdNeighbour(distance, position);
+                std::push_heap(heap.begin(), heap.end());
+            }
+        }
+    };
+    
+    /*
+     * Keeps every tuple within a fixed squared distance.
+     */
+private:
+    class RadiusCollector
+    {
+    private:
+        std::vector<KdNeighbour>& result;
+        const float radius2;
+        
+    public:
+        RadiusCollector(std::vector<KdNeighbour>& r, const float d) : result(r), radius2(d) {}
+        
+        float bound() const
+        {
+            return radius2;
+        }
+        
+        void add(const float distance, const long position)
+        {
+            if (distance <= radius2) {
+                result.push_back(KdNeighbour(distance, position));
+            }
+        }
+    };
+    
+    /*
+     * Search the subtree [start, end] for tuples nearer to the query point than
+     * the collector's bound.  The branch on the query's side of the partition is
+     * searched first, and the other branch only if the squared distance to the
+     * partition plane does not exceed the bound, which may have shrunk meanwhile.
+     */
+private:
+    template <typename Collector>
+    void nearestSearch(const float *query, Collector& collector, KdRangeStats& stats) const
+    {
+        long slots[64];
+        if (this->layout == LAYOUT_INORDER) {
+            nearestSearch<false>(query, collector, stats, slots, 0, size() - 1, 0, 0);
+        } else {
+            nearestSearch<true>(query, collector, stats, slots, 0, size() - 1, 0, 0);
+        }
+    }
+    
+    template <bool Reordered, typename Collector>
+    void nearestSearch(const float *query, Collector& collector, KdRangeStats& stats, long *slots,
+                       const long start, const long end, const long heap, const long depth) const
+    {
+        // Measure the distances of all tuples of a leaf bucket at once.
+        KD_TRACE_VISIT(depth);
+        if (end - start < this->bucketSize) {
+            float distances[KD_MAX_BUCKET_SIZE];
+            kdKernels->squaredDistances(this->points, size(), this->dim, start, end - start + 1, query, distances);
+            for (long i = 0; i <= end - start; i++) {
+                collector.add(distances[i], start + i);
+            }
+            stats.scannedBuckets += 1;
+            stats.scannedTuples += end - start + 1;
+            KD_TRACE_SCAN(end - start + 1);
+            return;
+        }
+        
+        const long median = start + ((end - start) / 2);
+        const float *tuple = nullptr;
+        if (Reordered) {
+            slots[depth] = nodeSlot(slots, heap, depth);
+            tuple = &this->nodes[slots[depth] * this->dim];
+        }
+        float distance = 0;
+        for (long i = 0; i < this->dim; i++) {
+            const float d = (Reordered ? tuple[i] : coordinate(median, i)) - query[i];
+            distance += d * d;
+        }
+        collector.add(distance, median);
+        stats.visitedNodes += 1;
+        KD_TRACE_TEST(1);
+        
+        const long axis = depth % this->dim;
+        const float split = query[axis] - (Reordered ? tuple[axis] : coordinate(median, axis));
+        const bool hasLt = start < median, hasGt = median < end;
+        if (split <= 0) {
+            if (hasLt) nearestSearch<Reordered>(query, collector, stats, slots, start, median - 1, 2 * heap + 1, depth + 1);
+            if (hasGt && split * split <= collector.bound()) nearestSearch<Reordered>(query, collector, stats, slots, median + 1, end, 2 * heap + 2, depth + 1);
+            else KD_TRACE_PRUNE(hasGt);
+        } else {
+            if (hasGt) nearestSearch<Reordered>(query, collector, stats, slots, median + 1, end, 2 * heap + 2, depth + 1);
+            if (hasLt && split * split <= collector.bound()) nearestSearch<Reordered>(query, collector, stats, slots, start, median - 1, 2 * heap + 1, depth + 1);
+            else KD_TRACE_PRUNE(hasLt);
+        }
+    }
+    
+    /*
+     * A subtree that knnApproximate has yet to search, and the squared
+     * distance below which it may hold a nearer tuple.
+     */
+private:
+    struct PriorityEntry
+    {
+        float gap;
+        long start, end, heap, depth;
+        
+        bool operator<(const PriorityEntry& other) const
+        {
+            return this->gap > other.gap;  // the nearest subtree is on top of the heap
+        }
+    };
+    
+    /*
+     * Set the slots of the ancestors of a node, which a search that does not
+     * descend from the root to the node cannot carry down.  The ancestor of
+     * heap number heap at depth d has heap number ((heap + 1) >> (depth - d)) - 1.
+     */
+    void ancestorSlots(long *slots, const long heap, const long depth) const
+    {
+        for (long d = 0; d < depth; d++) {
+            slots[d] = nodeSlot(slots, ((heap + 1) >> (depth - d)) - 1, d);
+        }
+    }
+    
+    /*
+     * Search for the k nearest tuples, as knnApproximate describes.  Each
+     * subtree taken from the priority queue is descended to a leaf bucket on
+     * the query's side, with the far branch at each node queued at the squared
+     * distance to its partition plane, or to the subtree that it branches
+     * from if that is larger.  The search ends once the nearest queued
+     * subtree is excluded, which excludes all of them, or the budget is spent.
+     *
+     * returns: true if no subtree that was skipped or left queued could hold
+     *          a tuple nearer than the k-th nearest found
+     */
+private:
+    template <bool Reordered>
+    bool priorityKnn(const float *query, KnnCollector& collector, const KdApproximation& approximation,
+                     KdRangeStats& stats) const
+    {
+        const float scale = (1 + approximation.epsilon) * (1 + approximation.epsilon);
+        const unsigned long maxLeaves = (approximation.maxLeaves > 0) ? stats.scannedBuckets + approximation.maxLeaves : ULONG_MAX;
+        const unsigned long maxNodes = (approximation.maxNodes > 0) ? stats.visitedNodes + approximation.maxNodes : ULONG_MAX;
+        // Each thread keeps its queue from one search to the next, so that a
+        // search allocates only when its queue outgrows those before it.
+        static thread_local std::vector<PriorityEntry> queue;
+        queue.clear();
+        queue.push_back({0, 0, size() - 1, 0, 0});
+        float skipped = INFINITY;  // the smallest distance of a subtree that was not queued
+        bool pruned = false;       // whether the tolerance excluded any subtree
+        long slots[64];
+        while (!queue.empty() && queue.front().gap * scale <= collector.bound()
+               && stats.scannedBuckets < maxLeaves && stats.visitedNodes < maxNodes) {
+            std::pop_heap(queue.begin(), queue.end());
+            PriorityEntry entry = queue.back();
+            queue.pop_back();
+            if (Reordered) {
+                ancestorSlots(slots, entry.heap, entry.depth);
+            }
+            for (;;) {
+                KD_TRACE_VISIT(entry.depth);
+                if (entry.end - entry.start < this->bucketSize) {
+                    float distances[KD_MAX_BUCKET_SIZE];
+                    kdKernels->squaredDistances(this->points, size(), this->dim, entry.start, entry.end - entry.start + 1,
+                                                query, distances);
+                    for (long i = 0; i <= entry.end - entry.start; i++) {
+                        collector.add(distances[i], entry.start + i);
+                    }
+                    stats.scannedBuckets += 1;
+                    stats.scannedTuples += entry.end - entry.start + 1;
+                    KD_TRACE_SCAN(entry.end - entry.start + 1);
+                    break;
+                }
+                
+                // Requeue the rest of a descent that runs out of its budget of nodes.
+                if (stats.visitedNodes >= maxNodes) {
+                    queue.push_back(entry);
+                    std::push_heap(queue.begin(), queue.end());
+                    break;
+                }
+                const long median = entry.start + ((entry.end - entry.start) / 2);
+                const float *tuple = nullptr;
+                if (Reordered) {
+                    slots[entry.depth] = nodeSlot(slots, entry.heap, entry.depth);
+                    tuple = &this->nodes[slots[entry.depth] * this->dim];
+                }
+                float distance = 0;
+                for (long i = 0; i < this->dim; i++) {
+                    const float d = (Reordered ? tuple[i] : coordinate(median, i)) - query[i];
+                    distance += d * d;
+                }
+                collector.add(distance, median);
+                stats.visitedNodes += 1;
+                KD_TRACE_TEST(1);
+                
+                const long axis = entry.depth % this->dim;
+                const float split = query[axis] - (Reordered ? tuple[axis] : coordinate(median, axis));
+                PriorityEntry lt = {entry.gap, entry.start, median - 1, 2 * entry.heap + 1, entry.depth + 1};
+                PriorityEntry gt = {entry.gap, median + 1, entry.end, 2 * entry.heap + 2, entry.depth + 1};
+                PriorityEntry& nearChild = (split <= 0) ? lt : gt;
+                PriorityEntry& farChild = (split <= 0) ? gt : lt;
+                farChild.gap = std::max(entry.gap, split * split);
+                if (farChild.start <= farChild.end) {
+                    if (farChild.gap * scale <= collector.bound()) {
+                        queue.push_back(farChild);
+                        std::push_heap(queue.begin(), queue.end());
+                    } else {
+                        skipped = std::min(skipped, farChild.gap);
+                        pruned = true;
+                        KD_TRACE_PRUNE(1);
+                    }
+                }
+                if (nearChild.start > nearChild.end) {
+                    break;
+                }
+                entry = nearChild;
+            }
+        }
+        
+        // A search that drained its queue without excluding a subtree read every
+        // tuple, even if fewer than k tuples left the bound infinite.
+        if (queue.empty() && !pruned) {
+            return true;
+        }
+        const float remaining = queue.empty() ? INFINITY : queue.front().gap;
+        return std::min(remaining, skipped) > collector.bound();
+    }
+    
+    /*
+     * Return the order of a set of points along a Morton curve: each point's
+     * coordinates are scaled to integers within the bounding box of the
+     * points, and their bits are interleaved from the most significant down.
+     *
+     * calling parameters:
+     *
+     * points - the points, dim floats each
+     * count - the number of points
+     * dim - the number of dimensions
+     *
+     * returns: the indices of the points in order along the curve
+     */
+private:
+    static std::vector<long> mortonOrder(const float *points, const long count, const long dim)
+    {
+        float lower[KD_MAX_DIMENSIONS], upper[KD_MAX_DIMENSIONS];
+        std::copy(points, points + dim, lower);
+        std::copy(points, points + dim, upper);
+        for (long i = 1; i < count; i++) {
+            for (long a = 0; a < dim; a++) {
+                lower[a] = std::min(lower[a], points[i * dim + a]);
+                upper[a] = std::max(upper[a], points[i * dim + a]);
+            }
+        }
+        // One dimension takes 63 bits, which a signed shift would overflow.
+        const long bits = 63 / dim;
+        const double maximum = (double) ((1ULL << bits) - 1);
+        std::vector< std::pair<uint64_t, long> > codes(count);
+        for (long i = 0; i < count; i++) {
+            uint64_t cell[KD_MAX_DIMENSIONS];
+            for (long a = 0; a < dim; a++) {
+                const double extent = (double) upper[a] - lower[a];
+                const double scaled = (extent > 0) ? (points[i * dim + a] - lower[a]) / extent * maximum : 0;
+                cell[a] = (uint64_t) std::min(std::max(scaled, 0.), maximum);
+            }
+            uint64_t code = 0;
+            for (long b = bits - 1; b >= 0; b--) {
+                for (long a = 0; a < dim; a++) {
+                    code = (code << 1) | ((cell[a] >> b) & 1);
+                }
+            }
+            codes[i] = std::make_pair(code, i);
+        }
+        std::sort(codes.begin(), codes.end());
+        std::vector<long> order(count);
+        for (long i = 0; i < count; i++) {
+            order[i] = codes[i].second;
+        }
+        return order;
+    }
+    
+    /*
+     * A subtree that a batched query has yet to search, and the squared
+     * distance below which it may hold a nearer tuple.
+     */
+private:
+    struct BatchEntry
+    {
+        long start, end, heap, depth;
+        long slot;    // the slot of the root's tuple, if the subtree is not a leaf bucket of a reordered tree
+        float gap;
+    };
+    
+    /*
+     * The state of one query in flight: its heap of the nearest tuples so far
+     * and the stack of subtrees that it has yet to search.  A depth-first
+     * search needs at most two entries per level.
+     */
+    struct BatchLane
+    {
+        long query;
+        long top;
+        std::vector<KdNeighbour> heap;
+        BatchEntry stack[128];
+        long slots[64];
+        
+        BatchLane() : query(-1), top(0) {}
+    };
+    
+    /*
+     * Prefetch the coordinates or the node tuple that a search reads first when
+     * it pops an entry.
+     */
+private:
+    template <bool Reordered>
+    void prefetchEntry(const BatchEntry& entry) const
+    {
+        if (entry.end - entry.start < this->bucketSize) {
+            for (long a = 0; a < this->dim; a++) {
+                __builtin_prefetch(this->points + a * size() + entry.start);
+                __builtin_prefetch(this->points + a * size() + entry.end);
+            }
+        } else if (Reordered) {
+            const float *tuple = &this->nodes[entry.slot * this->dim];
+            __builtin_prefetch(tuple);
+            __builtin_prefetch(tuple + this->dim - 1);
+        } else {
+            const long median = entry.start + ((entry.end - entry.start) / 2);
+            for (long a = 0; a < this->dim; a++) {
+                __builtin_prefetch(this->points + a * size() + median);
+            }
+        }
+    }
+    
+    /*
+     * Push a subtree onto the stack of a lane, finding the slot of its tuple
+     * from the slots of its ancestors while they are current.
+     */
+    template <bool Reordered>
+    __attribute__((always_inline)) void pushEntry(BatchLane& lane, const long start, const long end, const long heap, const long depth, const float gap) const
+    {
+        BatchEntry& entry = lane.stack[lane.top++];
+        entry.start = start;
+        entry.end = end;
+        entry.heap = heap;
+        entry.depth = depth;
+        entry.slot = (Reordered && end - start >= this->bucketSize) ? nodeSlot(lane.slots, heap, depth) : 0;
+        entry.gap = gap;
+    }
+    
+    /*
+     * Advance the search of one lane until the node that it visits next lies
+     * below KD_BATCH_HOT_DEPTH and has been prefetched.
+     *
+     * returns: false once the search of the lane is finished
+     */
+    template <bool Reordered>
+    bool stepLane(const float *query, BatchLane& lane, const long k) const
+    {
+        while (stepNode<Reordered>(query, lane, k)) {
+            if (lane.top == 0 || lane.stack[lane.top - 1].depth >= KD_BATCH_HOT_DEPTH) {
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    /*
+     * Advance the search of one lane by one node: pop the subtrees that the
+     * bound now excludes, then measure the next node or leaf bucket, push its
+     * branches far first, and prefetch the entry on top.  This searches the
+     * same nodes in the same order as nearestSearch.
+     *
+     * returns: false if no subtree was left to search
+     */
+    template <bool Reordered>
+    __attribute__((always_inline)) bool stepNode(const float *query, BatchLane& lane, const long k) const
+    {
+        KnnCollector collector(lane.heap, k);
+        while (lane.top > 0 && lane.stack[lane.top - 1].gap > collector.bound()) {
+            lane.top--;
+        }
+        if (lane.top == 0) {
+            return false;
+        }
+        const BatchEntry entry = lane.stack[--lane.top];
+        if (entry.end - entry.start < this->bucketSize) {
+            float distances[KD_MAX_BUCKET_SIZE];
+            kdKernels->squaredDistances(this->points, size(), this->dim, entry.start, entry.end - entry.start + 1, query, distances);
+            for (long i = 0; i <= entry.end - entry.start; i++) {
+                collector.add(distances[i], entry.start + i);
+            }
+        } else {
+            const long median = entry.start + ((entry.end - entry.start) / 2);
+            const float *tuple = Reordered ? &this->nodes[entry.slot * this->dim] : nullptr;
+            lane.slots[entry.depth] = entry.slot;
+            float distance = 0;
+            for (long i = 0; i < this->dim; i++) {
+                const float d = (Reordered ? tuple[i] : coordinate(median, i)) - query[i];
+                distance += d * d;
+            }
+            collector.add(distance, median);
+            
+            const long axis = entry.depth % this->dim;
+            const float split = query[axis] - (Reordered ? tuple[axis] : coordinate(median, axis));
+            const bool hasLt = entry.start < median, hasGt = median < entry.end;
+            if (split <= 0) {
+                if (hasGt) pushEntry<Reordered>(lane, median + 1, entry.end, 2 * entry.heap + 2, entry.depth + 1, split * split);
+                if (hasLt) pushEntry<Reordered>(lane, entry.start, median - 1, 2 * entry.heap + 1, entry.depth + 1, entry.gap);
+            } else {
+                if (hasLt) pushEntry<Reordered>(lane, entry.start, median - 1, 2 * entry.heap + 1, entry.depth + 1, split * split);
+                if (hasGt) pushEntry<Reordered>(lane, median + 1, entry.end, 2 * entry.heap + 2, entry.depth + 1, entry.gap);
+            }
+        }
+        if (lane.top > 0) {
+            prefetchEntry<Reordered>(lane.stack[lane.top - 1]);
+        }
+        return true;
+    }
+    
+    /*
+     * Search the k nearest tuples to a run of queries, keeping every lane busy:
+     * whenever the search of a lane finishes, its result is written out and
+     * the lane takes the next query of the run.
+     *
+     * calling parameters:
+     *
+     * queries - all query points, dim floats each
+     * order - the indices of the queries of the run
+     * count - the number of queries in the run
+     * k - the number of tuples to find, at most size()
+     * lanes - the lanes of the calling thread
+     * result - receives k neighbours per query at the query's index
+     */
+    template <bool Reordered>
+    void knnPipeline(const float *queries, const long *order, const long count, const long k,
+                     std::vector<BatchLane>& lanes, KdNeighbour *result) const
+    {
+        long next = 0, active = 0;
+        for (long l = 0; l < lanes.size(); l++) {
+            lanes[l].query = -1;
+        }
+        do {
+            for (long l = 0; l < lanes.size(); l++) {
+                BatchLane& lane = lanes[l];
+                if (lane.query >= 0 && stepLane<Reordered>(&queries[lane.query * this->dim], lane, k)) {
+                    continue;
+                }
+                if (lane.query >= 0) {
+                    std::sort_heap(lane.heap.begin(), lane.heap.end());
+                    std::copy(lane.heap.begin(), lane.heap.end(), result + lane.query * k);
+                    lane.query = -1;
+                    active--;
+                }
+                if (next < count) {
+                    lane.query = order[next++];
+                    lane.heap.clear();
+                    lane.top = 0;
+                    pushEntry<Reordered>(lane, 0, size() - 1, 0, 0, 0);
+                    prefetchEntry<Reordered>(lane.stack[0]);
+                    active++;
+                }
+            }
+        } while (active > 0);
+    }
+};
+
+
+inline void KdIndexSink::add(const long position)
+{
+    indices.push_back((uint32_t) tree.getIndex(position));
+}
+
+inline void KdIndexSink::addSpan(const long start, const long end)
+{
+    for (long position = start; position <= end; position++) {
+        indices.push_back((uint32_t) tree.getIndex(position));
+    }
+}
+
+inline void KdAggregateSink::add(const long position)
+{
+    float tuple[KD_MAX_DIMENSIONS];
+    tree.getTuple(position, tuple);
+    aggregate.count += 1;
+    for (long i = 0; i < tree.dimensions(); i++) {
+        aggregate.sum[i] += tuple[i];
+    }
+}
+
+inline void KdAggregateSink::addSpan(const long start, const long end)
+{
+    aggregate.count += end - start + 1;
+    tree.addSums(start, end, aggregate.sum);
+}
+
+
+/* The type in which a FixedKdTree accumulates squared distances between tuples of type T. */
+template <typename T> struct KdDistance { typedef T type; };
+template <> struct KdDistance<int32_t> { typedef int64_t type; };
+
+/*
+ * A k-d tree whose number of dimensions and coordinate type are template
+ * parameters, for float, double or quantized int32_t coordinates.  It has the
+ * same in-order layout and leaf buckets as KdTree, and for the same tuples it
+ * is the same tree, but the tuples are stored one after another as arrays of
+ * Dim coordinates.  The partition axis of each level is a template parameter
+ * of the functions that build and search that level, so the axis cycles at
+ * compile time, and the super key comparison and the distance and box tests
+ * are loops of constant length that the compiler unrolls.
+ */
+template <long Dim, typename T>
+class FixedKdTree
+{
+public:
+    typedef std::array<T, Dim> Tuple;
+    typedef typename KdDistance<T>::type Distance;
+    
+    /* An axis-aligned box with inclusive bounds. */
+    struct Box
+    {
+        T lower[Dim];
+        T upper[Dim];
+    };
+    
+private:
+    struct Node
+    {
+        Tuple tuple;
+        uint32_t index;   // the index of the tuple in the input coordinates
+    };
+    
+    std::vector<Node> nodes;
+    long bucketSize;
+    
+public:
+    FixedKdTree() : bucketSize(1) {}
+    
+    long size() const
+    {
+        return (long) this->nodes.size();
+    }
+    
+    const Tuple& getTuple(const long position) const
+    {
+        return this->nodes[position].tuple;
+    }
+    
+    long getIndex(const long position) const
+    {
+        return this->nodes[position].index;
+    }
+    
+    size_t memoryUsage() const
+    {
+        return sizeof(*this) + this->nodes.capacity() * sizeof(Node);
+    }
+    
+    /*
+     * Compare two tuples on the super key that begins with axis Axis and
+     * cycles through the other axes, as KdNode::superKeyCompare does.
+     *
+     * returns: a negative, zero or positive value as a is less than, equal to or greater than b
+     */
+private:
+    template <long Axis, long I = 0>
+    static int superKeyCompare(const Tuple& a, const Tuple& b)
+    {
+        constexpr long axis = (Axis + I) % Dim;
+        if (a[axis] != b[axis]) {
+            return (a[axis] < b[axis]) ? -1 : 1;
+        }
+        if constexpr (I + 1 < Dim) {
+            return superKeyCompare<Axis, I + 1>(a, b);
+        } else {
+            return 0;
+        }
+    }
+    
+    /*
+     * Select the median of nodes[start, end] on the super key of axis Axis as
+     * the root of that subtree, partition the other nodes about it, then build
+     * the two subtrees on the next axis.
+     *
+     * calling parameters:
+     *
+     * start - the first node of the subtree
+     * end - the last node of the subtree
+     * maximumSubmitDepth - the depth above which the < subtree is built by another thread
+     * depth - the depth in the k-d tree
+     */
+private:
+    template <long Axis>
+    void buildKdTree(const long start, const long end, const long maximumSubmitDepth, const long depth)
+    {
+        if (end - start < 1) {
+            return;
+        }
+        const long median = start + (end - start) / 2;
+        std::nth_element(this->nodes.begin() + start, this->nodes.begin() + median, this->nodes.begin() + end + 1,
+                         [](const Node& a, const Node& b) {return superKeyCompare<Axis>(a.tuple, b.tuple) < 0;});
+        constexpr long next = (Axis + 1) % Dim;
+        if (depth < maximumSubmitDepth) {
+            std::future<void> lt = std::async(std::launch::async, [=] {
+                buildKdTree<next>(start, median - 1, maximumSubmitDepth, depth + 1);
+            });
+            buildKdTree<next>(median + 1, end, maximumSubmitDepth, depth + 1);
+            lt.get();
+        } else {
+            buildKdTree<next>(start, median - 1, maximumSubmitDepth, depth + 1);
+            buildKdTree<next>(median + 1, end, maximumSubmitDepth, depth + 1);
+        }
+    }
+    
+    /*
+     * Build a tree from contiguous tuples.  The tuples are sorted on the x super
+     * key to remove duplicates, then each median is selected in place.
+     *
+     * calling parameters:
+     *
+     * coordinates - the tuples, Dim coordinates each
+     * numTuples - the number of tuples
+     * numThreads - the number of threads that build; the tree is the same for any number
+     * bucketSize - the largest number of tuples in a leaf bucket
+     *
+     * returns: the k-d tree
+     */
+public:
+    static FixedKdTree createKdTree(const T *coordinates, const long numTuples, const long numThreads = 1,
+                                    const long bucketSize = KD_DEFAULT_BUCKET_SIZE)
+    {
+        FixedKdTree kdTree;
+        kdTree.bucketSize = std::min(std::max(bucketSize, 1L), (long) KD_MAX_BUCKET_SIZE);
+        kdTree.nodes.resize(std::max(numTuples, 0L));
+        for (long i = 0; i < kdTree.size(); i++) {
+            std::copy(coordinates + i * Dim, coordinates + (i + 1) * Dim, kdTree.nodes[i].tuple.begin());
+            kdTree.nodes[i].index = (uint32_t) i;
+        }
+        
+        // Duplicates are adjacent after sorting, and only the first of each is kept.
+        std::stable_sort(kdTree.nodes.begin(), kdTree.nodes.end(),
+                         [](const Node& a, const Node& b) {return superKeyCompare<0>(a.tuple, b.tuple) < 0;});
+        kdTree.nodes.erase(std::unique(kdTree.nodes.begin(), kdTree.nodes.end(),
+                                       [](const Node& a, const Node& b) {return a.tuple == b.tuple;}),
+                           kdTree.nodes.end());
+        kdTree.nodes.shrink_to_fit();
+        kdTree.template buildKdTree<0>(0, kdTree.size() - 1, KdNode::submitDepth(numThreads), 0);
+        return kdTree;
+    }
+    
+    /*
+     * Return true if a tuple lies within a box.
+     */
+private:
+    static bool inBox(const Box& box, const Tuple& tuple)
+    {
+        bool inside = true;
+        for (long i = 0; i < Dim; i++) {
+            inside &= box.lower[i] <= tuple[i] && tuple[i] <= box.upper[i];
+        }
+        return inside;
+    }
+    
+    /*
+     * Return the squared distance between a query point and a tuple.
+     */
+private:
+    static Distance squaredDistance(const T *query, const Tuple& tuple)
+    {
+        Distance distance = 0;
+        for (long i = 0; i < Dim; i++) {
+            const Distance d = (Distance) tuple[i] - (Distance) query[i];
+            distance += d * d;
+        }
+        return distance;
+    }
+    
+    /*
+     * Search the tree for the tuples that lie within a box, and hand the
+     * position of each one to a sink as KdTree::rangeSearch does.
+     *
+     * calling parameters:
+     *
+     * box - the query box
+     * sink - receives the positions of the tuples in the box
+     */
+public:
+    template <typename Sink>
+    void rangeSearch(const Box& box, Sink& sink) const
+    {
+        if (size() > 0) {
+            rangeSearch<0>(box, sink, 0, size() - 1);
+        }
+    }
+    
+private:
+    template <long Axis, typename Sink>
+    void rangeSearch(const Box& box, Sink& sink, const long start, const long end) const
+    {
+        if (end - start < this->bucketSize) {
+            for (long position = start; position <= end; position++) {
+                if (inBox(box, this->nodes[position].tuple)) {
+                    sink.add(position);
+                }
+            }
+            return;
+        }
+        const long median = start + (end - start) / 2;
+        const Tuple& tuple = this->nodes[median].tuple;
+        if (inBox(box, tuple)) {
+            sink.add(median);
+        }
+        constexpr long next = (Axis + 1) % Dim;
+        if (start < median && box.lower[Axis] <= tuple[Axis]) {
+            rangeSearch<next>(box, sink, start, median - 1);
+        }
+        if (median < end && box.upper[Axis] >= tuple[Axis]) {
+            rangeSearch<next>(box, sink, median + 1, end);
+        }
+    }
+    
+    /*
+     * Find the k nearest tuples to a query point.
+     *
+     * calling parameters:
+     *
+     * query - the query point
+     * k - the number of neighbours
+     * result - receives (squared distance, position) pairs, nearest first
+     */
+public:
+    void knn(const T *query, const long k, std::vector< std::pair<Distance, long> >& result) const
+    {
+        result.clear();
+        if (k > 0 && size() > 0) {
+            result.reserve(k + 1);
+            nearestSearch<0>(query, k, result, 0, size() - 1);
+            std::sort_heap(result.begin(), result.end());
+        }
+    }
+    
+private:
+    void collect(const Distance distance, const long position, const long k,
+                 std::vector< std::pair<Distance, long> >& heap) const
+    {
+        if ((long) heap.size() < k) {
+            heap.push_back(std::make_pair(distance, position));
+            std::push_heap(heap.begin(), heap.end());
+        } else if (distance < heap.front().first) {
+            std::pop_heap(heap.begin(), heap.end());
+            heap.back() = std::make_pair(distance, position);
+            std::push_heap(heap.begin(), heap.end());
+        }
+    }
+    
+    template <long Axis>
+    void nearestSearch(const T *query, const long k, std::vector< std::pair<Distance, long> >& heap,
+                       const long start, const long end) const
+    {
+        if (end - start < this->bucketSize) {
+            for (long position = start; position <= end; position++) {
+                collect(squaredDistance(query, this->nodes[position].tuple), position, k, heap);
+            }
+            return;
+        }
+        const long median = start + (end - start) / 2;
+        const Tuple& tuple = this->nodes[median].tuple;
+        collect(squaredDistance(query, tuple), median, k, heap);
+        
+        constexpr long next = (Axis + 1) % Dim;
+        const Distance split = (Distance) query[Axis] - (Distance) tuple[Axis];
+        const bool hasLt = start < median, hasGt = median < end;
+        if (split <= 0) {
+            if (hasLt) nearestSearch<next>(query, k, heap, start, median - 1);
+            if (hasGt && ((long) heap.size() < k || split * split <= heap.front().first)) nearestSearch<next>(query, k, heap, median + 1, end);
+        } else {
+            if (hasGt) nearestSearch<next>(query, k, heap, median + 1, end);
+            if (hasLt && ((long) heap.size() < k || split * split <= heap.front().first)) nearestSearch<next>(query, k, heap, start, median - 1);
+        }
+    }
+};
+
+
+/* The number of consecutive tree positions that share the quantization frame of a QuantizedKdTree. */
+#define KD_QUANTIZED_BLOCK_SHIFT (8)
+#define KD_QUANTIZED_BLOCK_SIZE (1L << KD_QUANTIZED_BLOCK_SHIFT)
+
+/*
+ * A compressed copy of a KdTree that keeps, for each tuple, only an integer
+ * code of 16 or 21 bits per axis and the index of the tuple in the input
+ * coordinates.  The tree keeps KdTree's in-order layout, so it needs no child
+ * references at all.  Each block of KD_QUANTIZED_BLOCK_SIZE consecutive
+ * positions, which is mostly one subtree, has its own bounding box, and a code
+ * q of that block stands for the interval [lower + q * step, lower + (q + 1) * step]
+ * of its box, widened by a margin that covers the rounding of that sum.
+ *
+ * A search decides from these intervals alone wherever it can: a tuple whose
+ * intervals lie within a query box is accepted, one whose intervals miss it is
+ * rejected, and a subtree is skipped only if the interval of its root proves
+ * that the subtree lies outside.  The remaining tuples are refined by reading
+ * their original floats, which the tree borrows, so that the results are the
+ * same as those of the KdTree.  When the originals are a mapped binary points
+ * file, only the pages of refined tuples are read.
+ *
+ * 21-bit codes are packed three to a 64-bit word, so they hold at most three
+ * dimensions; trees of more dimensions use 16-bit codes.
+ */
+class QuantizedKdTree
+{
+private:
+    long dim;
+    long count;
+    long bucketSize;
+    long bits;
+    std::vector<uint16_t> codes16;   // 16-bit codes, one axis after another
+    std::vector<uint64_t> codes64;   // 21-bit codes of all axes of each position
+    std::vector<uint32_t> indices;   // the index of each node's tuple in the input coordinates
+    std::vector<double> frames;      // lower, step and margin of each axis of each block
+    const float *coordinates;        // the original tuples, dim floats each
+    long numCoordinates;             // the number of original tuples up to the largest index
+    
+public:
+    QuantizedKdTree() : dim(0), count(0), bucketSize(1), bits(16), coordinates(nullptr), numCoordinates(0) {}
+    
+    long size() const
+    {
+        return this->count;
+    }
+    
+    long getBits() const
+    {
+        return this->bits;
+    }
+    
+    long getIndex(const long position) const
+    {
+        return this->indices[position];
+    }
+    
+    /*
+     * Copy the original tuple at a position of the tree.
+     */
+    void getTuple(const long position, float *tuple) const
+    {
+        std::copy(original(position), original(position) + this->dim, tuple);
+    }
+    
+    /*
+     * Return the bytes that the tree holds, including the borrowed original
+     * tuples, which refinement reads and which must stay in memory or mapped
+     * for as long as the tree.
+     */
+    size_t memoryUsage() const
+    {
+        return sizeof(*this) + this->codes16.capacity() * sizeof(uint16_t) + this->codes64.capacity() * sizeof(uint64_t)
+        + this->indices.capacity() * sizeof(uint32_t) + this->frames.capacity() * sizeof(double) + borrowedMemoryUsage();
+    }
+    
+    /*
+     * Return the bytes of the borrowed original tuples.
+     */
+    size_t borrowedMemoryUsage() const
+    {
+        return this->numCoordinates * this->dim * sizeof(float);
+    }
+    
+private:
+    const float *original(const long position) const
+    {
+        return this->coordinates + (size_t) this->indices[position] * this->dim;
+    }
+    
+    long code(const long position, const long axis) const
+    {
+        if (this->bits == 16) {
+            return this->codes16[axis * this->count + position];
+        }
+        return (long) ((this->codes64[position] >> (21 * axis)) & ((1UL << 21) - 1));
+    }
+    
+    /*
+     * Return the interval that holds coordinate axis of the tuple at a position.
+     */
+    void interval(const long position, const long axis, double& lower, double& upper) const
+    {
+        const double *frame = &this->frames[((position >> KD_QUANTIZED_BLOCK_SHIFT) * this->dim + axis) * 3];
+        const double q = (double) code(position, axis);
+        lower = frame[0] + q * frame[1] - frame[2];
+        upper = frame[0] + (q + 1) * frame[1] + frame[2];
+    }
+    
+    /*
+     * Compress a KdTree.
+     *
+     * calling parameters:
+     *
+     * kdTree - the tree, which may be destroyed afterwards
+     * coordinates - the tuples that the tree was built from, which must outlive the compressed tree
+     * bits - 16 or 21 bits per axis
+     * numThreads - the number of threads that encode the blocks
+     *
+     * returns: the compressed tree
+     */
+public:
+    static QuantizedKdTree createKdTree(const KdTree& kdTree, const float *coordinates, const long bits,
+                                        const long numThreads = 1)
+    {
+        QuantizedKdTree tree;
+        tree.dim = kdTree.dimensions();
+        tree.count = kdTree.size();
+        tree.bucketSize = kdTree.getBucketSize();
+        tree.bits = (bits == 21 && tree.dim <= 3) ? 21 : 16;
+        tree.coordinates = coordinates;
+        if (tree.bits == 16) {
+            tree.codes16.resize(tree.count * tree.dim);
+        } else {
+            tree.codes64.resize(tree.count);
+        }
+        tree.indices.resize(tree.count);
+        const long numBlocks = (tree.count + KD_QUANTIZED_BLOCK_SIZE - 1) / KD_QUANTIZED_BLOCK_SIZE;
+        tree.frames.resize(numBlocks * tree.dim * 3);
+        const double maximumCode = (double) ((1L << tree.bits) - 1);
+        
+        parallelFor(numBlocks, numThreads, [&](const long, const long block) {
+            const long first = block * KD_QUANTIZED_BLOCK_SIZE;
+            const long last = std::min(first + KD_QUANTIZED_BLOCK_SIZE, tree.count);
+            for (long position = first; position < last; position++) {
+                tree.indices[position] = (uint32_t) kdTree.getIndex(position);
+            }
+            for (long axis = 0; axis < tree.dim; axis++) {
+                float lower = kdTree.coordinate(first, axis), upper = lower;
+                for (long position = first + 1; position < last; position++) {
+                    lower = std::min(lower, kdTree.coordinate(position, axis));
+                    upper = std::max(upper, kdTree.coordinate(position, axis));
+                }
+                
+                // The margin is far larger than the rounding error of lower + q * step in double.
+                double *frame = &tree.frames[(block * tree.dim + axis) * 3];
+                frame[0] = lower;
+                frame[1] = ((double) upper - lower) / maximumCode;
+                frame[2] = 1e-12 * (std::fabs((double) lower) + std::fabs((double) upper)) + 1e-30;
+                for (long position = first; position < last; position++) {
+                    const double scaled = (frame[1] > 0) ? (kdTree.coordinate(position, axis) - frame[0]) / frame[1] : 0;
+                    const uint64_t q = (uint64_t) std::min(std::max(std::floor(scaled), 0.), maximumCode);
+                    if (tree.bits == 16) {
+                        tree.codes16[axis * tree.count + position] = (uint16_t) q;
+                    } else {
+                        tree.codes64[position] |= q << (21 * axis);
+                    }
+                }
+            }
+        });
+        for (long position = 0; position < tree.count; position++) {
+            tree.numCoordinates = std::max(tree.numCoordinates, (long) tree.indices[position] + 1);
+        }
+        return tree;
+    }
+    
+    /*
+     * Search the tree for the tuples that lie within a box, and hand their
+     * positions to a sink.  The stats count the nodes visited and, as
+     * refinedTuples, the tuples whose original floats were read.
+     *
+     * calling parameters:
+     *
+     * box - the query box
+     * sink - receives the positions of the tuples in the box
+     * stats - accumulates the work done by the search
+     */
+public:
+    template <typename Sink>
+    void rangeSearch(const KdBox& box, Sink& sink, KdRangeStats& stats) const
+    {
+        if (size() > 0) {
+            rangeSearch(box, sink, stats, 0, size() - 1, 0);
+        }
+    }
+    
+    template <typename Sink>
+    void rangeSearch(const KdBox& box, Sink& sink) const
+    {
+        KdRangeStats stats;
+        rangeSearch(box, sink, stats);
+    }
+    
+private:
+    template <typename Sink>
+    void testTuple(const KdBox& box, Sink& sink, KdRangeStats& stats, const long position) const
+    {
+        bool certain = true;
+        for (long i = 0; i < this->dim; i++) {
+            double lower, upper;
+            interval(position, i, lower, upper);
+            if (upper < box.lower[i] || lower > box.upper[i]) {
+                return;
+            }
+            certain &= box.lower[i] <= lower && upper <= box.upper[i];
+        }
+        if (!certain) {
+            stats.refinedTuples++;
+            const float *tuple = original(position);
+            for (long i = 0; i < this->dim; i++) {
+                if (tuple[i] < box.lower[i] || tuple[i] > box.upper[i]) {
+                    return;
+                }
+            }
+        }
+        sink.add(position);
+    }
+    
+    template <typename Sink>
+    void rangeSearch(const KdBox& box, Sink& sink, KdRangeStats& stats,
+                     const long start, const long end, const long depth) const
+    {
+        KD_TRACE_VISIT(depth);
+        if (end - start < this->bucketSize) {
+            stats.scannedBuckets++;
+            stats.scannedTuples += end - start + 1;
+            KD_TRACE_SCAN(end - start + 1);
+            for (long position = start; position <= end; position++) {
+                testTuple(box, sink, stats, position);
+            }
+            return;
+        }
+        
+        stats.visitedNodes++;
+        KD_TRACE_TEST(1);
+        const long median = start + (end - start) / 2;
+        testTuple(box, sink, stats, median);
+        
+        // The < subtree holds no coordinate above the median's, and the > subtree none below it.
+        const long axis = depth % this->dim;
+        double lower, upper;
+        interval(median, axis, lower, upper);
+        if (start < median && box.lower[axis] <= upper) {
+            rangeSearch(box, sink, stats, start, median - 1, depth + 1);
+        }
+        if (median < end && box.upper[axis] >= lower) {
+            rangeSearch(box, sink, stats, median + 1, end, depth + 1);
+        }
+        KD_TRACE_PRUNE((start < median && box.lower[axis] > upper) + (median < end && box.upper[axis] < lower));
+    }
+    
+    /*
+     * Find the k nearest tuples to a query point, by their exact distances.
+     *
+     * calling parameters:
+     *
+     * query - the query point
+     * k - the number of neighbours
+     * result - receives the neighbours, nearest first
+     * refinedTuples - if not NULL, accumulates the number of tuples whose original floats were read
+     */
+public:
+    void knn(const float *query, const long k, std::vector<KdNeighbour>& result, unsigned long *refinedTuples = NULL) const
+    {
+        result.clear();
+        if (size() > 0 && k > 0) {
+            unsigned long refined = 0;
+            nearestSearch(query, k, result, refined, 0, size() - 1, 0);
+            std::sort_heap(result.begin(), result.end());
+            if (refinedTuples != NULL) {
+                *refinedTuples += refined;
+            }
+        }
+    }
+    
+private:
+    /*
+     * Return true if a squared distance, measured exactly from the intervals,
+     * exceeds the k-th smallest distance so far.  The bound is relaxed by the
+     * rounding error of a distance measured in float, so that nothing that
+     * KdTree::knn would find is excluded.
+     */
+    static bool excluded(const double gap, const long k, const std::vector<KdNeighbour>& heap)
+    {
+        return (long) heap.size() >= k && gap > heap.front().distance * (1 + 1e-6);
+    }
+    
+    /*
+     * Offer a tuple to the heap of the k nearest, reading its original floats
+     * only if the distance to its intervals does not already exclude it.
+     */
+    void testTuple(const float *query, const long k, std::vector<KdNeighbour>& heap, unsigned long& refined,
+                   const long position) const
+    {
+        double gap = 0;
+        for (long i = 0; i < this->dim; i++) {
+            double lower, upper;
+            interval(position, i, lower, upper);
+            const double d = (query[i] < lower) ? lower - query[i] : (query[i] > upper) ? query[i] - upper : 0;
+            gap += d * d;
+        }
+        if (excluded(gap, k, heap)) {
+            return;
+        }
+        refined++;
+        const float *tuple = original(position);
+        float distance = 0;
+        for (long i = 0; i < this->dim; i++) {
+            const float d = tuple[i] - query[i];
+            distance += d * d;
+        }
+        if ((long) heap.size() < k) {
+            heap.push_back(KdNeighbour(distance, position));
+            std::push_heap(heap.begin(), heap.end());
+        } else if (distance < heap.front().distance) {
+            std::pop_heap(heap.begin(), heap.end());
+            heap.back() = KdNeighbour(distance, position);
+            std::push_heap(heap.begin(), heap.end());
+        }
+    }
+    
+    void nearestSearch(const float *query, const long k, std::vector<KdNeighbour>& heap, unsigned long& refined,
+                       const long start, const long end, const long depth) const
+    {
+        KD_TRACE_VISIT(depth);
+        if (end - start < this->bucketSize) {
+            KD_TRACE_SCAN(end - start + 1);
+            for (long position = start; position <= end; position++) {
+                testTuple(query, k, heap, refined, position);
+            }
+            return;
+        }
+        const long median = start + (end - start) / 2;
+        KD_TRACE_TEST(1);
+        testTuple(query, k, heap, refined, median);
+        
+        // The distance to the far subtree is at least the distance to the far side of the median's interval.
+        const long axis = depth % this->dim;
+        double lower, upper;
+        interval(median, axis, lower, upper);
+        const bool hasLt = start < median, hasGt = median < end;
+        const double ltGap = std::max(query[axis] - upper, 0.), gtGap = std::max(lower - query[axis], 0.);
+        if (query[axis] <= 0.5 * (lower + upper)) {
+            if (hasLt) nearestSearch(query, k, heap, refined, start, median - 1, depth + 1);
+            if (hasGt && !excluded(gtGap * gtGap, k, heap)) nearestSearch(query, k, heap, refined, median + 1, end, depth + 1);
+            else KD_TRACE_PRUNE(hasGt);
+        } else {
+            if (hasGt) nearestSearch(query, k, heap, refined, median + 1, end, depth + 1);
+            if (hasLt && !excluded(ltGap * ltGap, k, heap)) nearestSearch(query, k, heap, refined, start, median - 1, depth + 1);
+            else KD_TRACE_PRUNE(hasLt);
+        }
+    }
+};
+
+/* The header of a binary points file, which is followed by count * dim floats. */
+struct KdPointFileHeader
+{
+    char magic[8];      // "KDPOINTS"
+    uint32_t version;   // KD_POINT_FILE_VERSION
+    uint32_t dim;       // the number of dimensions
+    uint64_t count;     // the number of tuples
+    uint64_t reserved;  // zero; pads the header to 32 bytes so that the floats are aligned
+};
+
+#define KD_POINT_FILE_MAGIC "KDPOINTS"
+#define KD_POINT_FILE_VERSION (1)
+
+/*
+ * The (x, y, z, w...) tuples of an input file, stored contiguously.  The
+ * tuples are either parsed from a text file into memory that the cloud owns,
+ * or mapped directly from a binary points file, in which case the mapping is
+ * the coordinate storage and nothing is copied.
+ */
+class PointCloud
+{
+private:
+    long dim;
+    long count;
+    std::vector<float> owned;
+    MappedFile mapping;
+    float *data;
+    
+public:
+    PointCloud() : dim(0), count(0), data(nullptr) {}
+    
+    PointCloud(PointCloud&&) = default;
+    PointCloud& operator=(PointCloud&&) = default;
+    PointCloud(const PointCloud&) = delete;
+    PointCloud& operator=(const PointCloud&) = delete;
+    
+    long size() const
+    {
+        return this->count;
+    }
+    
+    long dimensions() const
+    {
+        return this->dim;
+    }
+    
+    float *coordinates() const
+    {
+        return this->data;
+    }
+    
+    /*
+     * Return the bytes that the cloud holds in memory, either parsed or mapped.
+     */
+    size_t memoryUsage() const
+    {
+        return this->owned.capacity() * sizeof(float) + this->mapping.size();
+    }
+    
+    /*
+     * Parse one decimal number such as -12.375e-2 without the locale handling
+     * of strtof.  The digits are gathered into an integer that is scaled by a
+     * power of ten in float arithmetic, which rounds once and so is exact
+     * while the integer is at most 2^24 and the power at most 10^10.  Other
+     * numbers are parsed by std::from_chars, which also rounds correctly.
+     *
+     * calling parameters:
+     *
+     * p - the first character of the number
+     * end - the end of the buffer
+     * value - receives the number
+     *
+     * returns: the character after the number
+     */
+    static const char *parseFloat(const char *p, const char *end, float& value)
+    {
+        static const float POWERS_OF_TEN[] = {
+            1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f
+        };
+        const char *first = p;
+        const bool negative = (*p == '-');
+        if (*p == '-' || *p == '+') {
+            p++;
+        }
+        const char *digitsBegin = p;
+        uint64_t mantissa = 0;
+        long digits = 0, exponent = 0;
+        for (; p < end && *p >= '0' && *p <= '9'; p++, digits++) {
+            mantissa = mantissa * 10 + (*p - '0');
+        }
+        if (p < end && *p == '.') {
+            for (p++; p < end && *p >= '0' && *p <= '9'; p++, digits++, exponent--) {
+                mantissa = mantissa * 10 + (*p - '0');
+            }
+        }
+        if (digits == 0) {
+            return first;
+        }
+        if (p < end && (*p == 'e' || *p == 'E')) {
+            const char *q = p + 1;
+            const bool negativeExponent = (q < end && *q == '-');
+            if (q < end && (*q == '-' || *q == '+')) {
+                q++;
+            }
+            if (q < end && *q >= '0' && *q <= '9') {
+                long e = 0;
+                for (; q < end && *q >= '0' && *q <= '9'; q++) {
+                    e = std::min(e * 10 + (*q - '0'), 100000L);
+                }
+                exponent += negativeExponent ? -e : e;
+                p = q;
+            }
+        }
+        if (digits > 19 || mantissa > (1 << 24) || exponent > 10 || exponent < -10) {
+            // from_chars takes no leading plus, and leaves value unset beyond the range of a float.
+            const char *begin = (*first == '-') ? first : digitsBegin;
+            if (std::from_chars(begin, p, value).ec != std::errc()) {
+                value = strtof(std::string(first, p).c_str(), nullptr);
+            }
+            return p;
+        }
+        const float magnitude = (exponent < 0) ? mantissa / POWERS_OF_TEN[-exponent] : mantissa * POWERS_OF_TEN[exponent];
+        value = negative ? -magnitude : magnitude;
+        return p;
+    }
+    
+    /*
+     * Parse the tuples of the lines in [begin, end), one tuple per line and any
+     * characters other than numbers between the coordinates, as in (x, y, z).
+     * Lines without a full tuple are skipped.
+     *
+     * returns: the number of tuples written to tuples
+     */
+    static long parseLines(const char *begin, const char *end, const long dim, float *tuples)
+    {
+        long n = 0;
+        const char *p = begin;
+        while (p < end) {
+            const char *eol = (const char *) memchr(p, '\n', end - p);
+            if (eol == nullptr) {
+                eol = end;
+            }
+            long j = 0;
+            while (j < dim) {
+                while (p < eol && !((*p >= '0' && *p <= '9') || *p == '-' || *p == '+' || *p == '.')) {
+                    p++;
+                }
+                if (p == eol) {
+                    break;
+                }
+                const char *next = parseFloat(p, eol, tuples[n * dim + j]);
+                if (next == p) {
+                    next++;
+                } else {
+                    j++;
+                }
+                p = next;
+            }
+            n += (j == dim);
+            p = eol + 1;
+        }
+        return n;
+    }
+    
+    /*
+     * Read a text file of tuples line by line with getline and istringstream,
+     * skipping the one separator character before each coordinate and the
+     * closing one after the last.
+     *
+     * calling parameters:
+     *
+     * path - the text file
+     * numDimensions - the number of dimensions
+     *
+     * returns: the tuples, or an empty cloud if the file cannot be read
+     */
+public:
+    static PointCloud readStream(const std::string& path, const long numDimensions)
+    {
+        PointCloud cloud;
+        cloud.dim = numDimensions;
+        std::ifstream input_data(path.c_str());
+        std::string line;
+        std::vector<float> tuple(numDimensions);
+        while (std::getline(input_data, line)) {
+            std::istringstream iss(line);
+            char garbageChar;
+            for (long j = 0; j < numDimensions; j++) {
+                iss >> garbageChar >> tuple.at(j);
+            }
+            if (iss) {
+                cloud.owned.insert(cloud.owned.end(), tuple.begin(), tuple.end());
+            }
+        }
+        cloud.owned.shrink_to_fit();
+        cloud.count = (long) cloud.owned.size() / numDimensions;
+        cloud.data = cloud.owned.data();
+        return cloud;
+    }
+    
+    /*
+     * Read a text file of tuples.  The file is mapped into memory and split
+     * into one chunk of whole lines per thread.  The lines of each chunk are
+     * counted to find where its tuples go, then every chunk is parsed
+     * concurrently and the tuples of lines that held none are squeezed out.
+     *
+     * calling parameters:
+     *
+     * path - the text file
+     * numDimensions - the number of dimensions
+     * numThreads - the number of threads
+     *
+     * returns: the tuples, or an empty cloud if the file cannot be read
+     */
+public:
+    static PointCloud readText(const std::string& path, const long numDimensions, const long numThreads)
+    {
+        PointCloud cloud;
+        cloud.dim = numDimensions;
+        MappedFile file;
+        if (!file.map(path, false)) {
+            return cloud;
+        }
+        const char *text = file.data();
+        const size_t size = file.size();
+        madvise((void *) text, size, MADV_SEQUENTIAL);
+        
+        // Split the file at the line ends that follow equally spaced offsets.
+        const long numChunks = std::max(numThreads, 1L);
+        std::vector<const char *> bounds(numChunks + 1, text + size);
+        bounds.at(0) = text;
+        for (long i = 1; i < numChunks; i++) {
+            const char *p = std::max(text + size * i / numChunks, bounds.at(i - 1));
+            const char *eol = (const char *) memchr(p, '\n', text + size - p);
+            bounds.at(i) = (eol == nullptr) ? text + size : eol + 1;
+        }
+        
+        // Count the lines of each chunk to find the first tuple of each chunk.
+        std::vector<long> first(numChunks + 1, 0);
+        parallelFor(numChunks, numChunks, [&](const long, const long i) {
+            long lines = 0;
+            for (const char *p = bounds.at(i); p < bounds.at(i + 1); lines++) {
+                const char *eol = (const char *) memchr(p, '\n', bounds.at(i + 1) - p);
+                p = (eol == nullptr) ? bounds.at(i + 1) : eol + 1;
+            }
+            first.at(i + 1) = lines;
+        });
+        for (long i = 0; i < numChunks; i++) {
+            first.at(i + 1) += first.at(i);
+        }
+        
+        // Parse the chunks, then squeeze out the slots of lines without a tuple.
+        cloud.owned.resize(first.at(numChunks) * numDimensions);
+        std::vector<long> parsed(numChunks);
+        parallelFor(numChunks, numChunks, [&](const long, const long i) {
+            parsed.at(i) = parseLines(bounds.at(i), bounds.at(i + 1), numDimensions, &cloud.owned[first.at(i) * numDimensions]);
+        });
+        long count = 0;
+        for (long i = 0; i < numChunks; i++) {
+            if (count != first.at(i)) {
+                memmove(&cloud.owned[count * numDimensions], &cloud.owned[first.at(i) * numDimensions],
+                        parsed.at(i) * numDimensions * sizeof(float));
+            }
+            count += parsed.at(i);
+        }
+        cloud.owned.resize(count * numDimensions);
+        cloud.owned.shrink_to_fit();
+        
+        cloud.count = count;
+        cloud.data = cloud.owned.data();
+        return cloud;
+    }
+    
+    /*
+     * Return true if a file begins with the magic number of a binary points file.
+     */
+public:
+    static bool isBinary(const std::string& path)
+    {
+        char magic[8] = {0};
+        std::ifstream file(path.c_str(), std::ios::binary);
+        file.read(magic, sizeof(magic));
+        return file && memcmp(magic, KD_POINT_FILE_MAGIC, sizeof(magic)) == 0;
+    }
+    
+    /*
+     * Map a binary points file.  The floats in the mapping are the coordinates
+     * of the cloud; they are mapped privately with write access because the
+     * builders take float*, but no builder writes to them.
+     *
+     * calling parameters:
+     *
+     * path - the binary points file
+     *
+     * returns: the tuples, or an empty cloud if the file is not a valid binary points file
+     */
+public:
+    static PointCloud mapBinary(const std::string& path)
+    {
+        PointCloud cloud;
+        MappedFile file;
+        if (!file.map(path, true)) {
+            return cloud;
+        }
+        const size_t size = file.size();
+        const KdPointFileHeader *header = (const KdPointFileHeader *) file.data();
+        if (size < sizeof(KdPointFileHeader) || memcmp(header->magic, KD_POINT_FILE_MAGIC, sizeof(header->magic)) != 0
+            || header->version != KD_POINT_FILE_VERSION || header->dim == 0
+            || header->count > (size - sizeof(KdPointFileHeader)) / (header->dim * sizeof(float))) {
+            return cloud;
+        }
+        cloud.dim = header->dim;
+        cloud.count = (long) header->count;
+        cloud.data = (float *) (file.data() + sizeof(KdPointFileHeader));
+        cloud.mapping = std::move(file);
+        return cloud;
+    }
+    
+    /*
+     * Write tuples to a binary points file.
+     *
+     * calling parameters:
+     *
+     * path - the binary points file
+     * coordinates - the tuples, stored contiguously
+     * numTuples - the number of tuples
+     * numDimensions - the number of dimensions
+     *
+     * returns: true if the file was written
+     */
+public:
+    static bool writeBinary(const std::string& path, const float *coordinates, const long numTuples, const long numDimensions)
+    {
+        KdPointFileHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, KD_POINT_FILE_MAGIC, sizeof(header.magic));
+        header.version = KD_POINT_FILE_VERSION;
+        header.dim = (uint32_t) numDimensions;
+        header.count = (uint64_t) numTuples;
+        std::ofstream file(path.c_str(), std::ios::binary | std::ios::trunc);
+        file.write((const char *) &header, sizeof(header));
+        file.write((const char *) coordinates, numTuples * numDimensions * sizeof(float));
+        return (bool) file;
+    }
+};
+
+/* The formats of the results of answerQueryFile. */
+enum KdResultFormat
+{
+    RESULTS_CSV,    // a header line, then one line per tuple found, or per query with --count-only
+    RESULTS_BINARY  // a KdResultFileHeader, then per query a KdResultHeader followed by its KdResultTuple records
+};
+
+/* The header of a binary results file. */
+struct KdResultFileHeader
+{
+    char magic[8];       // "KDRESULT"
+    uint32_t version;    // KD_RESULT_FILE_VERSION
+    uint32_t dim;        // the number of coordinates of each KdResultTuple
+    uint64_t countOnly;  // 1 if the queries carry their counts but no tuples
+    uint64_t reserved;   // zero
+};
+
+/* The header of the results of one query in a binary results file. */
+struct KdResultHeader
+{
+    uint64_t query;     // the number of the query in the query file, from zero
+    uint32_t kind;      // 1 for a range query and 2 for a nearest-neighbour query
+    uint32_t reserved;  // zero
+    uint64_t count;     // the number of tuples found, which follow unless countOnly
+};
+
+/* One tuple found by a query in a binary results file. */
+struct KdResultTuple
+{
+    uint32_t index;    // the index of the tuple in the input
+    float tuple[3];    // its coordinates
+    float distance;    // its distance from the query point, or zero for a range query
+};
+
+#define KD_RESULT_FILE_MAGIC "KDRESULT"
+#define KD_RESULT_FILE_VERSION (1)
+
+/* The number of queries that answerQueryFile reads, answers in parallel and writes at a time. */
+#define KD_QUERY_BLOCK_SIZE (4096)
+
+/* The growth of a query's results between the checks of answerQueryFile's budget. */
+#define KD_QUERY_SPILL_BYTES (1 << 12)
+
+/*
+ * The bytes of results, beyond the first KD_QUERY_SPILL_BYTES of each query,
+ * that a block of queries holds at once.  A query that would pass them is
+ * answered again after the block's earlier queries are written, with its
+ * results written as they are found.
+ */
+#define KD_QUERY_BLOCK_BYTES (64L << 20)
+
+/*
+ * Writes to a file, or to standard output, through a buffer, so that the
+ * many small writes of the results cost one system call per buffer.
+ */
+class BufferedWriter
+{
+private:
+    int fd;
+    bool owned;
+    bool failed;
+    size_t used;
+    size_t written;
+    std::vector<char> buffer;
+    
+public:
+    BufferedWriter() : fd(-1), owned(false), failed(false), used(0), written(0), buffer(1 << 20) {}
+    
+    BufferedWriter(const BufferedWriter&) = delete;
+    BufferedWriter& operator=(const BufferedWriter&) = delete;
+    
+    ~BufferedWriter()
+    {
+        close();
+    }
+    
+    /*
+     * Open a file for writing, truncating it, or standard output for "-".
+     *
+     * returns: true if the file was opened
+     */
+    bool open(const std::string& path)
+    {
+        close();
+        this->failed = false;
+        this->written = 0;
+        if (path == "-") {
+            this->fd = STDOUT_FILENO;
+            this->owned = false;
+        } else {
+            this->fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            this->owned = true;
+        }
+        return this->fd >= 0;
+    }
+    
+    void write(const char *data, const size_t size)
+    {
+        if (this->used + size > this->buffer.size()) {
+            flush();
+            if (size >= this->buffer.size()) {
+                writeAll(data, size);
+                return;
+            }
+        }
+        memcpy(&this->buffer[this->used], data, size);
+        this->used += size;
+    }
+    
+    /*
+     * Write the buffered bytes to the file.
+     *
+     * returns: true if every write so far succeeded
+     */
+    bool flush()
+    {
+        writeAll(this->buffer.data(), this->used);
+        this->used = 0;
+        return !this->failed;
+    }
+    
+    /*
+     * Flush the buffer and close the file.
+     *
+     * returns: true if every write succeeded
+     */
+    bool close()
+    {
+        if (this->fd < 0) {
+            return !this->failed;
+        }
+        flush();
+        if (this->owned && ::close(this->fd) != 0) {
+            this->failed = true;
+        }
+        this->fd = -1;
+        return !this->failed;
+    }
+    
+    size_t bytesWritten() const
+    {
+        return this->written + this->used;
+    }
+    
+private:
+    void writeAll(const char *data, size_t size)
+    {
+        while (size > 0 && !this->failed) {
+            const ssize_t n = ::write(this->fd, data, size);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                this->failed = true;
+                return;
+            }
+            data += n;
+            size -= n;
+            this->written += n;
+        }
+    }
+};
+
+/* One query of a query file: a range query (Q1) or a nearest-neighbour query (Q2). */
+struct KdQuery
+{
+    long kind;      // 1 or 2
+    long k;         // the number of neighbours of a nearest-neighbour query
+    KdBox box;      // the query box of a range query
+    float point[3]; // the query point of a nearest-neighbour query
+};
+
+/*
+ * Parse one line of a query file.  The line holds a query as it is typed at
+ * the interactive prompt, "Q1 x1 x2 y1 y2 z1 z2" or "Q2 x1 y1 z1", and a
+ * nearest-neighbour query may end with its own number of neighbours.
+ *
+ * calling parameters:
+ *
+ * line - the line
+ * defaultK - the number of neighbours of a nearest-neighbour query that has none
+ * query - receives the query
+ *
+ * returns: 1 for a query, 0 for a blank line or a comment that begins with #,
+ *          and -1 for a malformed line
+ */
+static long parseQuery(const std::string& line, const long defaultK, KdQuery& query)
+{
+    const char *p = line.c_str();
+    while (*p == ' ' || *p == '\t' || *p == '\r') {
+        p++;
+    }
+    if (*p == 0 || *p == '#') {
+        return 0;
+    }
+    if (p[0] != 'Q' || (p[1] != '1' && p[1] != '2') || (p[2] != ' ' && p[2] != '\t')) {
+        return -1;
+    }
+    query.kind = p[1] - '0';
+    const long numValues = (query.kind == 1) ? 6 : 3;
+    float values[6];
+    p += 2;
+    for (long i = 0; i < numValues; i++) {
+        char *end;
+        values[i] = strtof(p, &end);
+        if (end == p) {
+            return -1;
+        }
+        p = end;
+    }
+    query.k = defaultK;
+    if (query.kind == 1) {
+        for (long j = 0; j < 3; j++) {
+            query.box.lower[j] = values[2 * j];
+            query.box.upper[j] = values[2 * j + 1];
+        }
+    } else {
+        std::copy(values, values + 3, query.point);
+        char *end;
+        const long k = strtol(p, &end, 10);
+        if (end != p) {
+            if (k < 1) {
+                return -1;
+            }
+            query.k = k;
+            p = end;
+        }
+    }
+    while (*p == ' ' || *p == '\t' || *p == '\r') {
+        p++;
+    }
+    return (*p == 0) ? 1 : -1;
+}
+
+/* Append a number to a line of CSV results in the shortest form that reads back exactly. */
+template <typename Number>
+static void appendNumber(std::string& text, const Number value)
+{
+    char digits[32];
+    const std::to_chars_result result = std::to_chars(digits, digits + sizeof(digits), value);
+    text.append(digits, result.ptr);
+}
+
+/*
+ * Pass the positions of the tuples within a query box to a function, skipping
+ * the first offset of them and passing at most limit of them.  The flat tree
+ * streams them and stops its search at the limit; the compressed tree
+ * searches the whole box.
+ */
+template <typename Tree, typename Function>
+static void rangeWindow(const Tree& tree, const KdBox& box, const long offset, const long limit, Function found)
+{
+    long seen = 0;
+    auto sink = makeCallbackSink([&](const long position) {
+        if (seen >= offset && seen - offset < limit) {
+            found(position);
+        }
+        seen++;
+    });
+    tree.rangeSearch(box, sink);
+}
+
+template <typename Function>
+static void rangeWindow(const KdTree& tree, const KdBox& box, const long offset, const long limit, Function found)
+{
+    tree.rangeStream(box, offset, limit, [&](const long *positions, const long count) {
+        for (long i = 0; i < count; i++) {
+            found(positions[i]);
+        }
+    });
+}
+
+/*
+ * Answer one query of a query file and append its results to a buffer.
+ *
+ * calling parameters:
+ *
+ * tree - the KdTree or QuantizedKdTree
+ * query - the query
+ * number - the number of the query in the query file
+ * format - the format of the results
+ * countOnly - true to write the number of tuples found without the tuples
+ * offset - the number of tuples of a range query to skip, unless countOnly
+ * limit - the largest number of tuples of a range query to write, unless countOnly
+ * neighbours - the nearest neighbours, whose capacity is reused
+ * text - receives the results
+ * spill - called as spill(text) each time the results in text grow by
+ *         KD_QUERY_SPILL_BYTES; it may write and clear text, or return false
+ *         to abandon the query, whose results are then removed from text
+ * knownCount - the number of tuples that a binary query writes, or -1 to fill
+ *              it in after them; it must be known if spill writes text
+ * complete - set to false if spill abandoned the query
+ *
+ * returns: the number of tuples found, or written for a range query unless countOnly
+ */
+template <typename Tree, typename Spill>
+static unsigned long answerQuery(const Tree& tree, const KdQuery& query, const long number, const KdResultFormat format,
+                                 const bool countOnly, const long offset, const long limit,
+                                 std::vector<KdNeighbour>& neighbours, std::string& text, Spill spill,
+                                 const long knownCount, bool& complete)
+{
+    const char *kind = (query.kind == 1) ? "Q1" : "Q2";
+    const size_t headerOffset = text.size();
+    size_t nextSpill = headerOffset + KD_QUERY_SPILL_BYTES;
+    complete = true;
+    auto appendTuple = [&](const long position, const float distance) {
+        if (!complete) {
+            return;
+        }
+        if (text.size() >= nextSpill) {
+            complete = spill(text);
+            if (!complete) {
+                text.resize(headerOffset);
+                return;
+            }
+            nextSpill = text.size() + KD_QUERY_SPILL_BYTES;
+        }
+        KdResultTuple record;
+        tree.getTuple(position, record.tuple);
+        record.index = (uint32_t) tree.getIndex(position);
+        record.distance = distance;
+        if (format == RESULTS_BINARY) {
+            text.append((const char *) &record, sizeof(record));
+            return;
+        }
+        appendNumber(text, number);
+        text += ',';
+        text += kind;
+        text += ',';
+        appendNumber(text, record.index);
+        for (long j = 0; j < 3; j++) {
+            text += ',';
+            appendNumber(text, record.tuple[j]);
+        }
+        text += ',';
+        if (query.kind == 2) {
+            appendNumber(text, distance);
+        }
+        text += '\n';
+    };
+    
+    // A binary query header is written before its tuples and, unless known, its count is filled in after them.
+    if (format == RESULTS_BINARY) {
+        KdResultHeader header;
+        memset(&header, 0, sizeof(header));
+        header.query = (uint64_t) number;
+        header.kind = (uint32_t) query.kind;
+        header.count = (uint64_t) std::max(knownCount, 0L);
+        text.append((const char *) &header, sizeof(header));
+    }
+    unsigned long count = 0;
+    if (query.kind == 1 && countOnly) {
+        KdCountSink sink;
+        tree.rangeSearch(query.box, sink);
+        count = sink.count;
+    } else if (query.kind == 1) {
+        rangeWindow(tree, query.box, offset, limit, [&](const long position) {
+            appendTuple(position, 0);
+            count++;
+        });
+    } else {
+        tree.knn(query.point, query.k, neighbours);
+        count = neighbours.size();
+        for (long i = 0; i < neighbours.size() && !countOnly; i++) {
+            appendTuple(neighbours[i].position, std::sqrt(neighbours[i].distance));
+        }
+    }
+    if (!complete) {
+        return count;
+    }
+    if (format == RESULTS_BINARY && knownCount < 0) {
+        const uint64_t total = count;
+        memcpy(&text[headerOffset + offsetof(KdResultHeader, count)], &total, sizeof(total));
+    } else if (format != RESULTS_BINARY && countOnly) {
+        appendNumber(text, number);
+        text += ',';
+        text += kind;
+        text += ',';
+        appendNumber(text, count);
+        text += '\n';
+    }
+    return count;
+}
+
+/* Totals of the queries that answerQueryFile answered. */
+struct KdQueryFileStats
+{
+    unsigned long queries;    // the number of queries answered
+    unsigned long tuples;     // the number of tuples that they found
+    unsigned long malformed;  // the number of lines that hold no valid query
+    unsigned long firstMalformedLine;  // the number of the first of those lines, from one
+    KdTraceSummary rangeTraces;    // the work of the range queries, when compiled with KD_TRACE
+    KdTraceSummary nearestTraces;  // the work of the nearest-neighbour queries, likewise
+    
+    KdQueryFileStats() : queries(0), tuples(0), malformed(0), firstMalformedLine(0) {}
+};
+
+/*
+ * Answer the queries of a query file and write their results.  The queries
+ * are read, answered in parallel and written in blocks of KD_QUERY_BLOCK_SIZE.
+ * Each query's results are formatted into its own buffer by the thread that
+ * answers it, and the buffers are written in the order of the queries.  The
+ * buffers of a block share KD_QUERY_BLOCK_BYTES; a query that finds more is
+ * abandoned and answered again once the queries before it are written, with
+ * its results written as they are found, so that a stream of queries is
+ * answered with bounded memory however many tuples each finds.  A buffer
+ * that grew past KD_QUERY_SPILL_BYTES is released once it is written.
+ *
+ * calling parameters:
+ *
+ * tree - the KdTree or QuantizedKdTree
+ * input - the query file
+ * output - receives the results
+ * format - the format of the results
+ * countOnly - true to write the number of tuples found by each query without the tuples
+ * offset - the number of tuples of each range query to skip, unless countOnly
+ * limit - the largest number of tuples of each range query to write, unless countOnly
+ * defaultK - the number of neighbours of a nearest-neighbour query that has none
+ * numThreads - the number of threads
+ *
+ * returns: the totals of the queries
+ */
+template <typename Tree>
+static KdQueryFileStats answerQueryFile(const Tree& tree, std::istream& input, BufferedWriter& output,
+                                        const KdResultFormat format, const bool countOnly, const long offset,
+                                        const long limit, const long defaultK, const long numThreads)
+{
+    if (format == RESULTS_BINARY) {
+        KdResultFileHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, KD_RESULT_FILE_MAGIC, sizeof(header.magic));
+        header.version = KD_RESULT_FILE_VERSION;
+        header.dim = 3;
+        header.countOnly = countOnly ? 1 : 0;
+        output.write((const char *) &header, sizeof(header));
+    } else {
+        const std::string header = countOnly ? "query,kind,count\n" : "query,kind,index,x,y,z,distance\n";
+        output.write(header.data(), header.size());
+    }
+    
+    KdQueryFileStats stats;
+    std::vector<KdQuery> queries;
+    queries.reserve(KD_QUERY_BLOCK_SIZE);
+    std::vector<std::string> results(KD_QUERY_BLOCK_SIZE);
+    std::vector<unsigned long> counts(KD_QUERY_BLOCK_SIZE);
+    std::vector<char> complete(KD_QUERY_BLOCK_SIZE);
+    std::vector< std::vector<KdNeighbour> > neighbours(std::max(numThreads, 1L));
+    std::vector<KdTraceSummary> rangeTraces(std::max(numThreads, 1L)), nearestTraces(std::max(numThreads, 1L));
+    std::string line;
+    unsigned long lineNumber = 0;
+    bool more = true;
+    while (more) {
+        queries.clear();
+        while (queries.size() < KD_QUERY_BLOCK_SIZE && (more = (bool) std::getline(input, line))) {
+            lineNumber++;
+            KdQuery query;
+            const long parsed = parseQuery(line, defaultK, query);
+            if (parsed > 0) {
+                queries.push_back(query);
+            } else if (parsed < 0 && stats.malformed++ == 0) {
+                stats.firstMalformedLine = lineNumber;
+            }
+        }
+        const long first = (long) stats.queries;
+        std::atomic<long> budget(KD_QUERY_BLOCK_BYTES);
+        parallelFor((long) queries.size(), numThreads, [&](const long thread, const long i) {
+            results[i].clear();
+            KdTraceScope trace((queries[i].kind == 1) ? rangeTraces[thread] : nearestTraces[thread]);
+            
+            // Each growth of the buffer by KD_QUERY_SPILL_BYTES draws on the block's budget.
+            auto reserve = [&budget](std::string&) {
+                return budget.fetch_sub(KD_QUERY_SPILL_BYTES) >= KD_QUERY_SPILL_BYTES;
+            };
+            bool done;
+            counts[i] = answerQuery(tree, queries[i], first + i, format, countOnly, offset, limit, neighbours[thread],
+                                    results[i], reserve, -1, done);
+            complete[i] = done;
+        });
+        for (long i = 0; i < queries.size(); i++) {
+            if (!complete[i]) {
+                // A binary query header goes out before its tuples, so count them first.
+                long known = -1;
+                if (format == RESULTS_BINARY && queries[i].kind == 1) {
+                    KdCountSink sink;
+                    tree.rangeSearch(queries[i].box, sink);
+                    known = std::min(std::max((long) sink.count - offset, 0L), limit);
+                } else if (format == RESULTS_BINARY) {
+                    tree.knn(queries[i].point, queries[i].k, neighbours[0]);
+                    known = (long) neighbours[0].size();
+                }
+                auto flush = [&output](std::string& text) {
+                    output.write(text.data(), text.size());
+                    text.clear();
+                    return true;
+                };
+                bool done;
+                counts[i] = answerQuery(tree, queries[i], first + i, format, countOnly, offset, limit, neighbours[0],
+                                        results[i], flush, known, done);
+            }
+            output.write(results[i].data(), results[i].size());
+            stats.tuples += counts[i];
+            
+            // Release a buffer that grew past KD_QUERY_SPILL_BYTES, so that the buffers
+            // kept between blocks hold no more than that each.
+            if (results[i].capacity() > KD_QUERY_SPILL_BYTES) {
+                std::string().swap(results[i]);
+            }
+        }
+        stats.queries += queries.size();
+    }
+    for (long t = 0; t < rangeTraces.size(); t++) {
+        stats.rangeTraces.merge(rangeTraces[t]);
+        stats.nearestTraces.merge(nearestTraces[t]);
+    }
+    return stats;
+}
+
+/* The capacity of the submission queue of a KdQueryServer. */
+#define KD_SERVER_QUEUE_SIZE (4096)
+
+/* The number of times that an idle worker of a KdQueryServer polls its queue before it sleeps. */
+#define KD_SERVER_SPINS (256)
+
+/*
+ * A bounded queue that any number of threads push to and pop from without a
+ * lock.  Each cell holds a sequence number that tells whether it is free for
+ * the push of its turn or full for the pop of its turn, so that a thread
+ * claims a cell with one compare-and-swap of a shared position and then
+ * fills or empties it alone.
+ */
+template <typename T>
+class KdConcurrentQueue
+{
+private:
+    struct Cell
+    {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+    
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+    alignas(64) std::atomic<size_t> pushPosition;
+    alignas(64) std::atomic<size_t> popPosition;
+    
+public:
+    /*
+     * calling parameters:
+     *
+     * capacity - the largest number of values that the queue holds, rounded up to a power of two
+     */
+    KdConcurrentQueue(const size_t capacity) : pushPosition(0), popPosition(0)
+    {
+        size_t size = 2;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        this->cells.reset(new Cell[size]);
+        this->mask = size - 1;
+        for (size_t i = 0; i < size; i++) {
+            this->cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+    
+    KdConcurrentQueue(const KdConcurrentQueue&) = delete;
+    KdConcurrentQueue& operator=(const KdConcurrentQueue&) = delete;
+    
+    /*
+     * Move a value to the back of the queue.
+     *
+     * returns: false, leaving the value as it was, if the queue is full
+     */
+    bool push(T& value)
+    {
+        size_t position = this->pushPosition.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell& cell = this->cells[position & this->mask];
+            const intptr_t difference = (intptr_t) cell.sequence.load(std::memory_order_acquire) - (intptr_t) position;
+            if (difference == 0) {
+                if (this->pushPosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    cell.value = std::move(value);
+                    cell.sequence.store(position + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (difference < 0) {
+                return false;
+            } else {
+                position = this->pushPosition.load(std::memory_order_relaxed);
+            }
+        }
+    }
+    
+    /*
+     * Move the value at the front of the queue.
+     *
+     * returns: false if the queue is empty or its front value is still being pushed
+     */
+    bool pop(T& value)
+    {
+        size_t position = this->popPosition.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell& cell = this->cells[position & this->mask];
+            const intptr_t difference = (intptr_t) cell.sequence.load(std::memory_order_acquire) - (intptr_t) (position + 1);
+            if (difference == 0) {
+                if (this->popPosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    value = std::move(cell.value);
+                    cell.sequence.store(position + this->mask + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (difference < 0) {
+                return false;
+            } else {
+                position = this->popPosition.load(std::memory_order_relaxed);
+            }
+        }
+    }
+};
+
+/* The answer of a KdQueryServer to one query. */
+struct KdQueryAnswer
+{
+    long kind;                            // 1 or 2, as in the query
+    std::vector<long> positions;          // the positions in the tree of the tuples within the box of a range query
+    std::vector<KdNeighbour> neighbours;  // the nearest neighbours of a nearest-neighbour query, nearest first
+    
+    KdQueryAnswer() : kind(0) {}
+    
+    /* Return the number of tuples found. */
+    size_t size() const
+    {
+        return (this->kind == 1) ? this->positions.size() : this->neighbours.size();
+    }
+};
+
+/*
+ * Answers the queries of any number of client threads against one tree, which
+ * is immutable once built, on a pool of worker threads.  A client submits a
+ * query to a lock-free queue and receives its answer through a future or a
+ * callback.  An idle worker polls the queue KD_SERVER_SPINS times and then
+ * sleeps until a query arrives; a client takes the lock that guards the
+ * sleep only if some worker sleeps.  When the queue is full, submit waits for
+ * room.  The destructor answers the queries already submitted, then stops
+ * the workers; no query may be submitted while it runs.
+ */
+template <typename Tree>
+class KdQueryServer
+{
+private:
+    // A promise allocates its shared state, so only a request that returns a future holds one.
+    struct Request
+    {
+        KdQuery query;
+        std::unique_ptr< std::promise<KdQueryAnswer> > promise;
+        std::function<void(KdQueryAnswer&)> callback;
+    };
+    
+    const Tree& tree;
+    KdConcurrentQueue<Request> queue;
+    std::vector<std::thread> workers;
+    std::atomic<long> pending;   // the requests pushed to the queue and not yet popped
+    std::atomic<long> sleepers;  // the workers that sleep or are about to
+    std::atomic<bool> stopping;
+    std::mutex mutex;
+    std::condition_variable wake;
+    
+public:
+    /*
+     * calling parameters:
+     *
+     * tree - the KdTree or QuantizedKdTree, which must outlive the server
+     * numThreads - the number of worker threads
+     * capacity - the largest number of queries that wait for a worker
+     */
+    KdQueryServer(const Tree& t, const long numThreads, const size_t capacity = KD_SERVER_QUEUE_SIZE)
+    : tree(t), queue(capacity), pending(0), sleepers(0), stopping(false)
+    {
+        for (long i = 0; i < std::max(numThreads, 1L); i++) {
+            this->workers.push_back(std::thread(&KdQueryServer::work, this));
+        }
+    }
+    
+    ~KdQueryServer()
+    {
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->stopping.store(true);
+        }
+        this->wake.notify_all();
+        for (long i = 0; i < this->workers.size(); i++) {
+            this->workers.at(i).join();
+        }
+    }
+    
+    KdQueryServer(const KdQueryServer&) = delete;
+    KdQueryServer& operator=(const KdQueryServer&) = delete;
+    
+    /* Return the number of worker threads. */
+    long threads() const
+    {
+        return this->workers.size();
+    }
+    
+    /*
+     * Submit a query from any thread.
+     *
+     * returns: a future that receives the answer
+     */
+    std::future<KdQueryAnswer> submit(const KdQuery& query)
+    {
+        Request request;
+        request.query = query;
+        request.promise.reset(new std::promise<KdQueryAnswer>());
+        std::future<KdQueryAnswer> answer = request.promise->get_future();
+        enqueue(request);
+        return answer;
+    }
+    
+    /*
+     * Submit a query from any thread and pass its answer to a callback, which
+     * runs on a worker thread, may move from the answer, and must not throw.
+     */
+    void submit(const KdQuery& query, std::function<void(KdQueryAnswer&)> callback)
+    {
+        Request request;
+        request.query = query;
+        request.callback = std::move(callback);
+        enqueue(request);
+    }
+    
+private:
+    void enqueue(Request& request)
+    {
+        while (!this->queue.push(request)) {
+            std::this_thread::yield();
+        }
+        
+        // Either this thread sees a sleeper, or the sleeper sees the pending request before it sleeps.
+        this->pending.fetch_add(1);
+        if (this->sleepers.load() > 0) {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->wake.notify_one();
+        }
+    }
+    
+    void answer(const KdQuery& query, KdQueryAnswer& answer) const
+    {
+        answer.kind = query.kind;
+        if (query.kind == 1) {
+            auto sink = makeCallbackSink([&answer](const long position) {
+                answer.positions.push_back(position);
+            });
+            this->tree.rangeSearch(query.box, sink);
+        } else {
+            this->tree.knn(query.point, query.k, answer.neighbours);
+        }
+    }
+    
+    void work()
+    {
+        Request request;
+        long idle = 0;
+        for (;;) {
+            if (this->queue.pop(request)) {
+                this->pending.fetch_sub(1);
+                idle = 0;
+                KdQueryAnswer result;
+                answer(request.query, result);
+                if (request.callback) {
+                    request.callback(result);
+                    request.callback = nullptr;
+                } else {
+                    request.promise->set_value(std::move(result));
+                    request.promise.reset();
+                }
+                continue;
+            }
+            if (++idle < KD_SERVER_SPINS) {
+                std::this_thread::yield();
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->sleepers.fetch_add(1);
+            while (this->pending.load() <= 0 && !this->stopping.load()) {
+                this->wake.wait(lock);
+            }
+            this->sleepers.fetch_sub(1);
+            if (this->pending.load() <= 0) {
+                return;
+            }
+            idle = 0;
+        }
+    }
+};
+
+/*
+ * A hardware event counter of the calling thread, such as its cache misses,
+ * which counts only while it is started.  Where the kernel does not grant
+ * access to the counters, as in many containers, read returns -1.
+ */
+class PerfCounter
+{
+private:
+    int fd;
+    
+public:
+    /*
+     * Open a counter that is stopped.
+     *
+     * calling parameters:
+     *
+     * type - PERF_TYPE_HARDWARE or PERF_TYPE_HW_CACHE
+     * config - the event of that type
+     */
+    PerfCounter(const uint32_t type, const uint64_t config) : fd(-1)
+    {
+#ifdef __linux__
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        this->fd = (int) syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+    }
+    
+    PerfCounter(const PerfCounter&) = delete;
+    PerfCounter& operator=(const PerfCounter&) = delete;
+    
+    ~PerfCounter()
+    {
+        if (this->fd >= 0) {
+            close(this->fd);
+        }
+    }
+    
+    void start()
+    {
+#ifdef __linux__
+        if (this->fd >= 0) {
+            ioctl(this->fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(this->fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+    
+    /*
+     * Stop the counter and return the events counted since start, or -1.
+     */
+    long stop()
+    {
+        long events = -1;
+#ifdef __linux__
+        if (this->fd >= 0) {
+            ioctl(this->fd, PERF_EVENT_IOC_DISABLE, 0);
+            uint64_t value;
+            if (read(this->fd, &value, sizeof(value)) == sizeof(value)) {
+                events = (long) value;
+            }
+        }
+#endif
+        return events;
+    }
+};
+
+/*
+ * Draw benchmark queries about randomly chosen tuples of a three-dimensional
+ * KdTree: boxes that span 5% of the extent of the tuples on each axis, and
+ * query points at tuples.
+ *
+ * calling parameters:
+ *
+ * kdTree - the tree
+ * numQueries - the number of queries of each kind
+ * boxes - receives the query boxes
+ * points - receives the query points, three floats each
+ */
+static void drawBenchmarkQueries(const KdTree& kdTree, const long numQueries, std::vector<KdBox>& boxes,
+                                 std::vector<float>& points)
+{
+    // Find the extent of the tuples to scale the query boxes.
+    float lower[3], upper[3];
+    kdTree.getTuple(0, lower);
+    kdTree.getTuple(0, upper);
+    for (long i = 1; i < kdTree.size(); i++) {
+        for (long j = 0; j < 3; j++) {
+            lower[j] = std::min(lower[j], kdTree.coordinate(i, j));
+            upper[j] = std::max(upper[j], kdTree.coordinate(i, j));
+        }
+    }
+    
+    std::mt19937 random(12345);
+    std::uniform_int_distribution<long> position(0, kdTree.size() - 1);
+    boxes.resize(numQueries);
+    points.resize(numQueries * 3);
+    for (long q = 0; q < numQueries; q++) {
+        kdTree.getTuple(position(random), &points[q * 3]);
+        const long centre = position(random);
+        for (long j = 0; j < 3; j++) {
+            const float half = 0.025f * (upper[j] - lower[j]);
+            boxes[q].lower[j] = kdTree.coordinate(centre, j) - half;
+            boxes[q].upper[j] = kdTree.coordinate(centre, j) + half;
+        }
+    }
+}
+
+/*
+ * Measure the throughput of range and nearest-neighbour searches of a KdTree
+ * for several leaf bucket sizes, with the scalar and with the widest kernels.
+ *
+ * calling parameters:
+ *
+ * kdTree - the tree, whose bucket size is restored afterwards
+ * numQueries - the number of queries of each kind
+ */
+static void benchmarkBucketSizes(KdTree& kdTree, const long numQueries)
+{
+    if (kdTree.size() == 0 || kdTree.dimensions() != 3) {
+        return;
+    }
+    std::vector<KdBox> boxes;
+    std::vector<float> points;
+    drawBenchmarkQueries(kdTree, numQueries, boxes, points);
+    
+    const long savedBucketSize = kdTree.getBucketSize();
+    const KdKernels *savedKernels = kdKernels;
+    const KdKernels *kernels[] = {selectKdKernels("scalar"), selectKdKernels()};
+    const long bucketSizes[] = {1, 8, 16, 32, 64};
+    std::vector<KdNeighbour> neighbours;
+    std::cout << "\nbucket size\tkernels\tQ1 queries/s\tQ2 (k = 8) queries/s\n";
+    for (long b = 0; b < sizeof(bucketSizes) / sizeof(bucketSizes[0]); b++) {
+        kdTree.setBucketSize(bucketSizes[b]);
+        for (long k = 0; k < 2; k++) {
+            kdKernels = kernels[k];
+            unsigned long checksum = 0;
+            const std::chrono::steady_clock::time_point q1 = std::chrono::steady_clock::now();
+            for (long q = 0; q < numQueries; q++) {
+                KdCountSink sink;
+                kdTree.rangeSearch(boxes[q], sink);
+                checksum += sink.count;
+            }
+            const std::chrono::steady_clock::time_point q2 = std::chrono::steady_clock::now();
+            for (long q = 0; q < numQueries; q++) {
+                kdTree.knn(&points[q * 3], 8, neighbours);
+                checksum += neighbours.size();
+            }
+            const std::chrono::steady_clock::time_point done = std::chrono::steady_clock::now();
+            std::cout << bucketSizes[b] << "\t" << kernels[k]->name << "\t"
+            << numQueries / std::chrono::duration<double>(q2 - q1).count() << "\t"
+            << numQueries / std::chrono::duration<double>(done - q2).count()
+            << "\t(checksum " << checksum << ")\n";
+        }
+    }
+    kdTree.setBucketSize(savedBucketSize);
+    kdKernels = savedKernels;
+}
+
+/*
+ * Measure the latency and the cache and TLB misses of range and
+ * nearest-neighbour searches of a KdTree for each node layout.  The misses are
+ * those of the last-level cache and of data TLB loads per query, or n/a where
+ * the hardware counters are not available.
+ *
+ * calling parameters:
+ *
+ * kdTree - the tree, whose layout is restored afterwards
+ * numQueries - the number of queries of each kind
+ */
+static void benchmarkNodeLayouts(KdTree& kdTree, const long numQueries)
+{
+    if (kdTree.size() == 0 || kdTree.dimensions() != 3) {
+        return;
+    }
+    std::vector<KdBox> boxes;
+    std::vector<float> points;
+    drawBenchmarkQueries(kdTree, numQueries, boxes, points);
+    
+    const KdLayout savedLayout = kdTree.getLayout();
+    const KdLayout layouts[] = {LAYOUT_INORDER, LAYOUT_VEB, LAYOUT_BLOCKED};
+#ifdef __linux__
+    PerfCounter cacheMisses(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    PerfCounter tlbMisses(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                          | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+#else
+    PerfCounter cacheMisses(0, 0), tlbMisses(0, 0);
+#endif
+    auto perQuery = [numQueries](const long events) {
+        return (events < 0) ? std::string("n/a") : std::to_string((double) events / numQueries);
+    };
+    std::vector<KdNeighbour> neighbours;
+    std::cout << "\nlayout\tQ1 us/query\tQ1 cache misses\tQ1 TLB misses\tQ2 (k = 8) us/query\tQ2 cache misses\tQ2 TLB misses\n";
+    for (long l = 0; l < sizeof(layouts) / sizeof(layouts[0]); l++) {
+        kdTree.setLayout(layouts[l]);
+        unsigned long checksum = 0;
+        const std::chrono::steady_clock::time_point q1 = std::chrono::steady_clock::now();
+        cacheMisses.start();
+        tlbMisses.start();
+        for (long q = 0; q < numQueries; q++) {
+            KdCountSink sink;
+            kdTree.rangeSearch(boxes[q], sink);
+            checksum += sink.count;
+        }
+        const long q1CacheMisses = cacheMisses.stop(), q1TlbMisses = tlbMisses.stop();
+        const std::chrono::steady_clock::time_point q2 = std::chrono::steady_clock::now();
+        cacheMisses.start();
+        tlbMisses.start();
+        for (long q = 0; q < numQueries; q++) {
+            kdTree.knn(&points[q * 3], 8, neighbours);
+            checksum += kdTree.getIndex(neighbours.front().position);
+        }
+        const long q2CacheMisses = cacheMisses.stop(), q2TlbMisses = tlbMisses.stop();
+        const std::chrono::steady_clock::time_point done = std::chrono::steady_clock::now();
+        std::cout << KD_LAYOUT_NAMES[layouts[l]] << "\t"
+        << std::chrono::duration<double, std::micro>(q2 - q1).count() / numQueries << "\t"
+        << perQuery(q1CacheMisses) << "\t" << perQuery(q1TlbMisses) << "\t"
+        << std::chrono::duration<double, std::micro>(done - q2).count() / numQueries << "\t"
+        << perQuery(q2CacheMisses) << "\t" << perQuery(q2TlbMisses)
+        << "\t(checksum " << checksum << ")\n";
+    }
+    kdTree.setLayout(savedLayout);
+}
+
+/*
+ * Compare the throughput of nearest-neighbour searches of a KdTree one query
+ * at a time with that of knnBatch on one thread and on all threads, and check
+ * that the batches find the same tuples.
+ *
+ * calling parameters:
+ *
+ * kdTree - the tree
+ * numQueries - the number of queries
+ * numThreads - the number of threads of the last batch
+ */
+static void benchmarkBatchKnn(const KdTree& kdTree, const long numQueries, const long numThreads)
+{
+    if (kdTree.size() == 0 || kdTree.dimensions() != 3) {
+        return;
+    }
+    std::vector<KdBox> boxes;
+    std::vector<float> points;
+    drawBenchmarkQueries(kdTree, numQueries, boxes, points);
+    
+    std::cout << "\nsearch\tthreads\tQ2 (k = " << 8 << ") queries/s\tsame results\n";
+    std::vector<KdNeighbour> expected, neighbours;
+    const std::chrono::steady_clock::time_point loop = std::chrono::steady_clock::now();
+    for (long q = 0; q < numQueries; q++) {
+        kdTree.knn(&points[q * 3], 8, neighbours);
+        expected.insert(expected.end(), neighbours.begin(), neighbours.end());
+    }
+    std::cout << "knn\t1\t" << numQueries / std::chrono::duration<double>(std::chrono::steady_clock::now() - loop).count()
+    << "\tyes\n";
+    const long threads[] = {1, numThreads};
+    for (long t = 0; t < ((numThreads > 1) ? 2 : 1); t++) {
+        const std::chrono::steady_clock::time_point batch = std::chrono::steady_clock::now();
+        const std::vector<KdNeighbour> result = kdTree.knnBatch(points.data(), numQueries, 8, threads[t]);
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - batch).count();
+        bool same = result.size() == expected.size();
+        for (long i = 0; same && i < result.size(); i++) {
+            same = result[i].position == expected[i].position && result[i].distance == expected[i].distance;
+        }
+        std::cout << "knnBatch\t" << threads[t] << "\t" << numQueries / seconds << "\t" << (same ? "yes" : "no") << "\n";
+    }
+}
+
+/*
+ * Return a percentile of sorted latencies by the nearest rank.
+ *
+ * calling parameters:
+ *
+ * latencies - the latencies, in ascending order
+ * p - the fraction of the latencies at or below the percentile, e.g. 0.99
+ *
+ * returns: the smallest latency that is at least a fraction p of the latencies
+ */
+static double percentile(const std::vector<double>& latencies, const double p)
+{
+    const long n = (long) latencies.size();
+    return latencies[std::min(std::max((long) std::ceil(p * n) - 1, 0L), n - 1)];
+}
+
+/*
+ * Measure the recall and the latency of approximate nearest-neighbour
+ * searches for several distance tolerances and budgets of leaf buckets,
+ * against exact searches.  The recall of a query is the fraction of its k
+ * tuples that lie no farther than the true k-th nearest tuple.  Each line
+ * is one point of a recall-latency curve.
+ *
+ * calling parameters:
+ *
+ * kdTree - the tree
+ * numQueries - the number of queries
+ * k - the number of neighbours of each query
+ */
+static void benchmarkApproximateKnn(const KdTree& kdTree, const long numQueries, const long k)
+{
+    if (kdTree.size() == 0 || kdTree.dimensions() != 3) {
+        return;
+    }
+    std::vector<KdBox> boxes;
+    std::vector<float> points;
+    drawBenchmarkQueries(kdTree, numQueries, boxes, points);
+    
+    // Move each query off the tuple that it was drawn from, so that its nearest tuple is not at distance 0.
+    std::mt19937 random(54321);
+    std::normal_distribution<float> jitter(0, 1);
+    float lower[3], upper[3];
+    kdTree.getTuple(0, lower);
+    kdTree.getTuple(0, upper);
+    for (long i = 1; i < kdTree.size(); i++) {
+        for (long j = 0; j < 3; j++) {
+            lower[j] = std::min(lower[j], kdTree.coordinate(i, j));
+            upper[j] = std::max(upper[j], kdTree.coordinate(i, j));
+        }
+    }
+    const float spacing = std::cbrt((upper[0] - lower[0]) * (upper[1] - lower[1]) * (upper[2] - lower[2]) / kdTree.size());
+    for (long i = 0; i < points.size(); i++) {
+        points[i] += spacing * jitter(random);
+    }
+    
+    std::vector<double> latencies(numQueries);
+    std::vector<float> kth(numQueries);
+    std::vector<KdNeighbour> neighbours;
+    unsigned long visited = 0;
+    for (long q = 0; q < numQueries; q++) {
+        KdRangeStats stats;
+        const std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+        kdTree.knn(&points[q * 3], k, neighbours, stats);
+        latencies[q] = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - begin).count();
+        kth[q] = neighbours.back().distance;
+        visited += stats.visitedNodes + stats.scannedBuckets;
+    }
+    double mean = 0;
+    for (long q = 0; q < numQueries; q++) {
+        mean += latencies[q] / numQueries;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    std::cout << "\nsearch\tepsilon\tmax leaves\tQ2 (k = " << k << ") mean us\tp99 us\trecall\tprovably exact\tflagged exact wrongly\tvisited per query\n";
+    std::cout << "knn\t0\t-\t" << mean << "\t" << percentile(latencies, 0.99) << "\t1\t1\t0\t" << (double) visited / numQueries << "\n";
+    
+    const float epsilons[] = {0, 0.1f, 0.5f, 1, 2};
+    const long budgets[] = {0, 64, 16, 4, 1};
+    for (long e = 0; e < sizeof(epsilons) / sizeof(epsilons[0]); e++) {
+        for (long b = 0; b < sizeof(budgets) / sizeof(budgets[0]); b++) {
+            KdApproximation approximation;
+            approximation.epsilon = epsilons[e];
+            approximation.maxLeaves = budgets[b];
+            double recall = 0;
+            long exact = 0, wrong = 0;
+            visited = 0;
+            for (long q = 0; q < numQueries; q++) {
+                KdRangeStats stats;
+                const std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+                const bool flagged = kdTree.knnApproximate(&points[q * 3], k, approximation, neighbours, stats);
+                latencies[q] = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - begin).count();
+                long found = 0;
+                for (long i = 0; i < neighbours.size(); i++) {
+                    found += (neighbours[i].distance <= kth[q]);
+                }
+                recall += (double) found / std::min(k, kdTree.size());
+                exact += flagged;
+                wrong += flagged && found < std::min(k, kdTree.size());
+                visited += stats.visitedNodes + stats.scannedBuckets;
+            }
+            mean = 0;
+            for (long q = 0; q < numQueries; q++) {
+                mean += latencies[q] / numQueries;
+            }
+            std::sort(latencies.begin(), latencies.end());
+            std::cout << "knnApproximate\t" << epsilons[e] << "\t";
+            if (budgets[b] > 0) {
+                std::cout << budgets[b];
+            } else {
+                std::cout << "-";
+            }
+            std::cout << "\t" << mean << "\t" << percentile(latencies, 0.99) << "\t" << recall / numQueries << "\t"
+            << (double) exact / numQueries << "\t" << wrong << "\t" << (double) visited / numQueries << "\n";
+        }
+    }
+}
+
+/*
+ * Verify that searches in a steady state allocate no memory.  Each kind of
+ * search is run once over the queries, so that the result vectors and the
+ * scratch of the calling thread grow to their largest sizes, then again
+ * while the allocations are counted.  A pointer tree is built over the
+ * tuples of the flat tree in an arena for the searches of KdNode.  Only a
+ * build with -DKD_CHECK_ALLOCATIONS counts the allocations.
+ *
+ * calling parameters:
+ *
+ * kdTree - the tree
+ * numQueries - the number of queries of each kind
+ * k - the number of neighbours of a nearest-neighbour query
+ *
+ * returns: true if no search allocated
+ */
+static bool checkAllocations(const KdTree& kdTree, const long numQueries, const long k)
+{
+#ifndef KD_CHECK_ALLOCATIONS
+    (void) kdTree;
+    (void) numQueries;
+    (void) k;
+    std::cout << "--check-allocations needs a build with -DKD_CHECK_ALLOCATIONS, which counts the allocations\n";
+    return false;
+#else
+    if (kdTree.size() == 0 || kdTree.dimensions() != 3) {
+        return true;
+    }
+    std::vector<KdBox> boxes;
+    std::vector<float> points;
+    drawBenchmarkQueries(kdTree, numQueries, boxes, points);
+    std::vector<float> tuples(kdTree.size() * 3);
+    std::vector<float *> coordinateVector(kdTree.size());
+    for (long i = 0; i < kdTree.size(); i++) {
+        kdTree.getTuple(i, &tuples[i * 3]);
+        coordinateVector[i] = &tuples[i * 3];
+    }
+    KdNode::Arena arena;
+    const KdNode *root = KdNode::createKdTree(arena, coordinateVector, 3);
+    
+    std::vector<uint32_t> indices;
+    std::vector<KdNeighbour> neighbours;
+    std::vector<const float *> found;
+    KdApproximation approximation;
+    approximation.epsilon = 0.5f;
+    unsigned long total = 0;
+    const long numKinds = 8;
+    const char *names[numKinds] = {"KdTree::rangeSearch (count)", "KdTree::rangeSearch (indices)", "KdTree::rangeStream",
+        "KdTree::knn", "KdTree::radiusSearch", "KdTree::knnApproximate", "KdNode::rangeSearch", "KdNode::searchKdTree"};
+    auto search = [&](const long kind, const long q) {
+        const float *point = &points[q * 3];
+        const float radius = 0.5f * (boxes[q].upper[0] - boxes[q].lower[0]);
+        switch (kind) {
+            case 0: {
+                KdCountSink sink;
+                kdTree.rangeSearch(boxes[q], sink);
+                total += sink.count;
+                break;
+            }
+            case 1: {
+                indices.clear();
+                KdIndexSink sink(kdTree, indices);
+                kdTree.rangeSearch(boxes[q], sink);
+                total += indices.size();
+                break;
+            }
+            case 2:
+                total += kdTree.rangeStream(boxes[q], 0, LONG_MAX, [](const long *positions, const long count) {});
+                break;
+            case 3:
+                kdTree.knn(point, k, neighbours);
+                total += neighbours.size();
+                break;
+            case 4:
+                kdTree.radiusSearch(point, radius, neighbours);
+                total += neighbours.size();
+                break;
+            case 5:
+                kdTree.knnApproximate(point, k, approximation, neighbours);
+                total += neighbours.size();
+                break;
+            case 6: {
+                unsigned long visitedNodes = 0;
+                auto counted = [&total](const float *tuple) {
+                    total++;
+                };
+                root->rangeSearch(boxes[q].lower, boxes[q].upper, 3, 0, counted, visitedNodes);
+                break;
+            }
+            default:
+                root->searchKdTree(point, radius, 3, 0, found);
+                total += found.size();
+                break;
+        }
+    };
+    
+    bool none = true;
+    std::cout << "\nsearch\tqueries\tallocations in a steady state\n";
+    for (long kind = 0; kind < numKinds; kind++) {
+        for (long q = 0; q < numQueries; q++) {
+            search(kind, q);
+        }
+        const unsigned long before = kdAllocations.load();
+        for (long q = 0; q < numQueries; q++) {
+            search(kind, q);
+        }
+        const unsigned long allocations = kdAllocations.load() - before;
+        std::cout << names[kind] << "\t" << numQueries << "\t" << allocations << "\n";
+        none &= (allocations == 0);
+    }
+    std::cout << (none ? "No search allocated" : "Some searches allocated") << " (" << total << " results)\n";
+    return none;
+#endif
+}
+
+/*
+ * Compare range searches that visit each tuple found with the aggregate
+ * searches that add up the subtrees within the query box, for boxes that span
+ * 2% to 50% of the extent of the tuples on each axis.  The pointer tree, built
+ * over the tuples of the flat tree, counts the tuples by rangeSearch and by
+ * rangeCount; the flat tree sums their coordinates one tuple at a time and by
+ * rangeAggregate, after createSums.  The times are in microseconds per query.
+ *
+ * calling parameters:
+ *
+ * kdTree - the tree, whose sums are created
+ * numQueries - the number of queries of each size
+ */
+static void benchmarkRangeAggregates(KdTree& kdTree, const long numQueries)
+{
+    if (kdTree.size() == 0 || kdTree.dimensions() != 3) {
+        return;
+    }
+    kdTree.createSums();
+    std::vector<KdBox> boxes;
+    std::vector<float> points;
+    drawBenchmarkQueries(kdTree, numQueries, boxes, points);
+    std::vector<float> tuples(kdTree.size() * 3);
+    std::vector<float *> coordinateVector(kdTree.size());
+    for (long i = 0; i < kdTree.size(); i++) {
+        kdTree.getTuple(i, &tuples[i * 3]);
+        coordinateVector[i] = &tuples[i * 3];
+    }
+    KdNode::Arena arena;
+    const KdNode *root = KdNode::createKdTree(arena, coordinateVector, 3);
+    float rootLower[3], rootUpper[3];
+    root->getBounds(3, rootLower, rootUpper);
+    
+    std::cout << "\nspan\ttuples per query\tpointer walk us\tvisited\tpointer rangeCount us\tvisited"
+    << "\tflat sum walk us\tflat rangeAggregate us\tvisited\tsame results\n";
+    const float spans[] = {0.02f, 0.05f, 0.1f, 0.2f, 0.5f};
+    for (long s = 0; s < sizeof(spans) / sizeof(spans[0]); s++) {
+        std::vector<KdBox> scaled(boxes);
+        for (long q = 0; q < numQueries; q++) {
+            for (long j = 0; j < 3; j++) {
+                const float centre = 0.5f * (boxes[q].lower[j] + boxes[q].upper[j]);
+                const float half = 0.5f * (boxes[q].upper[j] - boxes[q].lower[j]) * spans[s] / 0.05f;
+                scaled[q].lower[j] = centre - half;
+                scaled[q].upper[j] = centre + half;
+            }
+        }
+        std::vector<unsigned long> walked(numQueries), counted(numQueries);
+        std::vector<KdAggregate> summed(numQueries), aggregated(numQueries);
+        unsigned long walkVisited = 0, countVisited = 0;
+        KdRangeStats stats;
+        
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (long q = 0; q < numQueries; q++) {
+            auto found = [&walked, q](const float *) {
+                walked[q]++;
+            };
+            root->rangeSearch(scaled[q].lower, scaled[q].upper, 3, 0, found, walkVisited);
+        }
+        const double walkTime = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+        
+        start = std::chrono::steady_clock::now();
+        for (long q = 0; q < numQueries; q++) {
+            float cellLower[3], cellUpper[3];
+            std::copy(rootLower, rootLower + 3, cellLower);
+            std::copy(rootUpper, rootUpper + 3, cellUpper);
+            counted[q] = root->rangeCount(scaled[q].lower, scaled[q].upper, cellLower, cellUpper, 3, 0, countVisited);
+        }
+        const double countTime = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+        
+        start = std::chrono::steady_clock::now();
+        for (long q = 0; q < numQueries; q++) {
+            KdAggregate& aggregate = summed[q];
+            auto sink = makeCallbackSink([&](const long position) {
+                float tuple[3];
+                kdTree.getTuple(position, tuple);
+                aggregate.count++;
+                for (long j = 0; j < 3; j++) {
+                    aggregate.sum[j] += tuple[j];
+                }
+            });
+            kdTree.rangeSearch(scaled[q], sink);
+        }
+        const double sumTime = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+        
+        start = std::chrono::steady_clock::now();
+        for (long q = 0; q < numQueries; q++) {
+            kdTree.rangeAggregate(scaled[q], aggregated[q], stats);
+        }
+        const double aggregateTime = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+        
+        // The sums differ only by the rounding of their different orders of addition.
+        bool same = true;
+        unsigned long tuples = 0;
+        for (long q = 0; q < numQueries; q++) {
+            same &= walked[q] == counted[q] && counted[q] == summed[q].count && summed[q].count == aggregated[q].count;
+            for (long j = 0; j < 3; j++) {
+                same &= std::fabs(summed[q].sum[j] - aggregated[q].sum[j]) <= 1e-6 * std::max(std::fabs(summed[q].sum[j]), 1.0);
+            }
+            tuples += walked[q];
+        }
+        std::cout << spans[s] << "\t" << (double) tuples / numQueries << "\t" << walkTime / numQueries << "\t"
+        << (double) walkVisited / numQueries << "\t" << countTime / numQueries << "\t" << (double) countVisited / numQueries
+        << "\t" << sumTime / numQueries << "\t" << aggregateTime / numQueries << "\t"
+        << (double) stats.visitedNodes / numQueries << "\t" << (same ? "yes" : "no") << "\n";
+    }
+}
+
+/* The number of client threads of benchmarkQueryServer, and of futures that each waits for at a time. */
+#define KD_SERVER_CLIENTS (4)
+#define KD_SERVER_WINDOW (64)
+
+/*
+ * Measure the throughput of a KdQueryServer on an even mix of range and
+ * nearest-neighbour (k = 8) queries for 1 to numThreads workers, first with
+ * futures and then with callbacks.  KD_SERVER_CLIENTS client threads submit
+ * the queries, each waiting for the futures of a window of them at a time,
+ * and the answers are compared with those of the queries answered one at a
+ * time on the calling thread.
+ *
+ * calling parameters:
+ *
+ * kdTree - the tree
+ * numQueries - the number of queries
+ * numThreads - the largest number of workers
+ */
+static void benchmarkQueryServer(const KdTree& kdTree, const long numQueries, const long numThreads)
+{
+    if (kdTree.size() == 0 || kdTree.dimensions() != 3) {
+        return;
+    }
+    std::vector<KdBox> boxes;
+    std::vector<float> points;
+    drawBenchmarkQueries(kdTree, numQueries, boxes, points);
+    std::vector<KdQuery> queries(numQueries);
+    for (long q = 0; q < numQueries; q++) {
+        queries[q].kind = 1 + (q & 1);
+        queries[q].k = 8;
+        queries[q].box = boxes[q];
+        std::copy(&points[q * 3], &points[q * 3] + 3, queries[q].point);
+    }
+    
+    std::cout << "\nsearch\tworkers\tmixed Q1/Q2 (k = 8) queries/s\tspeedup\tsame results\n";
+    std::vector<size_t> expected(numQueries);
+    std::vector<KdNeighbour> neighbours;
+    const std::chrono::steady_clock::time_point loop = std::chrono::steady_clock::now();
+    for (long q = 0; q < numQueries; q++) {
+        if (queries[q].kind == 1) {
+            KdCountSink sink;
+            kdTree.rangeSearch(queries[q].box, sink);
+            expected[q] = sink.count;
+        } else {
+            kdTree.knn(queries[q].point, queries[q].k, neighbours);
+            expected[q] = neighbours.size();
+        }
+    }
+    std::cout << "direct\t0\t" << numQueries / std::chrono::duration<double>(std::chrono::steady_clock::now() - loop).count()
+    << "\t\tyes\n";
+    
+    std::vector<long> workers;
+    for (long t = 1; t < numThreads; t *= 2) {
+        workers.push_back(t);
+    }
+    workers.push_back(numThreads);
+    for (long mode = 0; mode < 2; mode++) {
+        double single = 0;
+        for (long w = 0; w < workers.size(); w++) {
+            std::atomic<long> answered(0), wrong(0);
+            const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            {
+                KdQueryServer<KdTree> server(kdTree, workers[w]);
+                auto client = [&](const long c) {
+                    std::vector< std::future<KdQueryAnswer> > window;
+                    std::vector<long> numbers;
+                    for (long q = c; q < numQueries; q += KD_SERVER_CLIENTS) {
+                        if (mode == 0) {
+                            window.push_back(server.submit(queries[q]));
+                            numbers.push_back(q);
+                        } else {
+                            server.submit(queries[q], [&, q](KdQueryAnswer& answer) {
+                                wrong += (answer.size() != expected[q]);
+                                answered++;
+                            });
+                        }
+                        if (window.size() == KD_SERVER_WINDOW || (q + KD_SERVER_CLIENTS >= numQueries && !window.empty())) {
+                            for (long i = 0; i < window.size(); i++) {
+                                wrong += (window[i].get().size() != expected[numbers[i]]);
+                                answered++;
+                            }
+                            window.clear();
+                            numbers.clear();
+                        }
+                    }
+                };
+                std::vector<std::thread> clients;
+                for (long c = 1; c < KD_SERVER_CLIENTS; c++) {
+                    clients.push_back(std::thread(client, c));
+                }
+                client(0);
+                for (long c = 0; c < clients.size(); c++) {
+                    clients[c].join();
+                }
+            }
+            const double rate = numQueries / std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if (w == 0) {
+                single = rate;
+            }
+            std::cout << ((mode == 0) ? "futures" : "callbacks") << "\t" << workers[w] << "\t" << rate << "\t"
+            << rate / single << "\t" << ((answered == numQueries && wrong == 0) ? "yes" : "no") << "\n";
+        }
+    }
+}
+
+/*
+ * Compare the dual-tree joinWithin and nearestWithin of two trees with loops
+ * of radiusSearch and knn over the tuples of the first tree, on one thread
+ * and on all threads, and check that they find the same pairs and the same
+ * nearest distances.
+ *
+ * calling parameters:
+ *
+ * a - the tree whose tuples are joined
+ * b - the tree that is searched
+ * radius - the join distance
+ * numThreads - the number of threads of the last runs
+ */
+static void benchmarkJoin(const KdTree& a, const KdTree& b, const float radius, const long numThreads)
+{
+    if (a.size() == 0 || b.size() == 0 || a.dimensions() != b.dimensions()) {
+        return;
+    }
+    const long dim = a.dimensions();
+    std::cout << "\n" << a.size() << " x " << b.size() << " tuples within " << radius << "\n";
+    std::cout << "search\tthreads\tms\tpairs\tsame results\n";
+    std::vector<float> tuple(dim);
+    std::vector<KdNeighbour> neighbours;
+    unsigned long expected = 0;
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    for (long p = 0; p < a.size(); p++) {
+        a.getTuple(p, tuple.data());
+        b.radiusSearch(tuple.data(), radius, neighbours);
+        expected += neighbours.size();
+    }
+    std::cout << "radiusSearch loop\t1\t" << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count()
+    << "\t" << expected << "\tyes\n";
+    const long threads[] = {1, numThreads};
+    for (long t = 0; t < ((numThreads > 1) ? 2 : 1); t++) {
+        std::vector<KdPairCountSink> sinks(threads[t]);
+        begin = std::chrono::steady_clock::now();
+        a.joinWithin(b, radius, sinks, threads[t]);
+        const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+        unsigned long pairs = 0;
+        for (long i = 0; i < sinks.size(); i++) {
+            pairs += sinks[i].count;
+        }
+        std::cout << "joinWithin\t" << threads[t] << "\t" << ms << "\t" << pairs << "\t" << ((pairs == expected) ? "yes" : "no") << "\n";
+    }
+    
+    std::cout << "search\tthreads\tms\ttuples matched\tsame results\n";
+    std::vector<float> nearest(a.size());
+    unsigned long matched = 0;
+    begin = std::chrono::steady_clock::now();
+    for (long p = 0; p < a.size(); p++) {
+        a.getTuple(p, tuple.data());
+        b.knn(tuple.data(), 1, neighbours);
+        nearest[p] = neighbours.front().distance;
+        matched += (nearest[p] <= radius * radius);
+    }
+    std::cout << "knn loop\t1\t" << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count()
+    << "\t" << matched << "\tyes\n";
+    for (long t = 0; t < ((numThreads > 1) ? 2 : 1); t++) {
+        begin = std::chrono::steady_clock::now();
+        const std::vector<KdNeighbour> result = a.nearestWithin(b, radius, threads[t]);
+        const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+        unsigned long found = 0;
+        bool same = true;
+        for (long p = 0; p < a.size(); p++) {
+            found += (result[p].position >= 0);
+            same &= (result[p].position >= 0) ? (result[p].distance == nearest[p]) : (nearest[p] > radius * radius);
+        }
+        std::cout << "nearestWithin\t" << threads[t] << "\t" << ms << "\t" << found << "\t" << (same ? "yes" : "no") << "\n";
+    }
+}
+
+/*
+ * Compare the memory and the query throughput of a KdTree with those of its
+ * QuantizedKdTree, and check that both find the same tuples.
+ *
+ * calling parameters:
+ *
+ * kdTree - the tree
+ * quantized - the compressed tree
+ * numQueries - the number of queries of each kind
+ */
+static void benchmarkQuantized(const KdTree& kdTree, const QuantizedKdTree& quantized, const long numQueries)
+{
+    if (kdTree.size() == 0 || kdTree.dimensions() != 3) {
+        return;
+    }
+    std::vector<KdBox> boxes;
+    std::vector<float> points;
+    drawBenchmarkQueries(kdTree, numQueries, boxes, points);
+    
+    std::vector<KdNeighbour> neighbours;
+    std::cout << "\ntree\tbytes per point\tof which borrowed\tQ1 queries/s\tQ2 (k = 8) queries/s\ttuples refined per Q1\tper Q2\n";
+    for (long t = 0; t < 2; t++) {
+        unsigned long checksum = 0;
+        KdRangeStats stats;
+        unsigned long refined = 0;
+        const std::chrono::steady_clock::time_point q1 = std::chrono::steady_clock::now();
+        for (long q = 0; q < numQueries; q++) {
+            KdCountSink sink;
+            if (t == 0) {
+                kdTree.rangeSearch(boxes[q], sink, stats);
+            } else {
+                quantized.rangeSearch(boxes[q], sink, stats);
+            }
+            checksum += sink.count;
+        }
+        const std::chrono::steady_clock::time_point q2 = std::chrono::steady_clock::now();
+        for (long q = 0; q < numQueries; q++) {
+            if (t == 0) {
+                kdTree.knn(&points[q * 3], 8, neighbours);
+            } else {
+                quantized.knn(&points[q * 3], 8, neighbours, &refined);
+            }
+            checksum += (unsigned long) neighbours.back().distance;
+        }
+        const std::chrono::steady_clock::time_point done = std::chrono::steady_clock::now();
+        const size_t bytes = (t == 0) ? kdTree.memoryUsage() : quantized.memoryUsage();
+        const size_t borrowed = (t == 0) ? 0 : quantized.borrowedMemoryUsage();
+        std::cout << ((t == 0) ? "KdTree" : (quantized.getBits() == 16) ? "16-bit" : "21-bit") << "\t"
+        << (double) bytes / kdTree.size() << "\t" << (double) borrowed / kdTree.size() << "\t"
+        << numQueries / std::chrono::duration<double>(q2 - q1).count() << "\t"
+        << numQueries / std::chrono::duration<double>(done - q2).count() << "\t"
+        << (double) stats.refinedTuples / numQueries << "\t" << (double) refined / numQueries
+        << "\t(checksum " << checksum << ")\n";
+    }
+}
+
+/*
+ * Time the build, range searches and nearest-neighbour searches of a
+ * FixedKdTree, and print them as one row of benchmarkDimensions.
+ *
+ * calling parameters:
+ *
+ * name - the name of the row
+ * coordinates - the tuples, Dim floats each
+ * numTuples - the number of tuples
+ * boxes - the query boxes, whose first Dim bounds are used
+ * points - the query points, Dim floats each
+ * scale - the factor by which coordinates are multiplied before conversion to T
+ * numThreads - the number of threads that build
+ */
+template <long Dim, typename T>
+static void benchmarkFixedKdTree(const char *name, const std::vector<float>& coordinates, const long numTuples,
+                                 const std::vector<KdBox>& boxes, const std::vector<float>& points,
+                                 const double scale, const long numThreads)
+{
+    std::vector<T> converted(coordinates.size());
+    for (long i = 0; i < converted.size(); i++) {
+        converted[i] = (T) (std::is_integral<T>::value ? std::lround(coordinates[i] * scale) : coordinates[i] * scale);
+    }
+    const long numQueries = (long) boxes.size();
+    std::vector<typename FixedKdTree<Dim, T>::Box> fixedBoxes(numQueries);
+    std::vector<T> fixedPoints(numQueries * Dim);
+    for (long q = 0; q < numQueries; q++) {
+        for (long j = 0; j < Dim; j++) {
+            fixedBoxes[q].lower[j] = (T) (std::is_integral<T>::value ? std::lround(boxes[q].lower[j] * scale) : boxes[q].lower[j] * scale);
+            fixedBoxes[q].upper[j] = (T) (std::is_integral<T>::value ? std::lround(boxes[q].upper[j] * scale) : boxes[q].upper[j] * scale);
+            fixedPoints[q * Dim + j] = (T) (std::is_integral<T>::value ? std::lround(points[q * Dim + j] * scale) : points[q * Dim + j] * scale);
+        }
+    }
+    
+    const std::chrono::steady_clock::time_point build = std::chrono::steady_clock::now();
+    FixedKdTree<Dim, T> kdTree = FixedKdTree<Dim, T>::createKdTree(converted.data(), numTuples, numThreads);
+    const std::chrono::steady_clock::time_point q1 = std::chrono::steady_clock::now();
+    unsigned long checksum = 0;
+    for (long q = 0; q < numQueries; q++) {
+        KdCountSink sink;
+        kdTree.rangeSearch(fixedBoxes[q], sink);
+        checksum += sink.count;
+    }
+    const std::chrono::steady_clock::time_point q2 = std::chrono::steady_clock::now();
+    std::vector< std::pair<typename FixedKdTree<Dim, T>::Distance, long> > neighbours;
+    for (long q = 0; q < numQueries; q++) {
+        kdTree.knn(&fixedPoints[q * Dim], 8, neighbours);
+        checksum += kdTree.getIndex(neighbours.front().second);
+    }
+    const std::chrono::steady_clock::time_point done = std::chrono::steady_clock::now();
+    std::cout << Dim << "\t" << name << "\t" << std::chrono::duration<double, std::milli>(q1 - build).count() << "\t"
+    << numQueries / std::chrono::duration<double>(q2 - q1).count() << "\t"
+    << numQueries / std::chrono::duration<double>(done - q2).count() << "\t"
+    << (double) kdTree.memoryUsage() / std::max(kdTree.size(), 1L) << "\t" << checksum << "\n";
+}
+
+/*
+ * Compare the FixedKdTree of float, double and int32_t coordinates with the
+ * runtime-dimension KdTree, built by the same selection method, for uniformly
+ * distributed tuples of two, three and four dimensions.  The query boxes are
+ * sized to hold about 1000 tuples.  The checksum sums the range counts and the
+ * input indices of the nearest tuples, so it matches between the trees except
+ * where quantization to int32_t moves tuples across a box boundary or ties.
+ *
+ * calling parameters:
+ *
+ * numTuples - the number of tuples of each dimension
+ * numQueries - the number of queries of each kind
+ * numThreads - the number of threads that build
+ */
+template <long Dim>
+static void benchmarkDimension(const long numTuples, const long numQueries, const long numThreads)
+{
+    std::mt19937 random(12345 + Dim);
+    std::uniform_real_distribution<float> uniform(0, 100);
+    std::vector<float> coordinates(numTuples * Dim);
+    for (long i = 0; i < coordinates.size(); i++) {
+        coordinates[i] = uniform(random);
+    }
+    const float half = 50 * std::pow(1000. / std::max(numTuples, 1000L), 1. / Dim);
+    std::vector<KdBox> boxes(numQueries);
+    std::vector<float> points(numQueries * Dim);
+    for (long q = 0; q < numQueries; q++) {
+        for (long j = 0; j < Dim; j++) {
+            const float centre = uniform(random);
+            boxes[q].lower[j] = centre - half;
+            boxes[q].upper[j] = centre + half;
+            points[q * Dim + j] = uniform(random);
+        }
+    }
+    
+    const std::chrono::steady_clock::time_point build = std::chrono::steady_clock::now();
+    KdTree kdTree = KdTree::createKdTree(coordinates.data(), numTuples, Dim, numThreads, BUILD_SELECT);
+    const std::chrono::steady_clock::time_point q1 = std::chrono::steady_clock::now();
+    unsigned long checksum = 0;
+    for (long q = 0; q < numQueries; q++) {
+        KdCountSink sink;
+        kdTree.rangeSearch(boxes[q], sink);
+        checksum += sink.count;
+    }
+    const std::chrono::steady_clock::time_point q2 = std::chrono::steady_clock::now();
+    std::vector<KdNeighbour> neighbours;
+    for (long q = 0; q < numQueries; q++) {
+        kdTree.knn(&points[q * Dim], 8, neighbours);
+        checksum += kdTree.getIndex(neighbours.front().position);
+    }
+    const std::chrono::steady_clock::time_point done = std::chrono::steady_clock::now();
+    std::cout << Dim << "\tKdTree (runtime)\t" << std::chrono::duration<double, std::milli>(q1 - build).count() << "\t"
+    << numQueries / std::chrono::duration<double>(q2 - q1).count() << "\t"
+    << numQueries / std::chrono::duration<double>(done - q2).count() << "\t"
+    << (double) kdTree.memoryUsage() / std::max(kdTree.size(), 1L) << "\t" << checksum << "\n";
+    
+    benchmarkFixedKdTree<Dim, float>("FixedKdTree<float>", coordinates, numTuples, boxes, points, 1, numThreads);
+    benchmarkFixedKdTree<Dim, double>("FixedKdTree<double>", coordinates, numTuples, boxes, points, 1, numThreads);
+    benchmarkFixedKdTree<Dim, int32_t>("FixedKdTree<int32_t>", coordinates, numTuples, boxes, points, 1 << 20, numThreads);
+}
+
+static void benchmarkDimensions(const long numTuples, const long numQueries, const long numThreads)
+{
+    std::cout << "\n" << numTuples << " uniform tuples, " << numQueries << " queries of each kind, "
+    << kdKernels->name << " kernels for KdTree\n";
+    std::cout << "dimensions\ttree\tbuild ms\tQ1 queries/s\tQ2 (k = 8) queries/s\tbytes per point\tchecksum\n";
+    benchmarkDimension<2>(numTuples, numQueries, numThreads);
+    benchmarkDimension<3>(numTuples, numQueries, numThreads);
+    benchmarkDimension<4>(numTuples, numQueries, numThreads);
+}
+
+/* The synthetic point clouds of runBenchmark. */
+enum KdBenchmarkCloud
+{
+    CLOUD_UNIFORM,     // uniform in a cube of side 100
+    CLOUD_CLUSTERED,   // Gaussian clusters of varied spread, with the cluster sizes in Zipf proportions
+    CLOUD_DUPLICATES   // exact copies of a few tuples, tuples on a line and tuples on a plane, rounded to a grid
+};
+static const char *KD_BENCHMARK_CLOUD_NAMES[] = {"uniform", "clustered", "duplicates"};
+
+/*
+ * Generate a three-dimensional synthetic point cloud.  The same size and
+ * seed always give the same tuples.
+ *
+ * calling parameters:
+ *
+ * cloud - the kind of cloud
+ * numTuples - the number of tuples
+ * seed - the seed of the random number generator
+ *
+ * returns: the coordinates, three floats per tuple
+ */
+static std::vector<float> generateBenchmarkCloud(const KdBenchmarkCloud cloud, const long numTuples, const uint64_t seed)
+{
+    std::mt19937_64 random(seed);
+    std::uniform_real_distribution<float> uniform(0, 100);
+    std::vector<float> coordinates(numTuples * 3);
+    if (cloud == CLOUD_UNIFORM) {
+        for (long i = 0; i < coordinates.size(); i++) {
+            coordinates[i] = uniform(random);
+        }
+    } else if (cloud == CLOUD_CLUSTERED) {
+        const long numClusters = 32;
+        std::vector<float> centres(numClusters * 3), spreads(numClusters);
+        std::vector<double> weights(numClusters);
+        for (long c = 0; c < numClusters; c++) {
+            for (long j = 0; j < 3; j++) {
+                centres[c * 3 + j] = uniform(random);
+            }
+            spreads[c] = 0.1f + 0.04f * uniform(random);
+            weights[c] = 1. / (c + 1);
+        }
+        std::discrete_distribution<long> cluster(weights.begin(), weights.end());
+        std::normal_distribution<float> normal(0, 1);
+        for (long i = 0; i < numTuples; i++) {
+            const long c = cluster(random);
+            for (long j = 0; j < 3; j++) {
+                coordinates[i * 3 + j] = centres[c * 3 + j] + spreads[c] * normal(random);
+            }
+        }
+    } else {
+        // A quarter of the tuples repeat 1000 tuples exactly, a quarter lie on
+        // the diagonal, and the rest lie on the plane z = 50; the last two are
+        // rounded to grids, so that they repeat as well.
+        std::vector<float> repeated(1000 * 3);
+        for (long i = 0; i < repeated.size(); i++) {
+            repeated[i] = uniform(random);
+        }
+        std::uniform_int_distribution<long> pick(0, 999);
+        for (long i = 0; i < numTuples; i++) {
+            float *tuple = &coordinates[i * 3];
+            if (i % 4 == 0) {
+                const long r = pick(random);
+                std::copy(&repeated[r * 3], &repeated[r * 3] + 3, tuple);
+            } else if (i % 4 == 1) {
+                tuple[0] = tuple[1] = tuple[2] = std::round(uniform(random) * 1000) / 1000;
+            } else {
+                tuple[0] = std::round(uniform(random) * 100) / 100;
+                tuple[1] = std::round(uniform(random) * 100) / 100;
+                tuple[2] = 50;
+            }
+        }
+    }
+    return coordinates;
+}
+
+/*
+ * Reset the peak resident set size of the process, where the kernel allows
+ * it, so that the peak of each benchmark phase can be read separately.
+ *
+ * returns: true if the peak was reset
+ */
+static bool resetPeakResident()
+{
+#ifdef __linux__
+    std::ofstream clearRefs("/proc/self/clear_refs");
+    clearRefs << "5";
+    clearRefs.close();
+    return !clearRefs.fail();
+#else
+    return false;
+#endif
+}
+
+/*
+ * Return the peak resident set size of the process in bytes, since the last
+ * resetPeakResident where that succeeded.
+ */
+static long peakResidentBytes()
+{
+#ifdef __linux__
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.compare(0, 6, "VmHWM:") == 0) {
+            return atol(line.c_str() + 6) * 1024;
+        }
+    }
+#endif
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss * 1024; // ru_maxrss is in kilobytes.
+}
+
+/* One line of JSON output of runBenchmark: an object of named strings and numbers. */
+class KdBenchmarkRecord
+{
+private:
+    std::ostringstream text;
+
+public:
+    KdBenchmarkRecord()
+    {
+        this->text << std::setprecision(6);
+    }
+
+    KdBenchmarkRecord& field(const char *name, const std::string& value)
+    {
+        this->text << (this->text.tellp() > 0 ? ", \"" : "{\"") << name << "\": \"" << value << "\"";
+        return *this;
+    }
+
+    KdBenchmarkRecord& field(const char *name, const double value)
+    {
+        this->text << (this->text.tellp() > 0 ? ", \"" : "{\"") << name << "\": ";
+        if (std::isfinite(value)) {
+            this->text << value;
+        } else {
+            this->text << "null";
+        }
+        return *this;
+    }
+
+    KdBenchmarkRecord& field(const char *name, const long value)
+    {
+        this->text << (this->text.tellp() > 0 ? ", \"" : "{\"") << name << "\": " << value;
+        return *this;
+    }
+
+    KdBenchmarkRecord& field(const char *name, const unsigned long value)
+    {
+        this->text << (this->text.tellp() > 0 ? ", \"" : "{\"") << name << "\": " << value;
+        return *this;
+    }
+
+    std::string str() const
+    {
+        return this->text.str() + "}";
+    }
+};
+
+/*
+ * Summarize the latencies of a set of queries in a record: the throughput of
+ * one thread, the 50th and 99th percentile latencies by the nearest rank, and
+ * the mean number of results and of visited nodes and scanned tuples.
+ *
+ * calling parameters:
+ *
+ * record - receives the fields
+ * latencies - the latency of each query in microseconds, which are sorted
+ * results - the total number of results
+ * stats - the total counters of the queries
+ */
+static void summarizeLatencies(KdBenchmarkRecord& record, std::vector<double>& latencies, const unsigned long results,
+                               const KdRangeStats& stats)
+{
+    const long n = (long) latencies.size();
+    std::sort(latencies.begin(), latencies.end());
+    double total = 0;
+    for (long i = 0; i < n; i++) {
+        total += latencies[i];
+    }
+    record.field("queries", n)
+    .field("qps", n / (total * 1e-6))
+    .field("p50_us", percentile(latencies, 0.5))
+    .field("p99_us", percentile(latencies, 0.99))
+    .field("mean_results", (double) results / n)
+    .field("mean_visited_nodes", (double) stats.visitedNodes / n)
+    .field("mean_scanned_tuples", (double) stats.scannedTuples / n);
+}
+
+/*
+ * Benchmark a KdTree on a synthetic point cloud and print one JSON record per
+ * phase: the build, a save and verified load of an index file, range searches
+ * at several selectivities and nearest-neighbour searches for several k.
+ * Each query is timed by the wall clock on one thread for the latency
+ * percentiles; the parallel throughput of the same queries is measured with
+ * rangeCount and knnBatch on numThreads threads.  The peak resident set size
+ * is that of the phase where the kernel can reset it, and of the process
+ * otherwise.
+ *
+ * calling parameters:
+ *
+ * cloud - the kind of cloud
+ * numTuples - the number of tuples
+ * seed - the seed of the cloud and of the queries
+ * numQueries - the number of queries of each kind
+ * numThreads - the number of threads that build and search in parallel
+ * builder - the method of finding each median
+ * bucketSize - the largest leaf bucket
+ * layout - the order of the nodes
+ */
+static void runBenchmark(const KdBenchmarkCloud cloud, const long numTuples, const uint64_t seed, const long numQueries,
+                         const long numThreads, const KdBuilder builder, const long bucketSize, const KdLayout layout)
+{
+    const bool phasePeak = resetPeakResident();
+    const std::string peakScope = phasePeak ? "phase" : "process";
+    auto base = [&](const char *phase) {
+        KdBenchmarkRecord record;
+        record.field("cloud", KD_BENCHMARK_CLOUD_NAMES[cloud]).field("tuples", numTuples).field("seed", (unsigned long) seed)
+        .field("phase", phase);
+        return record;
+    };
+    auto finish = [&](KdBenchmarkRecord& record) {
+        record.field("peak_rss_mb", peakResidentBytes() / (1024. * 1024.)).field("peak_rss_scope", peakScope);
+        std::cout << record.str() << std::endl;
+        resetPeakResident();
+    };
+
+    const std::chrono::steady_clock::time_point generate = std::chrono::steady_clock::now();
+    std::vector<float> coordinates = generateBenchmarkCloud(cloud, numTuples, seed);
+    const double generateMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - generate).count();
+
+    // The build phase includes the input tuples, which the flat tree copies.
+    const std::chrono::steady_clock::time_point build = std::chrono::steady_clock::now();
+    KdTree kdTree = KdTree::createKdTree(coordinates.data(), numTuples, 3, numThreads, builder, bucketSize, layout);
+    const double buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - build).count();
+    std::vector<float>().swap(coordinates);
+    KdBenchmarkRecord buildRecord = base("build");
+    buildRecord.field("generate_ms", generateMs).field("build_ms", buildMs).field("distinct_tuples", kdTree.size())
+    .field("threads", numThreads).field("bucket", kdTree.getBucketSize())
+    .field("layout", KD_LAYOUT_NAMES[kdTree.getLayout()]).field("kernels", kdKernels->name)
+    .field("bytes_per_point", (double) kdTree.memoryUsage() / std::max(kdTree.size(), 1L));
+    finish(buildRecord);
+    if (kdTree.size() == 0) {
+        return;
+    }
+
+    // Save the tree to a temporary index file and map it back with its checksum verified.
+    const char *directory = getenv("TMPDIR");
+    std::string path = std::string((directory != NULL && *directory != 0) ? directory : "/tmp") + "/kdtree-benchmark-XXXXXX";
+    const int fd = mkstemp(&path[0]);
+    if (fd >= 0) {
+        close(fd);
+        const std::chrono::steady_clock::time_point save = std::chrono::steady_clock::now();
+        const bool saved = kdTree.save(path);
+        const std::chrono::steady_clock::time_point load = std::chrono::steady_clock::now();
+        KdTree loaded;
+        const std::string error = saved ? KdTree::load(path, loaded, true) : "could not write the index file";
+        const std::chrono::steady_clock::time_point done = std::chrono::steady_clock::now();
+        struct stat status;
+        const long fileBytes = (stat(path.c_str(), &status) == 0) ? (long) status.st_size : 0;
+        unlink(path.c_str());
+        KdBenchmarkRecord loadRecord = base("load");
+        loadRecord.field("save_ms", std::chrono::duration<double, std::milli>(load - save).count())
+        .field("load_ms", std::chrono::duration<double, std::milli>(done - load).count())
+        .field("file_bytes", fileBytes).field("error", error);
+        finish(loadRecord);
+    }
+
+    // Centre the query boxes and points on randomly chosen tuples.  A box of
+    // selectivity s spans the cube root of s of the extent on each axis, so it
+    // holds about the fraction s of uniform tuples.
+    float lower[3], upper[3];
+    kdTree.getTuple(0, lower);
+    kdTree.getTuple(0, upper);
+    for (long i = 1; i < kdTree.size(); i++) {
+        for (long j = 0; j < 3; j++) {
+            lower[j] = std::min(lower[j], kdTree.coordinate(i, j));
+            upper[j] = std::max(upper[j], kdTree.coordinate(i, j));
+        }
+    }
+    std::mt19937_64 random(seed + 1);
+    std::uniform_int_distribution<long> position(0, kdTree.size() - 1);
+    std::vector<float> centres(numQueries * 3), points(numQueries * 3);
+    for (long q = 0; q < numQueries; q++) {
+        kdTree.getTuple(position(random), &centres[q * 3]);
+        kdTree.getTuple(position(random), &points[q * 3]);
+    }
+    std::vector<double> latencies(numQueries);
+
+    const double selectivities[] = {1e-5, 1e-4, 1e-3, 1e-2};
+    for (long s = 0; s < sizeof(selectivities) / sizeof(selectivities[0]); s++) {
+        std::vector<KdBox> boxes(numQueries);
+        for (long q = 0; q < numQueries; q++) {
+            for (long j = 0; j < 3; j++) {
+                const float half = 0.5f * std::cbrt(selectivities[s]) * (upper[j] - lower[j]);
+                boxes[q].lower[j] = centres[q * 3 + j] - half;
+                boxes[q].upper[j] = centres[q * 3 + j] + half;
+            }
+        }
+        KdRangeStats stats;
+        unsigned long results = 0;
+        for (long q = 0; q < numQueries; q++) {
+            const std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+            KdCountSink sink;
+            kdTree.rangeSearch(boxes[q], sink, stats);
+            latencies[q] = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - begin).count();
+            results += sink.count;
+        }
+        const std::chrono::steady_clock::time_point parallel = std::chrono::steady_clock::now();
+        kdTree.rangeCount(boxes, numThreads);
+        const double parallelSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - parallel).count();
+        KdBenchmarkRecord rangeRecord = base("range");
+        rangeRecord.field("selectivity", selectivities[s]);
+        summarizeLatencies(rangeRecord, latencies, results, stats);
+        rangeRecord.field("parallel_qps", numQueries / parallelSeconds).field("threads", numThreads);
+        finish(rangeRecord);
+    }
+
+    const long ks[] = {1, 8, 64};
+    std::vector<KdNeighbour> neighbours;
+    for (long n = 0; n < sizeof(ks) / sizeof(ks[0]); n++) {
+        KdRangeStats stats;
+        unsigned long results = 0;
+        for (long q = 0; q < numQueries; q++) {
+            const std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+            kdTree.knn(&points[q * 3], ks[n], neighbours, stats);
+            latencies[q] = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - begin).count();
+            results += neighbours.size();
+        }
+        const std::chrono::steady_clock::time_point parallel = std::chrono::steady_clock::now();
+        kdTree.knnBatch(points.data(), numQueries, ks[n], numThreads);
+        const double parallelSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - parallel).count();
+        KdBenchmarkRecord knnRecord = base("knn");
+        knnRecord.field("k", ks[n]);
+        summarizeLatencies(knnRecord, latencies, results, stats);
+        knnRecord.field("parallel_qps", numQueries / parallelSeconds).field("threads", numThreads);
+        finish(knnRecord);
+    }
+}
+
+#define SEARCH_DISTANCE (+INFINITY)
+/* Create a simple k-d tree and print its topology for inspection. */
+int main(int argc, const char * argv[]) {
+    std::cout << std::setprecision(7);
+    
+    // --benchmark-dimensions [N] compares the FixedKdTree with the KdTree for
+    // N synthetic tuples of two, three and four dimensions, without an input file.
+    if (argc > 1 && std::string(argv[1]) == "--benchmark-dimensions") {
+        const long numTuples = (argc > 2) ? std::max(atol(argv[2]), 1L) : 1000000;
+        benchmarkDimensions(numTuples, 100000, std::max((long) std::thread::hardware_concurrency(), 1L));
+        return 0;
+    }
+
+    // --benchmark runs the reproducible benchmark on synthetic point clouds,
+    // without an input file, and prints one JSON record per line.  --cloud=
+    // uniform|clustered|duplicates selects one cloud (default all three),
+    // --size=N the number of tuples, --seed=N the seed, and --queries=N the
+    // number of queries of each kind; --threads, --builder, --bucket and
+    // --layout are as below.
+    if (argc > 1 && std::string(argv[1]) == "--benchmark") {
+        std::vector<KdBenchmarkCloud> clouds = {CLOUD_UNIFORM, CLOUD_CLUSTERED, CLOUD_DUPLICATES};
+        long numTuples = 1000000, numQueries = 10000, bucketSize = KD_DEFAULT_BUCKET_SIZE;
+        long numThreads = std::max((long) std::thread::hardware_concurrency(), 1L);
+        uint64_t seed = 12345;
+        KdBuilder builder = BUILD_PRESORT;
+        KdLayout layout = LAYOUT_INORDER;
+        for (int arg = 2; arg < argc; arg++) {
+            const std::string option(argv[arg]);
+            if (option == "--cloud=uniform") {clouds = {CLOUD_UNIFORM};}
+            else if (option == "--cloud=clustered") {clouds = {CLOUD_CLUSTERED};}
+            else if (option == "--cloud=duplicates") {clouds = {CLOUD_DUPLICATES};}
+            else if (option.compare(0, 7, "--size=") == 0) {numTuples = std::max(atol(option.c_str() + 7), 1L);}
+            else if (option.compare(0, 7, "--seed=") == 0) {seed = strtoull(option.c_str() + 7, NULL, 10);}
+            else if (option.compare(0, 10, "--queries=") == 0) {numQueries = std::max(atol(option.c_str() + 10), 1L);}
+            else if (option.compare(0, 10, "--threads=") == 0) {numThreads = std::max(atol(option.c_str() + 10), 1L);}
+            else if (option == "--builder=presort") {builder = BUILD_PRESORT;}
+            else if (option == "--builder=select") {builder = BUILD_SELECT;}
+            else if (option == "--builder=sampled") {builder = BUILD_SAMPLED;}
+            else if (option.compare(0, 9, "--bucket=") == 0) {bucketSize = atol(option.c_str() + 9);}
+            else if (option == "--layout=inorder") {layout = LAYOUT_INORDER;}
+            else if (option == "--layout=veb") {layout = LAYOUT_VEB;}
+            else if (option == "--layout=blocked") {layout = LAYOUT_BLOCKED;}
+            else if (option.compare(0, 10, "--kernels=") == 0) {kdKernels = selectKdKernels(option.substr(10));}
+        }
+        for (long c = 0; c < clouds.size(); c++) {
+            runBenchmark(clouds[c], numTuples, seed, numQueries, numThreads, builder, bucketSize, layout);
+        }
+        return 0;
+    }
+    std::string inputFile = argv[1];
+    
+    // --loader=stream reads the input with getline and istringstream;
+    // --loader=fast, the default, parses the mapped file
+    // on all threads.  A binary points file is always mapped directly, and
+    // --write-binary=FILE converts the input to one.  An index file that
+    // --save-index=FILE wrote is mapped instead of building the flat tree;
+    // --no-verify skips comparing its checksum.
+    // --query-file=FILE answers the queries of FILE, or of standard input for
+    // -, instead of prompting for them, and writes their results to
+    // --results=FILE, or to standard output for - (the default), as
+    // --format=csv|binary; --count-only writes the number of tuples that
+    // each query finds without the tuples.  The reports go to standard error
+    // while the results go to standard output.  --offset=N skips the first N
+    // tuples of each range query and --limit=N stops it after N, both in the
+    // results of --query-file and in those that SHOW prints.
+    bool streamLoader = false;
+    bool verifyIndex = true;
+    std::string binaryOutputFile;
+    std::string indexOutputFile;
+    std::string queryFile;
+    std::string resultsFile = "-";
+    KdResultFormat resultFormat = RESULTS_CSV;
+    bool countOnly = false;
+    long resultOffset = 0;
+    long resultLimit = LONG_MAX;
+    for (int arg = 2; arg < argc; arg++) {
+        const std::string option(argv[arg]);
+        if (option == "--loader=stream") {streamLoader = true;}
+        else if (option == "--loader=fast") {streamLoader = false;}
+        else if (option.compare(0, 15, "--write-binary=") == 0) {binaryOutputFile = option.substr(15);}
+        else if (option.compare(0, 13, "--save-index=") == 0) {indexOutputFile = option.substr(13);}
+        else if (option == "--no-verify") {verifyIndex = false;}
+        else if (option.compare(0, 13, "--query-file=") == 0) {queryFile = option.substr(13);}
+        else if (option.compare(0, 10, "--results=") == 0) {resultsFile = option.substr(10);}
+        else if (option == "--format=csv") {resultFormat = RESULTS_CSV;}
+        else if (option == "--format=binary") {resultFormat = RESULTS_BINARY;}
+        else if (option == "--count-only") {countOnly = true;}
+        else if (option.compare(0, 9, "--offset=") == 0) {resultOffset = std::max(atol(option.c_str() + 9), 0L);}
+        else if (option.compare(0, 8, "--limit=") == 0) {resultLimit = std::max(atol(option.c_str() + 8), 0L);}
+    }
+    if (!queryFile.empty() && resultsFile == "-") {
+        std::cout.rdbuf(std::cerr.rdbuf());
+    }
+    const bool indexInput = KdTree::isIndexFile(inputFile);
+    const long numberOfLoaderThreads = std::max((long) std::thread::hardware_concurrency(), 1L);
+    if (access(inputFile.c_str(), R_OK) != 0) {
+        std::cout << "Could not open " << inputFile << ": " << strerror(errno) << "\n";
+        return 1;
+    }
+    PointCloud cloud;
+    std::string loader;
+    const std::chrono::steady_clock::time_point BEGINNING_OF_INPUT_PROCEDURE = std::chrono::steady_clock::now();
+    if (indexInput) {
+        loader = "index file";
+    } else if (PointCloud::isBinary(inputFile)) {
+        loader = "binary mapping";
+        cloud = PointCloud::mapBinary(inputFile);
+    } else if (!streamLoader) {
+        loader = "fast text parser";
+        cloud = PointCloud::readText(inputFile, 3, numberOfLoaderThreads);
+    } else {
+        loader = "getline";
+        cloud = PointCloud::readStream(inputFile, 3);
+    }
+    if (!indexInput && cloud.dimensions() != 3) {
+        std::cout << "Could not read three-dimensional tuples from " << inputFile << "\n";
+        return 1;
+    }
+    float *inputCoordinates = cloud.coordinates();
+    const long numberOfTuples = cloud.size();
+    const double EXECUTION_OF_INPUT_PROCEDURE = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - BEGINNING_OF_INPUT_PROCEDURE).count(); // Report the execution time (in milliseconds).
+    std::cout << "\n" << "Execution time of input procedure in miliseconds:\t" << EXECUTION_OF_INPUT_PROCEDURE << " (" << loader << ")\n"; // Print out the time elapsed inputting the data.
+    if (!indexInput) {
+        std::cout << "Read " << numberOfTuples << " tuples (" << cloud.memoryUsage() / (1024. * 1024.) << "MB)\n";
+    }
+    if (!binaryOutputFile.empty() && !indexInput) {
+        PointCloud::writeBinary(binaryOutputFile, inputCoordinates, numberOfTuples, 3);
+    }
+    
+    // Select the tree layout: the flat tree is the default, and --tree=pointer
+    // builds the original tree of KdNode objects for comparison.  --k=N sets
+    // the number of nearest neighbours that Q2 finds in the flat tree,
+    // --threads=N the number of threads that build either tree,
+    // --builder=presort|select|sampled the method of finding each median,
+    // --bucket=N the largest leaf bucket of the flat tree and
+    // --kernels=scalar|avx2|avx512 the kernels that compare its buckets.
+    // --benchmark-buckets measures the flat tree for several bucket sizes.
+    // --layout=inorder|veb|blocked orders the nodes of the flat tree above
+    // its leaf buckets, and --benchmark-layouts compares the layouts.
+    // --benchmark-batch compares batched nearest-neighbour searches with
+    // searches one query at a time.
+    // --epsilon=E, --max-leaves=N and --max-nodes=N make Q2 of the flat tree
+    // an approximate best-bin-first search within 1 + E times the true
+    // distances, or stopped after N leaf buckets or nodes, which reports
+    // whether its result is provably exact; --benchmark-approximate measures
+    // its recall and latency for several tolerances and budgets.
+    // --check-allocations verifies that repeated searches of either tree
+    // allocate no memory once their result vectors and scratch have grown,
+    // and exits with status 1 if any does; it needs -DKD_CHECK_ALLOCATIONS.
+    // --aggregate precomputes the sums of the coordinates of the subtrees of the
+    // flat tree, so that Q3 sums those within its box in O(1) each;
+    // --benchmark-aggregate compares such range counts and sums with range
+    // searches that visit every tuple found, for several sizes of boxes.
+    // --benchmark-server measures the queries per second of a KdQueryServer
+    // that answers queries from several client threads on 1 to --threads workers.
+    // --join=FILE builds a second flat tree of the points of FILE and finds
+    // the pairs of tuples of the two trees within --radius=R of each other
+    // (default 1) and the nearest tuple of FILE to each input tuple within R,
+    // then exits; --benchmark-join compares those with searches of the second
+    // tree for each input tuple.
+    // --quantize=16|21 compresses the flat tree to 16- or 21-bit codes per
+    // axis, compares it with the flat tree, then queries only the compressed
+    // tree, which refines its results from the input tuples.
+    bool pointerTree = false;
+    bool benchmarkBuckets = false;
+    bool benchmarkLayouts = false;
+    bool benchmarkBatch = false;
+    bool benchmarkJoins = false;
+    bool benchmarkApproximate = false;
+    bool allocationCheck = false;
+    bool benchmarkServer = false;
+    bool aggregateSums = false;
+    bool benchmarkAggregates = false;
+    KdApproximation approximation;
+    std::string joinFile;
+    float joinRadius = 1;
+    long numberOfNeighbours = 1;
+    long numberOfThreads = std::max((long) std::thread::hardware_concurrency(), 1L);
+    long bucketSize = KD_DEFAULT_BUCKET_SIZE;
+    long quantizeBits = 0;
+    KdBuilder builder = BUILD_PRESORT;
+    KdLayout layout = LAYOUT_INORDER;
+    for (int arg = 2; arg < argc; arg++) {
+        const std::string option(argv[arg]);
+        if (option == "--tree=pointer") {pointerTree = true;}
+        else if (option.compare(0, 10, "--threads=") == 0) {numberOfThreads = std::max(atol(option.c_str() + 10), 1L);}
+        else if (option == "--builder=presort") {builder = BUILD_PRESORT;}
+        else if (option == "--builder=select") {builder = BUILD_SELECT;}
+        else if (option == "--builder=sampled") {builder = BUILD_SAMPLED;}
+        else if (option.compare(0, 4, "--k=") == 0) {numberOfNeighbours = std::max(atol(option.c_str() + 4), 1L);}
+        else if (option.compare(0, 9, "--bucket=") == 0) {bucketSize = atol(option.c_str() + 9);}
+        else if (option.compare(0, 10, "--kernels=") == 0) {kdKernels = selectKdKernels(option.substr(10));}
+        else if (option == "--benchmark-buckets") {benchmarkBuckets = true;}
+        else if (option == "--layout=inorder") {layout = LAYOUT_INORDER;}
+        else if (option == "--layout=veb") {layout = LAYOUT_VEB;}
+        else if (option == "--layout=blocked") {layout = LAYOUT_BLOCKED;}
+        else if (option == "--benchmark-layouts") {benchmarkLayouts = true;}
+        else if (option == "--benchmark-batch") {benchmarkBatch = true;}
+        else if (option.compare(0, 10, "--epsilon=") == 0) {approximation.epsilon = std::max((float) atof(option.c_str() + 10), 0.f);}
+        else if (option.compare(0, 13, "--max-leaves=") == 0) {approximation.maxLeaves = std::max(atol(option.c_str() + 13), 0L);}
+        else if (option.compare(0, 12, "--max-nodes=") == 0) {approximation.maxNodes = std::max(atol(option.c_str() + 12), 0L);}
+        else if (option == "--benchmark-approximate") {benchmarkApproximate = true;}
+        else if (option == "--check-allocations") {allocationCheck = true;}
+        else if (option == "--benchmark-server") {benchmarkServer = true;}
+        else if (option == "--aggregate") {aggregateSums = true;}
+        else if (option == "--benchmark-aggregate") {benchmarkAggregates = true;}
+        else if (option.compare(0, 7, "--join=") == 0) {joinFile = option.substr(7);}
+        else if (option.compare(0, 9, "--radius=") == 0) {joinRadius = std::max((float) atof(option.c_str() + 9), 0.f);}
+        else if (option == "--benchmark-join") {benchmarkJoins = true;}
+        else if (option == "--quantize=16") {quantizeBits = 16;}
+        else if (option == "--quantize=21") {quantizeBits = 21;}
+    }
+    if (indexInput && (pointerTree || quantizeBits > 0)) {
+        std::cout << "An index file holds the flat tree, so --tree=pointer and --quantize need the input tuples\n";
+        return 1;
+    }
+    if ((pointerTree || quantizeBits > 0) && !joinFile.empty()) {
+        std::cout << "--join needs the flat tree\n";
+        return 1;
+    }
+    if (pointerTree && !queryFile.empty()) {
+        std::cout << "--query-file needs the flat or the compressed tree\n";
+        return 1;
+    }
+    const bool approximate = approximation.epsilon > 0 || approximation.maxLeaves > 0 || approximation.maxNodes > 0;
+    if (approximate && (pointerTree || quantizeBits > 0 || !queryFile.empty())) {
+        std::cout << "--epsilon, --max-leaves and --max-nodes apply to the interactive Q2 of the flat tree\n";
+        return 1;
+    }
+    if (aggregateSums && (pointerTree || quantizeBits > 0)) {
+        std::cout << "--aggregate applies to the flat tree\n";
+        return 1;
+    }
+    if (pointerTree && numberOfTuples == 0) {
+        std::cout << "The pointer tree needs at least one tuple\n";
+        return 1;
+    }
+    if (pointerTree && numberOfTuples > KD_MAX_NODES) {
+        std::cout << "The pointer tree holds at most " << KD_MAX_NODES << " tuples\n";
+        return 1;
+    }
+    std::vector<KdNeighbour> neighbours;
+    KdNode::Arena arena;
+    const KdNode *root = nullptr;
+    KdTree kdTree;
+    QuantizedKdTree quantized;
+    size_t referenceBytes = 0;
+    if (indexInput) {
+        const std::chrono::steady_clock::time_point BEGINNING_OF_LOAD_PROCEDURE = std::chrono::steady_clock::now();
+        const std::string error = KdTree::load(inputFile, kdTree, verifyIndex);
+        const double EXECUTION_TIME_OF_LOAD_PROCEDURE = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - BEGINNING_OF_LOAD_PROCEDURE).count();
+        if (!error.empty()) {
+            std::cout << "Could not load " << inputFile << ": " << error << "\n";
+            return 1;
+        }
+        if (kdTree.dimensions() != 3) {
+            std::cout << "Could not read three-dimensional tuples from " << inputFile << "\n";
+            return 1;
+        }
+        std::cout << "\n" << "Execution time of index load procedure in miliseconds:\t" << EXECUTION_TIME_OF_LOAD_PROCEDURE
+        << (verifyIndex ? " (checksum verified)" : " (checksum not verified)") << "\n";
+        if (bucketSize != kdTree.getBucketSize() && bucketSize != KD_DEFAULT_BUCKET_SIZE) {
+            std::cout << "The index file was saved with leaf buckets of up to " << kdTree.getBucketSize() << " tuples\n";
+        }
+        if (layout != kdTree.getLayout() && layout != LAYOUT_INORDER) {
+            std::cout << "The index file was saved with the " << KD_LAYOUT_NAMES[kdTree.getLayout()] << " layout\n";
+        }
+    }
+    // The build is timed by the wall clock because clock() sums the CPU time of all threads.
+    const std::chrono::steady_clock::time_point BEGINNING_OF_BUILD_PROCEDURE = std::chrono::steady_clock::now(); // Mark the beginning of the building procedure.
+    if (pointerTree) {
+        
+        // The two-dimensional array is indexed by
+        // a vector<long*> in order to pass it as a function argument.
+        // The array is not copied to a vector< vector<long> > because,
+        // for efficiency, assignments in the initializeReference,
+        // mergeSort and buildKdTree functions copy only the long*
+        // pointer instead of all elements of a vector<long>.
+        std::vector<float *> coordinateVector(numberOfTuples);
+        for (long i = 0; i < coordinateVector.size(); ++i) {
+            coordinateVector.at(i) = inputCoordinates + 3 * i;
+        }
+        root = KdNode::createKdTree(arena, coordinateVector, 3, numberOfThreads, builder, &referenceBytes);
+        referenceBytes += coordinateVector.capacity() * sizeof(float *);
+    } else if (!indexInput) {
+        const std::string error = KdTree::checkInput(numberOfTuples, 3);
+        if (!error.empty()) {
+            std::cout << "Could not build the flat tree: " << error << "\n";
+            return 1;
+        }
+        kdTree = KdTree::createKdTree(inputCoordinates, numberOfTuples, 3, numberOfThreads, builder, bucketSize, layout,
+                                      &referenceBytes);
+        
+        // The flat tree holds its own copy of the tuples, so the input is no longer needed
+        // unless the compressed tree refines its results from it.
+        if (quantizeBits == 0) {
+            cloud = PointCloud();
+        }
+    }
+    if (!indexInput) {
+        const double EXECUTION_TIME_OF_BUILD_PROCEDURE = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - BEGINNING_OF_BUILD_PROCEDURE).count(); // Report the execution time (in milliseconds).
+        std::cout << "\n" << "Execution time of build procedure in miliseconds:\t" << EXECUTION_TIME_OF_BUILD_PROCEDURE << "\n"; // Print out the time elapsed building.
+#ifdef KD_TRACE
+        kdBuildTrace.print(std::cout);
+#endif
+    }
+#ifdef KD_TRACE
+    if (pointerTree) {
+        KdTreeShape shape;
+        root->getShape(shape);
+        shape.print(std::cout, "Tree shape");
+    } else {
+        kdTree.getShape().print(std::cout, "Tree shape");
+    }
+#endif
+    if (!indexOutputFile.empty() && !pointerTree) {
+        const std::chrono::steady_clock::time_point BEGINNING_OF_SAVE_PROCEDURE = std::chrono::steady_clock::now();
+        if (!kdTree.save(indexOutputFile)) {
+            std::cout << "Could not write " << indexOutputFile << "\n";
+            return 1;
+        }
+        std::cout << "Execution time of index save procedure in miliseconds:\t"
+        << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - BEGINNING_OF_SAVE_PROCEDURE).count() << "\n";
+    }
+    if (!indexInput) {
+        std::cout << "Reference arrays during the build: " << referenceBytes / (1024. * 1024.) << "MB\n";
+    }
+    if (pointerTree) {
+        
+        // The nodes refer to the input tuples, which must stay in memory as long as the tree.
+        const long numberOfNodes = root->countNodes();
+        std::cout << "Index size: " << root->memoryUsage() / (1024. * 1024.) << "MB for " << numberOfNodes << " nodes ("
+        << sizeof(KdNode) << " bytes per node) plus " << cloud.memoryUsage() / (1024. * 1024.) << "MB of borrowed tuples ("
+        << (double) (root->memoryUsage() + cloud.memoryUsage()) / std::max(numberOfNodes, 1L) << " bytes per point)\n";
+    } else {
+        std::cout << "Index size: " << kdTree.memoryUsage() / (1024. * 1024.) << "MB ("
+        << (double) kdTree.memoryUsage() / std::max(kdTree.size(), 1L) << " bytes per point)\n";
+        std::cout << "Leaf buckets of up to " << kdTree.getBucketSize() << " tuples, " << kdKernels->name << " kernels, "
+        << KD_LAYOUT_NAMES[kdTree.getLayout()] << " layout\n";
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    std::cout << "Peak resident set size: " << usage.ru_maxrss / 1024. << "MB\n"; // ru_maxrss is in kilobytes.
+    if (benchmarkBuckets && !pointerTree) {
+        benchmarkBucketSizes(kdTree, 100000);
+        return 0;
+    }
+    if (benchmarkLayouts && !pointerTree) {
+        benchmarkNodeLayouts(kdTree, 100000);
+        return 0;
+    }
+    if (benchmarkBatch && !pointerTree) {
+        benchmarkBatchKnn(kdTree, 100000, numberOfThreads);
+        return 0;
+    }
+    if (benchmarkApproximate && !pointerTree) {
+        benchmarkApproximateKnn(kdTree, 10000, numberOfNeighbours);
+        return 0;
+    }
+    if (benchmarkAggregates && !pointerTree) {
+        benchmarkRangeAggregates(kdTree, 1000);
+        return 0;
+    }
+    if (benchmarkServer && !pointerTree) {
+        benchmarkQueryServer(kdTree, 100000, numberOfThreads);
+        return 0;
+    }
+    if (allocationCheck && !pointerTree) {
+        return checkAllocations(kdTree, 10000, numberOfNeighbours) ? 0 : 1;
+    }
+    if (!joinFile.empty()) {
+        if (access(joinFile.c_str(), R_OK) != 0) {
+            std::cout << "Could not open " << joinFile << ": " << strerror(errno) << "\n";
+            return 1;
+        }
+        const std::chrono::steady_clock::time_point BEGINNING_OF_JOIN_BUILD = std::chrono::steady_clock::now();
+        PointCloud joinCloud = PointCloud::isBinary(joinFile) ? PointCloud::mapBinary(joinFile)
+                                                               : PointCloud::readText(joinFile, 3, numberOfLoaderThreads);
+        if (joinCloud.dimensions() != 3) {
+            std::cout << "Could not read three-dimensional tuples from " << joinFile << "\n";
+            return 1;
+        }
+        const std::string error = KdTree::checkInput(joinCloud.size(), 3);
+        if (!error.empty()) {
+            std::cout << "Could not build the flat tree of " << joinFile << ": " << error << "\n";
+            return 1;
+        }
+        const KdTree other = KdTree::createKdTree(joinCloud.coordinates(), joinCloud.size(), 3, numberOfThreads, builder,
+                                                  bucketSize, layout);
+        joinCloud = PointCloud();
+        std::cout << "Execution time of input and build procedure of " << joinFile << " in miliseconds:\t"
+        << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - BEGINNING_OF_JOIN_BUILD).count()
+        << " (" << other.size() << " tuples)\n";
+        if (benchmarkJoins) {
+            benchmarkJoin(kdTree, other, joinRadius, numberOfThreads);
+            return 0;
+        }
+        std::vector<KdPairCountSink> sinks(numberOfThreads);
+        std::vector<KdTraceSummary> joinTraces(numberOfThreads), nearestTraces(numberOfThreads);
+        const std::chrono::steady_clock::time_point BEGINNING_OF_JOIN_PROCEDURE = std::chrono::steady_clock::now();
+        kdTree.joinWithin(other, joinRadius, sinks, numberOfThreads, joinTraces.data());
+        unsigned long pairs = 0;
+        for (long i = 0; i < sinks.size(); i++) {
+            pairs += sinks[i].count;
+        }
+        const std::chrono::steady_clock::time_point BEGINNING_OF_NEAREST_PROCEDURE = std::chrono::steady_clock::now();
+        const std::vector<KdNeighbour> nearest = kdTree.nearestWithin(other, joinRadius, numberOfThreads, nearestTraces.data());
+        const std::chrono::steady_clock::time_point END_OF_NEAREST_PROCEDURE = std::chrono::steady_clock::now();
+        long matched = 0;
+        for (long i = 0; i < nearest.size(); i++) {
+            matched += (nearest[i].position >= 0);
+        }
+        std::cout << "\n" << "Execution time of join procedure in miliseconds:\t"
+        << std::chrono::duration<double, std::milli>(BEGINNING_OF_NEAREST_PROCEDURE - BEGINNING_OF_JOIN_PROCEDURE).count() << "\n";
+        std::cout << "Number of pairs within " << joinRadius << ": " << pairs << "\n";
+        std::cout << "Execution time of nearest-match procedure in miliseconds:\t"
+        << std::chrono::duration<double, std::milli>(END_OF_NEAREST_PROCEDURE - BEGINNING_OF_NEAREST_PROCEDURE).count() << "\n";
+        std::cout << "Number of tuples with a tuple of " << joinFile << " within " << joinRadius << ": " << matched << "\n";
+        for (long t = 1; t < numberOfThreads; t++) {
+            joinTraces[0].merge(joinTraces[t]);
+            nearestTraces[0].merge(nearestTraces[t]);
+        }
+        joinTraces[0].print(std::cout, "Join groups");
+        nearestTraces[0].print(std::cout, "Nearest-match groups");
+        return 0;
+    }
+    if (quantizeBits > 0 && !pointerTree) {
+        quantized = QuantizedKdTree::createKdTree(kdTree, inputCoordinates, quantizeBits, numberOfThreads);
+        benchmarkQuantized(kdTree, quantized, 100000);
+        kdTree = KdTree();
+        std::cout << "Compressed index size: " << quantized.memoryUsage() / (1024. * 1024.) << "MB ("
+        << (double) quantized.memoryUsage() / std::max(quantized.size(), 1L) << " bytes per point, "
+        << quantized.getBits() << "-bit codes), including " << quantized.borrowedMemoryUsage() / (1024. * 1024.)
+        << "MB of borrowed original tuples\n";
+    }
+    const bool quantizedTree = quantized.size() > 0;
+    if (aggregateSums) {
+        const std::chrono::steady_clock::time_point BEGINNING_OF_SUMS_PROCEDURE = std::chrono::steady_clock::now();
+        kdTree.createSums();
+        std::cout << "Execution time of subtree sums procedure in miliseconds:\t"
+        << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - BEGINNING_OF_SUMS_PROCEDURE).count()
+        << " (index size " << kdTree.memoryUsage() / (1024. * 1024.) << "MB)\n";
+    }
+    if (!queryFile.empty()) {
+        std::ifstream queryStream;
+        if (queryFile != "-") {
+            queryStream.open(queryFile.c_str());
+            if (!queryStream) {
+                std::cout << "Could not read " << queryFile << "\n";
+                return 1;
+            }
+        }
+        BufferedWriter results;
+        if (!results.open(resultsFile)) {
+            std::cout << "Could not write " << resultsFile << "\n";
+            return 1;
+        }
+        std::istream& input = (queryFile == "-") ? std::cin : queryStream;
+        const std::chrono::steady_clock::time_point BEGINNING_OF_QUERY_PROCEDURE = std::chrono::steady_clock::now();
+        const KdQueryFileStats stats = quantizedTree
+        ? answerQueryFile(quantized, input, results, resultFormat, countOnly, resultOffset, resultLimit,
+                          numberOfNeighbours, numberOfThreads)
+        : answerQueryFile(kdTree, input, results, resultFormat, countOnly, resultOffset, resultLimit,
+                          numberOfNeighbours, numberOfThreads);
+        const size_t bytes = results.bytesWritten();
+        const bool written = results.close();
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - BEGINNING_OF_QUERY_PROCEDURE).count();
+        if (!written) {
+            std::cout << "Could not write " << resultsFile << "\n";
+            return 1;
+        }
+        std::cout << "\n" << "Answered " << stats.queries << " queries on " << numberOfThreads << " threads in "
+        << seconds * 1000 << " miliseconds (" << stats.queries / seconds << " queries/s), found "
+        << stats.tuples << " tuples and wrote " << bytes / (1024. * 1024.) << "MB ("
+        << bytes / (1024. * 1024.) / seconds << "MB/s)\n";
+        if (stats.malformed > 0) {
+            std::cout << "Skipped " << stats.malformed << " malformed lines, the first at line " << stats.firstMalformedLine << "\n";
+        }
+        stats.rangeTraces.print(std::cout, "Range queries");
+        stats.nearestTraces.print(std::cout, "Nearest-neighbour queries");
+        return 0;
+    }
+    KdTraceSummary rangeTraces, nearestTraces;
+    std::vector<const float *> kdList;
+    
+    // The bounding box of the pointer tree is the cell of its root, from which rangeCount starts.
+    float rootLower[3], rootUpper[3];
+    if (pointerTree) {
+        root->getBounds(3, rootLower, rootUpper);
+    }
+    bool more = true;
+    while(more)
+    {
+        std::string input;
+        std::cout << "Do please indicate your query type, i.e., Q1 and its related parameters (i.e., x1, x2, y1, y2, z1, and z2) for range search, or Q2 and its related parameters (i.e., x1, y1, and z1) for nearest neighbour(s) search, or Q3 and the parameters of Q1 for the number, sums and centroid of the tuples in a range... You can also type QUIT to terminate this program...: " << std::endl;
+        std::cin >> input;
+        
+        if (input == "QUIT") {more = false;}
+        else if (input == "Q2")
+        {
+            float x1;
+            float y1;
+            float z1;
+            std::cout << "Do please enter a coordinate in the format [x1 y1 z1] in order for its nearest neighbours to be found!..." << std::endl;
+            std::cin >> x1 >> y1 >> z1;
+            /* Search the k-d tree for the k-d nodes that lie within the cutoff distance. */
+            float query[3];
+            query[0] = x1;
+            query[1] = y1;
+            query[2] = z1;
+            const clock_t BEGINNING_OF_SEARCH_PROCEDURE = clock(); // Mark the beginning of the execution of the searching procedure.
+            if (pointerTree) {
+                {
+                    KdTraceScope trace(nearestTraces);
+                    root->searchKdTree(query, SEARCH_DISTANCE, 3, 0, kdList);
+                }
+                const double EXECUTION_TIME_OF_SEARCH_PROCEDURE = (double)(clock() - BEGINNING_OF_SEARCH_PROCEDURE) / CLOCKS_PER_SEC * 1000; // Report the execution time (in seconds).
+                std::cout << "\n" << "Execution time of search procedure in miliseconds:\t" << EXECUTION_TIME_OF_SEARCH_PROCEDURE << "\n"; // Print out the time elapsed sorting.
+                std::cout << std::endl << kdList.size() << " nodes within " << SEARCH_DISTANCE << " units of ";
+                KdNode::printTuple(query, 3);
+                std::cout << " in all dimensions." << std::endl << std::endl;
+                if (kdList.size() != 0) {
+                    std::cout << "List of k-d nodes within " << SEARCH_DISTANCE << "-unit search distance follows:" << std::endl << std::endl;
+                    for (long i = 0; i < kdList.size(); i++) {
+                        KdNode::printTuple(kdList[i], 3);
+                        std::cout << " ";
+                    }
+                    std::cout << std::endl << std::endl;
+                }
+            } else {
+                bool exact = true;
+                {
+                    KdTraceScope trace(nearestTraces);
+                    if (quantizedTree) {
+                        quantized.knn(query, numberOfNeighbours, neighbours);
+                    } else if (approximate) {
+                        exact = kdTree.knnApproximate(query, numberOfNeighbours, approximation, neighbours);
+                    } else {
+                        kdTree.knn(query, numberOfNeighbours, neighbours);
+                    }
+                }
+                const double EXECUTION_TIME_OF_SEARCH_PROCEDURE = (double)(clock() - BEGINNING_OF_SEARCH_PROCEDURE) / CLOCKS_PER_SEC * 1000; // Report the execution time (in seconds).
+                std::cout << "\n" << "Execution time of search procedure in miliseconds:\t" << EXECUTION_TIME_OF_SEARCH_PROCEDURE << "\n"; // Print out the time elapsed searching.
+                std::cout << std::endl << neighbours.size() << " nearest neighbour(s) of ";
+                KdNode::printTuple(query, 3);
+                std::cout << " follow" << (!approximate ? "" : exact ? " (provably exact)" : " (approximate)") << ":" << std::endl << std::endl;
+                for (long i = 0; i < neighbours.size(); i++) {
+                    float tuple[3];
+                    if (quantizedTree) {
+                        quantized.getTuple(neighbours[i].position, tuple);
+                    } else {
+                        kdTree.getTuple(neighbours[i].position, tuple);
+                    }
+                    const long index = quantizedTree ? quantized.getIndex(neighbours[i].position) : kdTree.getIndex(neighbours[i].position);
+                    KdNode::printTuple(tuple, 3);
+                    std::cout << " at distance " << sqrt(neighbours[i].distance) << " (tuple " << index << ")" << std::endl;
+                }
+                std::cout << std::endl;
+            }
+            continue;
+        }
         else if (input == "Q1")
         {
             float x1;
@@ -559,21 +7901,135 @@ int main(int argc, const char * argv[]) {
             rightAbovePoint[0] = x2;
             rightAbovePoint[1] = y2;
             rightAbovePoint[2] = z2;
+            // Ask whether to show the tuples before searching, so that a single
+            // search counts them and, for SHOW, prints those from --offset up to
+            // --limit through a buffered writer as they are found.
+            std::cout << "If you do want to observe the returned tuples, do please type [SHOW]!: " << std::endl;
+            std::string input2;
+            std::cin >> input2;
+            const bool show = (input2 == "SHOW");
+            BufferedWriter shown;
+            if (show) {
+                std::cout.flush();
+                shown.open("-");
+            }
+            auto print = [&shown](const float *tuple) {
+                char line[64];
+                const int length = snprintf(line, sizeof(line), "%.7g, %.7g, %.7g\n", tuple[0], tuple[1], tuple[2]);
+                shown.write(line, length);
+            };
             // Initialize attributes
             numberOfReturnedTuples = 0;
             numberOfVisitedNodes = 0;
             const clock_t BEGINNING_OF_RANGE_SEARCH_PROCEDURE = clock();
-            root -> rangeSearchNOSHOW(3, 0);
+            KdBox box;
+            std::copy(leftBottomPoint, leftBottomPoint + 3, box.lower);
+            std::copy(rightAbovePoint, rightAbovePoint + 3, box.upper);
+            {
+                KdTraceScope trace(rangeTraces);
+                if (pointerTree && !show) {
+                    
+                    // Subtrees that lie within the box are counted without being visited.
+                    float cellLower[3], cellUpper[3];
+                    std::copy(rootLower, rootLower + 3, cellLower);
+                    std::copy(rootUpper, rootUpper + 3, cellUpper);
+                    numberOfReturnedTuples = root->rangeCount(box.lower, box.upper, cellLower, cellUpper, 3, 0,
+                                                              numberOfVisitedNodes);
+                } else if (pointerTree) {
+                    long seen = 0;
+                    auto found = [&](const float *tuple) {
+                        if (seen >= resultOffset && seen - resultOffset < resultLimit) {
+                            print(tuple);
+                        }
+                        seen++;
+                    };
+                    root->rangeSearch(3, 0, found);
+                } else {
+                    KdRangeStats stats;
+                    if (show && !quantizedTree) {
+                        
+                        // The cursor passes over the tuples before the offset and after the
+                        // limit without reading the subtrees that lie within the box.
+                        KdTree::RangeCursor cursor(kdTree, box);
+                        long positions[KD_RANGE_CHUNK_SIZE];
+                        numberOfReturnedTuples = cursor.skip(resultOffset);
+                        for (long n = 1, printed = 0; n > 0 && printed < resultLimit; printed += n) {
+                            n = cursor.next(positions, std::min(resultLimit - printed, (long) KD_RANGE_CHUNK_SIZE));
+                            for (long i = 0; i < n; i++) {
+                                float tuple[3];
+                                kdTree.getTuple(positions[i], tuple);
+                                print(tuple);
+                            }
+                            numberOfReturnedTuples += n;
+                        }
+                        numberOfReturnedTuples += cursor.skip(LONG_MAX);
+                        stats = cursor.getStats();
+                    } else if (show) {
+                        long seen = 0;
+                        auto sink = makeCallbackSink([&](const long position) {
+                            if (seen >= resultOffset && seen - resultOffset < resultLimit) {
+                                float tuple[3];
+                                quantized.getTuple(position, tuple);
+                                print(tuple);
+                            }
+                            seen++;
+                        });
+                        quantized.rangeSearch(box, sink, stats);
+                        numberOfReturnedTuples = seen;
+                    } else {
+                        KdCountSink sink;
+                        if (quantizedTree) {
+                            quantized.rangeSearch(box, sink, stats);
+                        } else {
+                            kdTree.rangeSearch(box, sink, stats);
+                        }
+                        numberOfReturnedTuples = sink.count;
+                    }
+                    numberOfVisitedNodes = stats.visitedNodes;
+                    numberOfBulkAcceptedSubtrees = stats.bulkAcceptedSubtrees;
+                    numberOfBulkAcceptedTuples = stats.bulkAcceptedTuples;
+                    numberOfRefinedTuples = stats.refinedTuples;
+                }
+            }
+            shown.close();
             const double EXECUTION_TIME_OF_RANGE_SEARCH_PROCEDURE = (double)(clock() - BEGINNING_OF_RANGE_SEARCH_PROCEDURE) / CLOCKS_PER_SEC * 1000; // Report the execution time (in minutes).
-            std::cout << "\n" << "Execution time of range search procedure in miliseconds:\t" << EXECUTION_TIME_OF_RANGE_SEARCH_PROCEDURE << "\n"; // Print out the time elapsed sorting.
+            std::cout << "\n" << "Execution time of range search procedure in miliseconds:\t" << EXECUTION_TIME_OF_RANGE_SEARCH_PROCEDURE
+            << (show ? " (including the output)" : "") << "\n"; // Print out the time elapsed sorting.
             std::cout << "Number of returned tuples: " << numberOfReturnedTuples << "\n";
             std::cout << "Number of visited nodes: " << numberOfVisitedNodes << "\n";
-            std::cout << "If you do want to observe the returned tuples, do please type [SHOW]!: " << std::endl;
-            std::string input2;
-            std::cin >> input2;
-            if (input2 == "SHOW") {root->rangeSearch(3, 0);}
-            else {
+            if (quantizedTree) {
+                std::cout << "Number of refined tuples: " << numberOfRefinedTuples << "\n";
+            } else if (!pointerTree) {
+                std::cout << "Number of bulk-accepted subtrees: " << numberOfBulkAcceptedSubtrees
+                << " (" << numberOfBulkAcceptedTuples << " tuples)\n";
+            }
+            continue;
+        }
+        else if (input == "Q3")
+        {
+            KdBox box;
+            std::cout << "Do please enter the range coordinates in the format [x1 y1 z1 x2 y2 z2] in order for the number, the sums and the centroid of the concerned tuples to be found!" << std::endl;
+            std::cin >> box.lower[0] >> box.upper[0] >> box.lower[1] >> box.upper[1] >> box.lower[2] >> box.upper[2];
+            if (pointerTree || quantizedTree) {
+                std::cout << "Q3 needs the flat tree\n";
+                continue;
+            }
+            KdAggregate aggregate;
+            KdRangeStats stats;
+            const clock_t BEGINNING_OF_AGGREGATE_PROCEDURE = clock();
+            {
+                KdTraceScope trace(rangeTraces);
+                kdTree.rangeAggregate(box, aggregate, stats);
             }
+            const double EXECUTION_TIME_OF_AGGREGATE_PROCEDURE = (double)(clock() - BEGINNING_OF_AGGREGATE_PROCEDURE) / CLOCKS_PER_SEC * 1000;
+            std::cout << "\n" << "Execution time of aggregate procedure in miliseconds:\t" << EXECUTION_TIME_OF_AGGREGATE_PROCEDURE
+            << (kdTree.hasSums() ? "" : " (without --aggregate, the subtrees are summed tuple by tuple)") << "\n";
+            std::cout << "Number of returned tuples: " << aggregate.count << "\n";
+            std::cout << "Sums of the coordinates: (" << aggregate.sum[0] << ", " << aggregate.sum[1] << ", " << aggregate.sum[2] << ")\n";
+            std::cout << "Centroid: (" << aggregate.centroid(0) << ", " << aggregate.centroid(1) << ", " << aggregate.centroid(2) << ")\n";
+            std::cout << "Number of visited nodes: " << stats.visitedNodes << "\n";
+            std::cout << "Number of bulk-accepted subtrees: " << stats.bulkAcceptedSubtrees
+            << " (" << stats.bulkAcceptedTuples << " tuples)\n";
             continue;
         }
         else
@@ -582,4 +8038,6 @@ int main(int argc, const char * argv[]) {
             continue;
         }
     }
+    rangeTraces.print(std::cout, "Range queries");
+    nearestTraces.print(std::cout, "Nearest-neighbour queries");
 }